@@ -6,9 +6,9 @@ macro (build_zbtunnel SRC_DIR BINARY_DIR BUILD_EXECUTABLE FIND_BOOST)
 	set(Boost_USE_STATIC_LIBS TRUE)
 	set(Boost_USE_STATIC_RUNTIME TRUE)
 	set(Boost_USE_MULTITHREADED TRUE)
-	find_package(Boost 1.47.0 COMPONENTS system thread)
+	find_package(Boost 1.47.0 COMPONENTS system thread chrono)
 	if (NOT Boost_FOUND)
-	find_package(Boost REQUIRED COMPONENTS system thread)
+	find_package(Boost REQUIRED COMPONENTS system thread chrono)
 	endif ()
 	endif ()
 
@@ -36,7 +36,7 @@ macro (build_zbtunnel SRC_DIR BINARY_DIR BUILD_EXECUTABLE FIND_BOOST)
         if (MSVC)
             set(CMAKE_CXX_FLAGS_DEBUG "${CMAKE_CXX_FLAGS_DEBUG} /DDEBUG /D_DEBUG")
         else ()
-            set(CMAKE_CXX_FLAGS_DEBUG "${CMAKE_CXX_FLAGS_DEBUG} -D DEBUG -D _DEBUG")
+            set(CMAKE_CXX_FLAGS_DEBUG "${CMAKE_CXX_FLAGS_DEBUG} -D DEBUG -D _DEBUG -D _GLIBCXX_ASSERTIONS")
         endif ()
 
 	file (GLOB DLL RELATIVE ${CMAKE_CURRENT_SOURCE_DIR}
@@ -49,7 +49,12 @@ macro (build_zbtunnel SRC_DIR BINARY_DIR BUILD_EXECUTABLE FIND_BOOST)
 	configure_file("${SRC_DIR}/zbtunnel/zbconfig_inc.hpp.in" "${BINARY_DIR}/gen/zbtunnel/zbconfig_inc.hpp")
 	source_group(GENERATED FILES "${BINARY_DIR}/gen/zbtunnel/zbconfig_inc.hpp")
 		
-	list(REMOVE_ITEM DLL "${SRC_DIR}/zbtunnel/main.cpp")
+	# The entry points of the executables, the glob gives them relative to the source dir
+	foreach (ITEM ${DLL})
+		if (ITEM MATCHES "zbtunnel/(test_)?main\\.cpp$")
+			list(REMOVE_ITEM DLL ${ITEM})
+		endif ()
+	endforeach ()
 
 	include_directories("${SRC_DIR}")
 	include_directories("${BINARY_DIR}/gen")
@@ -76,6 +81,10 @@ macro (build_zbtunnel SRC_DIR BINARY_DIR BUILD_EXECUTABLE FIND_BOOST)
 	set_target_properties(zbtunnel PROPERTIES 
 		OUTPUTNAME "zbtunnel" 
 		)
+
+	add_executable(zbtunnel_test "${SRC_DIR}/zbtunnel/test_main.cpp")
+	add_dependencies(zbtunnel_test zbtunnel_lib)
+	target_link_libraries(zbtunnel_test zbtunnel_lib ${Boost_LIBRARIES})
 	endif ()
 		
 endmacro (build_zbtunnel)
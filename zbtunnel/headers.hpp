@@ -35,6 +35,17 @@
 #define BOOST_ASIO_DISABLE_EPOLL
 #endif
 
+#ifdef __linux__
+#define ZB_HAS_SPLICE
+#ifdef WITH_OPENSSL
+#include <openssl/opensslv.h>
+// The TLS 1.2 key block is derived with the PRF and the cipher digests of openssl 1.1.1
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+#define ZB_HAS_KTLS
+#endif
+#endif
+#endif
+
 #if defined(__CYGWIN__) || defined(WIN32)
 #  define _WIN32_WINNT 0x0501 
 #endif 
@@ -59,6 +70,21 @@
 #include <unistd.h>
 #endif
 
+#ifdef ZB_HAS_SPLICE
+#include <fcntl.h>
+#endif
+
+#ifdef ZB_HAS_KTLS
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#endif
+
 #include <string>
 #include <stdint.h>
 #include <iostream>
@@ -67,6 +93,9 @@
 #include <set>
 #include <map>
 #include <vector>
+#include <deque>
+#include <algorithm>
+#include <limits>
 
 using boost::asio::ip::tcp;
 using boost::asio::io_service;
@@ -89,5 +118,6 @@ namespace zb {
 	namespace tunnel {
 		typedef std::map<std::string,std::string> config_type;
 		typedef std::vector<config_type> chain_config_type;
+		typedef boost::shared_ptr<const chain_config_type> chain_ptr;
 	}
 }
\ No newline at end of file
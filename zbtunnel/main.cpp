@@ -29,11 +29,15 @@ namespace zb {
 			boost::thread_group tg_;
 			tunnel_map tunnels_;
 			io_service service_;
+			// Event loops shared by all socket tunnels when io_threads is set, one thread each
+			vector<shared_ptr<io_service> > loops_;
+			vector<shared_ptr<io_service::work> > loop_works_;
+			size_t next_loop_;
 			boost::asio::signal_set signals_;
 			std::ostream *out_, *err_;
 
 		public:
-			ZbTunnelMain():signals_(service_) {}
+			ZbTunnelMain():next_loop_(0), signals_(service_) {}
 
 			int run(int argc, char **argv) {
 				out_ = &std::cout;
@@ -85,6 +89,21 @@ namespace zb {
 							gconf.log_level((ZbConfig::log_level_type)global.get("log_level", (int)gconf.log_level()));
 							gconf.recycle(global.get<bool>("recycle", gconf.recycle()));
 							gconf.preconnect(global.get("preconnect", (int)gconf.preconnect()));
+							gconf.idle_timeout(global.get("idle_timeout", gconf.idle_timeout()));
+							gconf.min_idle(global.get("min_idle", gconf.min_idle()));
+							gconf.max_idle(global.get("max_idle", gconf.max_idle()));
+							gconf.adaptive_preconnect(global.get<bool>("adaptive_preconnect", gconf.adaptive_preconnect()));
+							gconf.threads(global.get("threads", gconf.threads()));
+							gconf.io_threads(global.get("io_threads", gconf.io_threads()));
+							gconf.reuse_port(global.get<bool>("reuse_port", gconf.reuse_port()));
+							gconf.splice(global.get<bool>("splice", gconf.splice()));
+							gconf.high_watermark(global.get("high_watermark", gconf.high_watermark()));
+							gconf.low_watermark(global.get("low_watermark", gconf.low_watermark()));
+							gconf.read_ahead(global.get("read_ahead", gconf.read_ahead()));
+							gconf.dns_ttl(global.get("dns_ttl", gconf.dns_ttl()));
+							gconf.dns_negative_ttl(global.get("dns_negative_ttl", gconf.dns_negative_ttl()));
+							gconf.connect_delay(global.get("connect_delay", gconf.connect_delay()));
+							gconf.table_cache(global.get("table_cache", gconf.table_cache()));
 						} else if (node.first.compare("-") == 0) {
 							if (tunnels_.size() > 0) 
 								throw "The io tunnel should be the only tunnel in the config";
@@ -96,6 +115,10 @@ namespace zb {
 							tg_.add_thread(tr);
 							break;
 
+						} else if (gconf.io_threads() > 0) {
+							boost::shared_ptr<ZbTunnel> t(new ZbSocketTunnel(node.first, next_loop()));
+							tunnels_[node.first] = t;
+							t->start_with_config(node.second);
 						} else {
 							boost::shared_ptr<ZbTunnel> t(new ZbSocketTunnel(node.first));
 							tunnels_[node.first] = t;
@@ -133,6 +156,41 @@ namespace zb {
 				return 0;
 			}
 
+			/// Tunnels are handed to the shared loops round-robin, so each loop
+			/// gets the same number of tunnels give or take one.
+			shared_ptr<io_service>& next_loop() {
+				if (loops_.empty()) {
+					for (size_t i = 0; i < gconf.io_threads(); i++) {
+						loops_.push_back(shared_ptr<io_service>(new io_service()));
+						loop_works_.push_back(shared_ptr<io_service::work>(new io_service::work(*loops_[i])));
+						tg_.add_thread(new boost::thread(boost::bind(&ZbTunnelMain::run_loop, this, loops_[i])));
+					}
+				}
+
+				shared_ptr<io_service>& loop = loops_[next_loop_];
+				next_loop_ = (next_loop_ + 1) % loops_.size();
+				return loop;
+			}
+
+			void run_loop(shared_ptr<io_service> loop) {
+				while (!loop->stopped()) {
+					try {
+						loop->run();
+					}
+					catch (const string& e) {
+						gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_WARN, "ZbTunnelMain", e);
+					}
+			#ifndef DEBUG
+					catch (const std::exception& e) {
+						gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_WARN, "ZbTunnelMain", e.what());
+					}
+					catch (...) {
+						gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_WARN, "ZbTunnelMain", "event loop crashed");
+					}
+			#endif
+				}
+			}
+
 			void wait_for_threads() {
 				tg_.join_all();
 				raise(SIGTERM);
@@ -143,8 +201,12 @@ namespace zb {
 					assert(node.second.get() != 0);
 					node.second->stop();
 				}
+				loop_works_.clear();
 
 				tg_.join_all();
+				BOOST_FOREACH(tunnel_map::value_type& node, tunnels_) {
+					node.second->wait();
+				}
 				*out_ << "ZbTunnel finished.\n";
 				gconf.flush();
 				out_->flush();
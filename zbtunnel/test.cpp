@@ -1,7 +1,190 @@
 #include "zbtunnel/zbcoder.hpp"
+#include "zbtunnel/zbtransport.hpp"
+#include "zbtunnel/zbmux.hpp"
+#include "zbtunnel/zbh2.hpp"
+#include "zbtunnel/zbtunnel.hpp"
+#include "zbtunnel/zbconnection.hpp"
+#include "zbtunnel/zbconnectionmanager.hpp"
+#include "zbtunnel/zbupstream.hpp"
+#include "zbtunnel/md5.h"
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
 
 namespace zb {
 	namespace tunnel {
+		/// One end of an in-memory link. What is sent shows up at the peer, which
+		/// hands it out at most max_read bytes per read, so reads split where a
+		/// socket might.
+		class ZbMemoryTransport: public ZbTransport {
+		public:
+			typedef shared_ptr<ZbMemoryTransport> pointer;
+
+			ZbMemoryTransport(shared_ptr<io_service> service, size_t max_read):ZbTransport(ZbTransport::pointer()),
+				max_read_(max_read), closed_(false), read_data_(0), read_size_(0), sent_(0), flip_((size_t)-1) {
+				io_service_ = service;
+			};
+
+			static void link(pointer a, pointer b) {
+				a->peer_ = b;
+				b->peer_ = a;
+			};
+
+			/// Corrupts the byte at offset of everything sent through this end
+			void flip(size_t offset) {flip_ = offset;};
+
+			virtual bool is_open() {return !closed_;};
+
+			virtual void close() {
+				if (closed_) return;
+				closed_ = true;
+				pointer peer = peer_.lock();
+				if (peer.get() != 0) peer->deliver();
+			};
+
+			virtual void async_send(const data_type data, const size_t size, const write_handler_type& handler) {
+				pointer peer = peer_.lock();
+				if (closed_ || peer.get() == 0 || peer->closed_) {
+					invoke_callback(boost::bind(handler, make_error_code(errc::broken_pipe), 0));
+					return;
+				}
+
+				for (size_t i = 0; i < size; i++, sent_++)
+					peer->inbox_.push_back(sent_ == flip_ ? data[i] ^ 0x01 : data[i]);
+				peer->deliver();
+				invoke_callback(boost::bind(handler, no_error_, size));
+			};
+
+			virtual void async_receive(const data_type& data, const size_t& size, const read_handler_type& handler) {
+				read_data_ = data;
+				read_size_ = size;
+				read_handler_ = handler;
+				deliver();
+			};
+
+		protected:
+			/// Completes the pending read with what has arrived, or with EOF once either end closed
+			void deliver() {
+				if (read_handler_.empty()) return;
+				pointer peer = peer_.lock();
+				bool eof = closed_ || peer.get() == 0 || peer->closed_;
+				if (inbox_.empty() && read_size_ > 0 && !eof) return;
+
+				read_handler_type handler;
+				handler.swap(read_handler_);
+				size_t n = std::min(std::min(read_size_, max_read_), inbox_.size());
+				std::copy(inbox_.begin(), inbox_.begin() + n, read_data_);
+				inbox_.erase(inbox_.begin(), inbox_.begin() + n);
+				invoke_callback(boost::bind(handler, n > 0 || read_size_ == 0 ? no_error_ : make_error_code(boost::asio::error::eof), n));
+			};
+
+			weak_ptr<ZbMemoryTransport> peer_;
+			std::deque<uint8_t> inbox_;
+			size_t max_read_;
+			bool closed_;
+			data_type read_data_;
+			size_t read_size_;
+			read_handler_type read_handler_;
+			size_t sent_, flip_;
+		};
+
+		/// Reads from a transport until it has want bytes or gets an error,
+		/// going through sizes for the size of each read
+		class ZbTestReader {
+		public:
+			ZbTestReader(size_t want, const vector<size_t>& sizes):want_(want), sizes_(sizes), reads_(0) {};
+
+			void read(ZbTransport::pointer transport) {
+				transport_ = transport;
+				start();
+			};
+
+			void start() {
+				size_t size = sizes_[reads_++ % sizes_.size()];
+				buf_.resize(size);
+				ZbTransport::data_type p = buf_.data();
+				transport_->async_receive(p, size, boost::bind(&ZbTestReader::handle_read, this, _1, _2));
+			};
+
+			void handle_read(const error_code& e, const size_t size) {
+				if (e) {
+					error = e;
+					return;
+				}
+				data.insert(data.end(), buf_.begin(), buf_.begin() + size);
+				if (data.size() < want_) start();
+			};
+
+			std::vector<uint8_t> data;
+			error_code error;
+
+		private:
+			ZbTransport::pointer transport_;
+			size_t want_;
+			vector<size_t> sizes_;
+			size_t reads_;
+			std::vector<uint8_t> buf_;
+		};
+
+		static ZbTransport::pointer make_test_shadow(ZbTransport::pointer parent, const string& method) {
+			config_type conf;
+			conf["method"] = method;
+			conf["key"] = "foobar!";
+			return ZbTransport::pointer(new ZbShadowTransport(parent, conf));
+		}
+
+		/// Connects two sockets over the loopback interface
+		static void connect_test_sockets(shared_ptr<io_service> service, socket_ptr& a, socket_ptr& b) {
+			tcp::acceptor acceptor(*service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+			a.reset(new tcp::socket(*service));
+			b.reset(new tcp::socket(*service));
+			a->connect(acceptor.local_endpoint());
+			acceptor.accept(*b);
+		}
+
+		/// Two linked memory transports on a service of their own, with a shadow
+		/// transport of method over each of them unless method is empty
+		struct ZbTestLink {
+			shared_ptr<io_service> service;
+			ZbMemoryTransport::pointer a, b;
+			ZbTransport::pointer shadow_a, shadow_b;
+
+			ZbTestLink(size_t max_read, const string& method = ""):service(new io_service()),
+				a(new ZbMemoryTransport(service, max_read)), b(new ZbMemoryTransport(service, max_read)) {
+				ZbMemoryTransport::link(a, b);
+				if (method.empty()) return;
+				shadow_a = make_test_shadow(a, method);
+				shadow_b = make_test_shadow(b, method);
+			};
+
+			/// Runs the service until nothing is left to do
+			void run() {
+				service->reset();
+				service->run();
+			};
+		};
+
+		static void record_write(error_code* error, size_t* written, const error_code& e, const size_t size) {
+			*error = e;
+			*written += size;
+		}
+
+		static void record_connect(error_code* error, const error_code& e) {
+			*error = e;
+		}
+
+		/// Bytes written in hex, spaces allowed
+		static std::vector<uint8_t> test_hex(const string& hex) {
+			std::vector<uint8_t> bytes;
+			string digits;
+			for (size_t i = 0; i < hex.size(); i++)
+				if (hex[i] != ' ') digits += hex[i];
+			for (size_t i = 0; i + 1 < digits.size(); i += 2)
+				bytes.push_back((uint8_t)strtol(digits.substr(i, 2).c_str(), 0, 16));
+			return bytes;
+		}
+
 		void encrypt_test()
 		{
 			uint8_t target1[2][256] = {
@@ -73,8 +256,824 @@ namespace zb {
 				assert(target2[1][i] == dt[i]);
 			}
 
+			// Long enough to go through the vector kernels and their scalar tails
+			uint8_t plain[1027], cipher[1027], back[1027];
+			for (int i=0; i<1027; i++) plain[i] = (uint8_t)(i * 7 + i / 256);
+			sc->encrypt(plain, cipher, 1027);
+			sc->decrypt(cipher, back, 1027);
+			for (int i=0; i<1027; i++) {
+				assert(cipher[i] == target2[0][plain[i]]);
+				assert(back[i] == plain[i]);
+			}
+
 			puts("Encryption/Decryption test passed!");
 
 		}
+
+#ifndef WIN32
+		/// Opens up the table cache of ZbTableCoder
+		class ZbTestTableCoder: public ZbTableCoder {
+		public:
+			ZbTestTableCoder(string key, string cache_dir = ""):ZbTableCoder("", key, cache_dir) {};
+			bool mapped() {return mapped_ != 0;};
+			using ZbTableCoder::load_table;
+			using ZbTableCoder::save_table;
+		};
+
+		void table_cache_test()
+		{
+			char dir[] = "/tmp/zbtunnel-test-XXXXXX";
+			if (mkdtemp(dir) == 0) throw string("unable to create a temporary directory");
+			string path = string(dir) + "/table-" + MD5("foobar!").hexdigest() + ".tbl";
+
+			ZbTestTableCoder made("foobar!");
+			assert(!made.mapped());
+			made.save_table(path);
+
+			// Found in the cache, so mapped instead of made
+			{
+				ZbTestTableCoder loaded("foobar!", dir);
+				assert(loaded.mapped());
+				assert(memcmp(loaded.get_encrypt_table(), made.get_encrypt_table(), 256) == 0);
+				assert(memcmp(loaded.get_decrypt_table(), made.get_decrypt_table(), 256) == 0);
+			}
+
+			// A truncated file is rejected, the tables are made again and saved over it
+			if (truncate(path.c_str(), 2 * 256 - 1) != 0) throw string("unable to truncate ") + path;
+			assert(!made.load_table(path));
+			{
+				ZbTestTableCoder rebuilt("foobar!", dir);
+				assert(!rebuilt.mapped());
+				assert(memcmp(rebuilt.get_encrypt_table(), made.get_encrypt_table(), 256) == 0);
+				assert(memcmp(rebuilt.get_decrypt_table(), made.get_decrypt_table(), 256) == 0);
+			}
+			{
+				ZbTestTableCoder loaded("foobar!", dir);
+				assert(loaded.mapped());
+				assert(memcmp(loaded.get_encrypt_table(), made.get_encrypt_table(), 256) == 0);
+			}
+
+			unlink(path.c_str());
+			rmdir(dir);
+			puts("Table cache test passed!");
+		}
+#endif
+
+		static void get_test_coder(boost::barrier* start, string key, ZbCoderPool::coder_type* coder) {
+			start->wait();
+			*coder = ZbCoderPool::get_instance()->get_coder("", key);
+		}
+
+		void coder_pool_test()
+		{
+			// The threads ask for a key nobody asked for before, all at once
+			const int count = 8;
+			boost::barrier start(count);
+			ZbCoderPool::coder_type coders[count];
+			boost::thread_group threads;
+			for (int i = 0; i < count; i++)
+				threads.create_thread(boost::bind(&get_test_coder, &start, string("coder pool test"), &coders[i]));
+			threads.join_all();
+
+			assert(coders[0].get() != 0);
+			for (int i = 1; i < count; i++)
+				assert(coders[i] == coders[0]);
+			assert(ZbCoderPool::get_instance()->get_coder("", "coder pool test") == coders[0]);
+
+			puts("Coder pool test passed!");
+		}
+
+		void evp_coder_test()
+		{
+#ifdef WITH_OPENSSL
+			// aes-256-cfb with the key "foobar!" and the iv 00..0f, made by an independent implementation
+			static uint8_t wire[] = {
+				0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+				0xd0, 0xa3, 0x5c, 0xd6, 0x94, 0x7b, 0xd1, 0xa9, 0xcb, 0x48, 0x9e, 0x98, 0xc9, 0xf3, 0x52, 0x03,
+				0x11, 0x68, 0x3c, 0x8e, 0xd3, 0xc2, 0x60, 0x41, 0x93, 0x11, 0x2a, 0x20, 0x97, 0xbf, 0x9a, 0xc9,
+				0xee, 0x5e, 0x33, 0x12, 0x9b};
+			const string plain = "zbtunnel aes-256-cfb known answer!!!!";
+
+			// The iv and the cipher text arrive in pieces of 5 bytes
+			ZbTestLink link(5, "aes-256-cfb");
+			vector<size_t> sizes;
+			sizes.push_back(7);
+			sizes.push_back(64);
+			ZbTestReader reader(plain.size(), sizes);
+			reader.read(link.shadow_b);
+			link.a->async_send(wire, sizeof(wire), boost::bind(&ZbTransport::_dummy_write_handler, link.a, _1, _2));
+			link.run();
+			assert(!reader.error);
+			assert(string(reader.data.begin(), reader.data.end()) == plain);
+
+			// A stream decrypts what another one encrypted, whatever the pieces
+			ZbCoderPool::coder_type coder = ZbCoderPool::get_instance()->get_coder("aes-256-cfb", "foobar!");
+			ZbCoderPool::coder_type enc = coder->new_stream(), dec = coder->new_stream();
+			uint8_t in[1000], out[1000], back[1000];
+			for (int i = 0; i < 1000; i++) in[i] = (uint8_t)(i * 13);
+			enc->encrypt(in, out, 1);
+			enc->encrypt(in + 1, out + 1, 999);
+			dec->decrypt_iv(enc->encrypt_iv());
+			dec->decrypt(out, back, 333);
+			dec->decrypt(out + 333, back + 333, 667);
+			assert(memcmp(in, back, 1000) == 0);
+
+			puts("Stream cipher test passed!");
+#endif
+		}
+
+		void aead_coder_test()
+		{
+#ifdef WITH_OPENSSL
+			// aes-256-gcm with the key "foobar!" and the salt 00..1f, sending "zbtunnel"
+			// and " aes-256-gcm known answer" as two chunks, made by an independent implementation
+			static uint8_t wire[] = {
+				0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+				0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+				0x9e, 0x4d, 0x4f, 0xd5, 0x89, 0xed, 0xa2, 0x1c, 0xfe, 0x14, 0xcc, 0xe9, 0xe2, 0xb7, 0x55, 0x76,
+				0x65, 0x69, 0xf8, 0x6d, 0x3c, 0xee, 0x48, 0xd9, 0x4b, 0x31, 0x5f, 0x57, 0x1b, 0x68, 0x19, 0xf7,
+				0x75, 0x59, 0x89, 0x28, 0xc2, 0x63, 0x1e, 0x00, 0x57, 0x33, 0x71, 0x23, 0xac, 0x14, 0xa9, 0xb5,
+				0x34, 0xe5, 0x67, 0xc3, 0x0b, 0xd9, 0xaf, 0x71, 0x05, 0x2f, 0x73, 0x45, 0x17, 0x27, 0x4f, 0xe9,
+				0x63, 0xec, 0x8c, 0x92, 0x4f, 0xb2, 0xe8, 0x12, 0x53, 0x53, 0x08, 0xff, 0x3b, 0x31, 0xd3, 0x2f,
+				0x91, 0x90, 0x61, 0xbe, 0xd1, 0x89, 0xe3, 0x2e, 0x86, 0x56, 0x0c, 0x71, 0x64, 0xd3, 0x5d, 0xe5,
+				0xbd, 0x6b, 0x64, 0xcc, 0x29};
+			const string plain = "zbtunnel aes-256-gcm known answer";
+
+			vector<size_t> sizes;
+			sizes.push_back(3);
+			sizes.push_back(100);
+
+			// The salt, the lengths and the tags arrive in pieces of 5 bytes
+			{
+				ZbTestLink link(5, "aes-256-gcm");
+				ZbTestReader reader(plain.size(), sizes);
+				reader.read(link.shadow_b);
+				link.a->async_send(wire, sizeof(wire), boost::bind(&ZbTransport::_dummy_write_handler, link.a, _1, _2));
+				link.run();
+				assert(!reader.error);
+				assert(string(reader.data.begin(), reader.data.end()) == plain);
+			}
+
+			// A round trip of uneven sends, which are sealed across their boundaries
+			// into full chunks and read back in pieces smaller and larger than a chunk
+			{
+				ZbTestLink link(1000, "aes-256-gcm");
+				std::vector<uint8_t> data(50000);
+				for (size_t i = 0; i < data.size(); i++) data[i] = (uint8_t)(i * 7 + i / 251);
+				size_t pieces[] = {1, 20000, 29999};
+				error_code error;
+				size_t written = 0, offset = 0;
+				for (size_t i = 0; i < sizeof(pieces) / sizeof(pieces[0]); offset += pieces[i++])
+					link.shadow_a->async_send(&data[offset], pieces[i], boost::bind(&record_write, &error, &written, _1, _2));
+
+				sizes.push_back(20000);
+				ZbTestReader reader(data.size(), sizes);
+				reader.read(link.shadow_b);
+				link.run();
+				assert(!error && written == data.size());
+				assert(!reader.error);
+				assert(reader.data == data);
+			}
+
+			// 100 bytes go as [salt 32][length 2][tag 16][payload 100][tag 16], so a
+			// byte flipped in the length tag, the payload or its tag fails the read
+			size_t flips[] = {32 + 2 + 5, 32 + 18 + 10, 32 + 18 + 100 + 2};
+			for (size_t i = 0; i < sizeof(flips) / sizeof(flips[0]); i++) {
+				ZbTestLink link(1000, "aes-256-gcm");
+				link.a->flip(flips[i]);
+				uint8_t data[100] = {0};
+				link.shadow_a->async_send(data, sizeof(data), boost::bind(&ZbTransport::_dummy_write_handler, link.shadow_a, _1, _2));
+
+				ZbTestReader reader(sizeof(data), sizes);
+				reader.read(link.shadow_b);
+				link.run();
+				assert(reader.error == make_error_code(errc::bad_message));
+				assert(reader.data.empty());
+				assert(link.shadow_b->last_error() == "shadow chunk failed authentication");
+			}
+
+			// A properly sealed length above MAX_PAYLOAD is refused too
+			{
+				shared_ptr<ZbAeadStreamCoder> coder = boost::static_pointer_cast<ZbAeadStreamCoder>(
+					ZbCoderPool::get_instance()->get_coder("aes-256-gcm", "foobar!")->new_stream());
+				uint8_t bad[32 + 2 + ZbAeadCoder::TAG_SIZE];
+				uint8_t len[2] = {0x40, 0x00};
+				memcpy(bad, coder->encrypt_iv(), 32);
+				coder->seal_begin();
+				coder->seal_update(len, bad + 32, 2);
+				coder->seal_end(bad + 34);
+
+				ZbTestLink link(1000, "aes-256-gcm");
+				ZbTestReader reader(1, sizes);
+				reader.read(link.shadow_b);
+				link.a->async_send(bad, sizeof(bad), boost::bind(&ZbTransport::_dummy_write_handler, link.a, _1, _2));
+				link.run();
+				assert(reader.error == make_error_code(errc::bad_message));
+				assert(link.shadow_b->last_error() == "shadow chunk length out of range");
+			}
+
+			puts("AEAD cipher test passed!");
+#endif
+		}
+
+		static void accept_test_stream(ZbMuxStream::pointer* accepted, ZbTestReader* reader, ZbMuxStream::pointer stream) {
+			*accepted = stream;
+			reader->read(stream);
+		}
+
+		void mux_test()
+		{
+			ZbTestLink link(1000);
+			ZbMuxSession::pointer client(new ZbMuxSession(link.service, "client")), server(new ZbMuxSession(link.service, "server"));
+
+			// More than WINDOW bytes, so the sender waits for the reader's ACKs
+			std::vector<uint8_t> data(ZbMuxSession::WINDOW * 2 + 75000);
+			for (size_t i = 0; i < data.size(); i++) data[i] = (uint8_t)(i * 31 + i / 4099);
+
+			vector<size_t> sizes;
+			sizes.push_back(10000);
+			sizes.push_back(333);
+			ZbTestReader reader(data.size(), sizes);
+			ZbMuxStream::pointer accepted;
+			server->start(link.b, boost::bind(&accept_test_stream, &accepted, &reader, _1));
+
+			// The stream is opened and written before the chain is ready
+			ZbMuxStream::pointer stream = client->open_stream();
+			error_code error;
+			size_t written = 0;
+			stream->async_send(&data[0], data.size(), boost::bind(&record_write, &error, &written, _1, _2));
+			client->handle_chain(error_code(), link.a);
+			link.run();
+			assert(accepted.get() != 0);
+			assert(!error && written == data.size());
+			assert(!reader.error);
+			assert(reader.data == data);
+
+			// The other way round, then closing gives the peer EOF
+			uint8_t reply[] = "done";
+			accepted->async_send(reply, sizeof(reply), boost::bind(&record_write, &error, &written, _1, _2));
+			ZbTestReader back(sizeof(reply), sizes);
+			back.read(stream);
+			link.run();
+			assert(!back.error);
+			assert(back.data.size() == sizeof(reply) && memcmp(&back.data[0], reply, sizeof(reply)) == 0);
+
+			ZbTestReader last(1, sizes);
+			last.read(accepted);
+			stream->close();
+			link.run();
+			assert(last.error == make_error_code(boost::asio::error::eof));
+			assert(last.data.empty());
+
+			client->close();
+			server->close();
+			link.run();
+
+			// A peer sending more than a window without our ACK breaks the session
+			ZbTestLink raw(1000);
+			ZbMuxSession::pointer session(new ZbMuxSession(raw.service, "server"));
+			ZbTestReader unread(1, vector<size_t>(1, 1));
+			accepted.reset();
+			session->start(raw.b, boost::bind(&accept_test_stream, &accepted, &unread, _1));
+			std::vector<uint8_t> frames;
+			uint8_t open[ZbMuxSession::HEADER_SIZE] = {0, 0, 0, 1, ZbMuxSession::OPEN, 0, 0, 0};
+			frames.insert(frames.end(), open, open + sizeof(open));
+			for (size_t sent = 0; sent < ZbMuxSession::WINDOW; sent += ZbMuxSession::MAX_PAYLOAD) {
+				uint8_t header[ZbMuxSession::HEADER_SIZE] = {0, 0, 0, 1, ZbMuxSession::DATA, 0, ZbMuxSession::MAX_PAYLOAD >> 8, 0};
+				frames.insert(frames.end(), header, header + sizeof(header));
+				frames.resize(frames.size() + ZbMuxSession::MAX_PAYLOAD, 'w');
+			}
+			raw.a->async_send(&frames[0], frames.size(), boost::bind(&record_write, &error, &written, _1, _2));
+			raw.run();
+			assert(accepted.get() != 0 && session->is_open());
+
+			uint8_t over[ZbMuxSession::HEADER_SIZE + 1] = {0, 0, 0, 1, ZbMuxSession::DATA, 0, 0, 1, 'x'};
+			raw.a->async_send(over, sizeof(over), boost::bind(&record_write, &error, &written, _1, _2));
+			raw.run();
+			assert(!session->is_open());
+
+			puts("Mux test passed!");
+		}
+
+#ifdef WITH_OPENSSL
+		/// Decodes a header block written in hex as in RFC 7541, spaces allowed
+		static bool hpack_decode(ZbHpack& hpack, const string& hex, ZbHpack::header_list& headers) {
+			std::vector<uint8_t> block = test_hex(hex);
+			headers.clear();
+			return hpack.decode(&block[0], block.size(), headers);
+		}
+
+		static bool same_headers(const ZbHpack::header_list& headers, const char* const expected[][2], size_t count) {
+			if (headers.size() != count) return false;
+			for (size_t i = 0; i < count; i++)
+				if (headers[i].first != expected[i][0] || headers[i].second != expected[i][1]) return false;
+			return true;
+		}
+#endif
+
+		void hpack_test()
+		{
+#ifdef WITH_OPENSSL
+			ZbHpack::header_list headers;
+
+			// C.2, one representation each
+			{
+				ZbHpack hpack;
+				const char* const c21[][2] = {{"custom-key", "custom-header"}};
+				assert(hpack_decode(hpack, "400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572", headers));
+				assert(same_headers(headers, c21, 1));
+				assert(hpack_decode(hpack, "be", headers));
+				assert(same_headers(headers, c21, 1));
+			}
+			{
+				ZbHpack hpack;
+				const char* const c22[][2] = {{":path", "/sample/path"}};
+				assert(hpack_decode(hpack, "040c 2f73 616d 706c 652f 7061 7468", headers));
+				assert(same_headers(headers, c22, 1));
+				assert(!hpack_decode(hpack, "be", headers));
+			}
+			{
+				ZbHpack hpack;
+				const char* const c23[][2] = {{"password", "secret"}};
+				assert(hpack_decode(hpack, "1008 7061 7373 776f 7264 0673 6563 7265 74", headers));
+				assert(same_headers(headers, c23, 1));
+				assert(!hpack_decode(hpack, "be", headers));
+			}
+			{
+				ZbHpack hpack;
+				const char* const c24[][2] = {{":method", "GET"}};
+				assert(hpack_decode(hpack, "82", headers));
+				assert(same_headers(headers, c24, 1));
+			}
+
+			// C.4, requests with Huffman coding on one connection
+			{
+				ZbHpack hpack;
+				const char* const c41[][2] = {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}};
+				assert(hpack_decode(hpack, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff", headers));
+				assert(same_headers(headers, c41, 4));
+
+				const char* const c42[][2] = {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"},
+					{"cache-control", "no-cache"}};
+				assert(hpack_decode(hpack, "8286 84be 5886 a8eb 1064 9cbf", headers));
+				assert(same_headers(headers, c42, 5));
+
+				const char* const c43[][2] = {{":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"}, {":authority", "www.example.com"},
+					{"custom-key", "custom-value"}};
+				assert(hpack_decode(hpack, "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf", headers));
+				assert(same_headers(headers, c43, 5));
+
+				const char* const table[][2] = {{"custom-key", "custom-value"}, {"cache-control", "no-cache"}, {":authority", "www.example.com"}};
+				assert(hpack_decode(hpack, "be bf c0", headers));
+				assert(same_headers(headers, table, 3));
+				assert(!hpack_decode(hpack, "c1", headers));
+			}
+
+			// C.6, responses with Huffman coding and a 256 byte table, set by a size
+			// update whose integer takes continuation bytes. Entries are evicted.
+			{
+				ZbHpack hpack;
+				const char* const c61[][2] = {{":status", "302"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+					{"location", "https://www.example.com"}};
+				assert(hpack_decode(hpack, "3fe1 01"
+					"4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae 43d3", headers));
+				assert(same_headers(headers, c61, 4));
+
+				const char* const c62[][2] = {{":status", "307"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+					{"location", "https://www.example.com"}};
+				assert(hpack_decode(hpack, "4883 640e ffc1 c0bf", headers));
+				assert(same_headers(headers, c62, 4));
+
+				// ":status: 302" made room for ":status: 307"
+				const char* const table2[][2] = {{":status", "307"}, {"location", "https://www.example.com"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+					{"cache-control", "private"}};
+				assert(hpack_decode(hpack, "be bf c0 c1", headers));
+				assert(same_headers(headers, table2, 4));
+				assert(!hpack_decode(hpack, "c2", headers));
+
+				const char* const c63[][2] = {{":status", "200"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:22 GMT"},
+					{"location", "https://www.example.com"}, {"content-encoding", "gzip"},
+					{"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}};
+				assert(hpack_decode(hpack, "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07", headers));
+				assert(same_headers(headers, c63, 6));
+
+				const char* const table3[][2] = {{"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"},
+					{"content-encoding", "gzip"}, {"date", "Mon, 21 Oct 2013 20:13:22 GMT"}};
+				assert(hpack_decode(hpack, "be bf c0", headers));
+				assert(same_headers(headers, table3, 3));
+				assert(!hpack_decode(hpack, "c1", headers));
+			}
+
+			// A table larger than the default is refused
+			{
+				ZbHpack hpack;
+				assert(!hpack_decode(hpack, "3fe2 1f", headers));
+			}
+
+			puts("HPACK test passed!");
+#endif
+		}
+
+		void socket_transport_test()
+		{
+			shared_ptr<io_service> service(new io_service());
+			socket_ptr a, b;
+			connect_test_sockets(service, a, b);
+			ZbSocketTransport::pointer t(new ZbSocketTransport(b, service));
+			vector<size_t> sizes(1, 0);
+
+			// A zero sized read, as asio's ssl makes them, with no read-ahead buffer
+			ZbTestReader empty(0, sizes);
+			empty.read(t);
+			service->reset();
+			service->run();
+			assert(!empty.error && empty.data.empty());
+
+			// Small reads served from the read-ahead buffer until it is drained, then a zero sized one
+			t->read_ahead(64);
+			const string sent = "read ahead";
+			boost::asio::write(*a, boost::asio::buffer(sent));
+			sizes[0] = 3;
+			ZbTestReader reader(sent.size(), sizes);
+			reader.read(t);
+			service->reset();
+			service->run();
+			assert(!reader.error);
+			assert(string(reader.data.begin(), reader.data.end()) == sent);
+			assert(t->buffered() == 0);
+
+			ZbTestReader drained(0, vector<size_t>(1, 0));
+			drained.read(t);
+			service->reset();
+			service->run();
+			assert(!drained.error && drained.data.empty());
+
+			puts("Socket transport test passed!");
+		}
+
+		/// Connects a socks5 client configured by conf to host port 80 through a server
+		/// which answers with the replies in hex, all there before the client asks.
+		/// sent gets what the client wrote, payload what it reads after the replies.
+		static error_code socks5_exchange(config_type conf, const string& host, const string& replies, std::vector<uint8_t>& sent, size_t payload_size, string& payload) {
+			ZbTestLink link(7);
+			ZbTransport::pointer parent = link.a;
+			shared_ptr<ZbSocks5Transport> socks5(new ZbSocks5Transport(parent, conf));
+			std::vector<uint8_t> r = test_hex(replies);
+			error_code error;
+			size_t written = 0;
+			link.b->async_send(&r[0], r.size(), boost::bind(&record_write, &error, &written, _1, _2));
+
+			socks5->init(boost::bind(&record_connect, &error, _1));
+			link.run();
+			if (!error) {
+				socks5->async_connect(host, "80", boost::bind(&record_connect, &error, _1));
+				link.run();
+			}
+
+			ZbTestReader server(1 << 20, vector<size_t>(1, 512));
+			server.read(link.b);
+			link.run();
+			sent = server.data;
+
+			if (!error && payload_size > 0) {
+				ZbTestReader reader(payload_size, vector<size_t>(1, 3));
+				reader.read(socks5);
+				link.run();
+				payload.assign(reader.data.begin(), reader.data.end());
+			}
+			return error;
+		}
+
+		/// The socks5 client against canned replies, split into small reads
+		void socks5_test()
+		{
+			config_type plain, auth, pipelined, pipelined_auth;
+			auth["username"] = pipelined_auth["username"] = "u";
+			auth["password"] = pipelined_auth["password"] = "pw";
+			pipelined["pipeline"] = pipelined_auth["pipeline"] = "1";
+			std::vector<uint8_t> sent;
+			string payload;
+
+			// IPv4, with payload right after the reply
+			error_code error = socks5_exchange(plain, "1.2.3.4", "0500 050000010a000001 1f90 6578747261", sent, 5, payload);
+			assert(!error);
+			assert(sent == test_hex("050100 05010001 01020304 0050"));
+			assert(payload == "extra");
+
+			// A domain with auth, all in one write and one reply
+			error = socks5_exchange(pipelined_auth, "example.com", "0502 0100 0500000304 686f7374 1f90 64617461", sent, 4, payload);
+			assert(!error);
+			assert(sent == test_hex("050102 0101 75 02 7077 05010003 0b 6578616d706c652e636f6d 0050"));
+			assert(payload == "data");
+
+			// IPv6 with auth, one step after the other
+			error = socks5_exchange(auth, "::1", "0502 0100 05000004 00000000000000000000000000000000 1f90", sent, 0, payload);
+			assert(!error);
+			assert(sent == test_hex("05020002 0101 75 02 7077 05010004 00000000000000000000000000000001 0050"));
+
+			// A CONNECT reply of another version, a refused login and a refused connect
+			error = socks5_exchange(pipelined, "1.2.3.4", "0500 04000001 00000000 0000", sent, 0, payload);
+			assert(error == make_error_code(errc::protocol_not_supported));
+			error = socks5_exchange(pipelined_auth, "1.2.3.4", "0502 0101", sent, 0, payload);
+			assert(error == make_error_code(errc::permission_denied));
+			error = socks5_exchange(plain, "1.2.3.4", "0500 05050001 00000000 0000", sent, 0, payload);
+			assert(error == make_error_code(errc::connection_refused));
+
+			puts("SOCKS5 test passed!");
+		}
+
+		/// A tunnel through chains, the first one with the tunnel settings, which
+		/// does not listen anywhere. Connections are started by the test.
+		class ZbTestTunnel: public ZbTunnel {
+		public:
+			ZbTestTunnel(shared_ptr<io_service>& service, const vector<chain_config_type>& chains):ZbTunnel("test", service) {
+				config_ = chains[0];
+				next_alternatives_.assign(chains.begin() + 1, chains.end());
+				init_chains();
+				init_upstreams();
+			};
+
+			unsigned int races(size_t i) {return race_stats_[i].races;};
+			unsigned int wins(size_t i) {return race_stats_[i].wins;};
+			double latency(size_t i) {return race_stats_[i].latency;};
+		};
+
+		/// A chain of a raw hop to endpoint
+		static chain_config_type raw_test_chain(const tcp::endpoint& endpoint) {
+			config_type hop;
+			hop["transport"] = "raw";
+			hop["host"] = endpoint.address().to_string();
+			hop["port"] = boost::lexical_cast<string>(endpoint.port());
+			return chain_config_type(1, hop);
+		}
+
+		static void record_accept(bool* accepted, const error_code& error) {
+			*accepted = !error;
+		}
+
+		/// Runs the handlers of service as they get ready until *done, for up to 5 seconds
+		static void poll_test_service(shared_ptr<io_service> service, const bool* done) {
+			for (int i = 0; i < 5000 && !*done; i++) {
+				service->reset();
+				if (service->poll() == 0) usleep(1000);
+			}
+			if (!*done) throw string("timed out");
+		}
+
+		/// Polls service until s has data, then reads size bytes of it
+		static string read_test_socket(shared_ptr<io_service> service, socket_ptr s, size_t size) {
+			bool readable = false;
+			for (int i = 0; i < 5000 && !readable; i++) {
+				service->reset();
+				if (service->poll() == 0) usleep(1000);
+				readable = s->available() >= size;
+			}
+			if (!readable) throw string("timed out reading");
+
+			string data(size, 0);
+			boost::asio::read(*s, boost::asio::buffer(&data[0], size));
+			return data;
+		}
+
+#ifdef ZB_HAS_SPLICE
+		/// A preconnected connection goes over to splice() once the server side is idle,
+		/// and relays again after it is recycled with a client which closed a spliced direction
+		void splice_test()
+		{
+			shared_ptr<io_service> service(new io_service());
+			tcp::acceptor acceptor(*service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+			vector<chain_config_type> chains(1, raw_test_chain(acceptor.local_endpoint()));
+			shared_ptr<ZbTestTunnel> tunnel(new ZbTestTunnel(service, chains));
+
+			ZbConnectionManager::pointer manager(new ZbConnectionManager("test"));
+			manager->recycle(true);
+			manager->max_reuse(2);
+			manager->splice(true);
+
+			socket_ptr server(new tcp::socket(*service));
+			bool accepted = false;
+			acceptor.async_accept(*server, boost::bind(record_accept, &accepted, _1));
+			manager->refill(service, tunnel, 1);
+			poll_test_service(service, &accepted);
+			// Let the connection see its connect done
+			service->reset();
+			service->poll();
+
+			ZbConnection::pointer conn = manager->get_or_create_conn(service, tunnel);
+			socket_ptr client, in;
+			connect_test_sockets(service, client, in);
+			conn->start(ZbTransport::pointer(new ZbSocketTransport(in, service)));
+
+			// Direction 1 was reading into buffers while waiting for a client
+			assert(!conn->splicing(1));
+			boost::asio::write(*server, boost::asio::buffer(string("pong")));
+			assert(read_test_socket(service, client, 4) == "pong");
+			assert(conn->splicing(0) && conn->splicing(1));
+			boost::asio::write(*client, boost::asio::buffer(string("ping")));
+			assert(read_test_socket(service, server, 4) == "ping");
+
+			// The client leaves, the connection goes back to the pool
+			client->close();
+			for (int i = 0; i < 100; i++) {
+				service->reset();
+				if (service->poll() == 0) usleep(1000);
+			}
+			ZbConnection::pointer again = manager->get_or_create_conn(service, tunnel);
+			assert(again == conn);
+
+			connect_test_sockets(service, client, in);
+			conn->start(ZbTransport::pointer(new ZbSocketTransport(in, service)));
+			boost::asio::write(*client, boost::asio::buffer(string("again")));
+			assert(read_test_socket(service, server, 5) == "again");
+			boost::asio::write(*server, boost::asio::buffer(string("back")));
+			assert(read_test_socket(service, client, 4) == "back");
+			assert(conn->splicing(0) && conn->splicing(1));
+
+			manager->stop_all();
+			puts("Splice test passed!");
+		}
+#endif
+
+		/// Chains ranked by the expected seconds per win, and a race whose loser is still
+		/// waiting for its socks5 proxy when the other chain is ready
+		void race_test()
+		{
+			shared_ptr<io_service> service(new io_service());
+			tcp::acceptor fast(*service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+			tcp::acceptor slow(*service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+			vector<chain_config_type> chains;
+			chains.push_back(raw_test_chain(fast.local_endpoint()));
+			chains.push_back(raw_test_chain(slow.local_endpoint()));
+			chains[1][0]["transport"] = "socks5";
+			chains.push_back(raw_test_chain(slow.local_endpoint()));
+
+			{
+				shared_ptr<ZbTestTunnel> tunnel(new ZbTestTunnel(service, chains));
+				vector<chain_ptr> snapshots;
+				// The first connection races them all
+				assert(tunnel->race_candidates(snapshots).size() == 3);
+
+				tunnel->race_done(0, true, chrono::milliseconds(100));
+				tunnel->race_done(1, true, chrono::milliseconds(10));
+				tunnel->race_cancelled(2);
+				vector<size_t> ranked = tunnel->race_candidates(snapshots);
+				assert(ranked.size() == 2 && ranked[0] == 1 && ranked[1] == 0);
+				assert(snapshots.size() == 2 && (*snapshots[0])[0].at("transport") == "socks5");
+
+				// Slower than chain 1, but better than never finishing
+				tunnel->race_done(2, false, chrono::milliseconds(5));
+				ranked = tunnel->race_candidates(snapshots);
+				assert(ranked[0] == 1 && ranked[1] == 2);
+			}
+
+			shared_ptr<ZbTestTunnel> tunnel(new ZbTestTunnel(service, vector<chain_config_type>(chains.begin(), chains.begin() + 2)));
+			ZbConnectionManager::pointer manager(new ZbConnectionManager("test"));
+			socket_ptr server(new tcp::socket(*service)), proxy(new tcp::socket(*service));
+			bool accepted = false, proxied = false;
+			fast.async_accept(*server, boost::bind(record_accept, &accepted, _1));
+			slow.async_accept(*proxy, boost::bind(record_accept, &proxied, _1));
+
+			ZbConnection::pointer conn = manager->get_or_create_conn(service, tunnel);
+			socket_ptr client, in;
+			connect_test_sockets(service, client, in);
+			conn->start(ZbTransport::pointer(new ZbSocketTransport(in, service)));
+			poll_test_service(service, &accepted);
+			poll_test_service(service, &proxied);
+
+			// The winner relays, the loser is dropped without a time of its own
+			boost::asio::write(*client, boost::asio::buffer(string("race")));
+			assert(read_test_socket(service, server, 4) == "race");
+			assert(tunnel->races(0) == 1 && tunnel->wins(0) == 1 && tunnel->latency(0) > 0);
+			assert(tunnel->races(1) == 1 && tunnel->wins(1) == 0 && tunnel->latency(1) == 0);
+
+			manager->stop_all();
+			puts("Race test passed!");
+		}
+
+		/// Upstreams a, b and c picked by strategy, with a connection given each kept open until released
+		static ZbUpstreams::pointer test_upstreams(const string& balance, const string& fail_timeout) {
+			config_type conf;
+			conf["upstreams"] = "a:1, b:2, c:3";
+			conf["balance"] = balance;
+			conf["max_fails"] = "2";
+			conf["fail_timeout"] = fail_timeout;
+			return ZbUpstreams::pointer(new ZbUpstreams(conf));
+		}
+
+		static string test_pick(ZbUpstreams::pointer upstreams, const vector<ZbUpstreams::upstream_ptr>& tried = vector<ZbUpstreams::upstream_ptr>()) {
+			ZbUpstreams::upstream_ptr u = upstreams->pick(tried);
+			return u.get() == 0 ? string() : u->host;
+		}
+
+		/// The balance strategies, taking upstreams out of rotation and back, and a
+		/// connection failing over from a refusing upstream to the next one
+		void upstream_test()
+		{
+			vector<ZbUpstreams::upstream_ptr> none;
+
+			ZbUpstreams::pointer upstreams = test_upstreams("round_robin", "10");
+			assert(test_pick(upstreams) == "a" && test_pick(upstreams) == "b" && test_pick(upstreams) == "c" && test_pick(upstreams) == "a");
+
+			// Fewest connections first, ties go round
+			upstreams = test_upstreams("least_conn", "10");
+			ZbUpstreams::upstream_ptr a = upstreams->pick(none), b = upstreams->pick(none), c = upstreams->pick(none);
+			assert(a->host == "a" && b->host == "b" && c->host == "c");
+			upstreams->release(b);
+			assert(test_pick(upstreams) == "b");
+			upstreams->release(a);
+			upstreams->release(c);
+			assert(test_pick(upstreams) == "c" && test_pick(upstreams) == "a");
+
+			// The least setup time per connection in use
+			upstreams = test_upstreams("latency", "10");
+			a = upstreams->pick(none);
+			b = upstreams->pick(none);
+			upstreams->connected(a, chrono::milliseconds(100), true);
+			upstreams->connected(b, chrono::milliseconds(10), true);
+			upstreams->release(a);
+			upstreams->release(b);
+			// Not measured yet goes first
+			c = upstreams->pick(none);
+			assert(c->host == "c");
+			upstreams->connected(c, chrono::milliseconds(50), true);
+			assert(test_pick(upstreams) == "b");
+			// b is in use now, which doubles its load, still below the others
+			assert(test_pick(upstreams) == "b");
+
+			// After max_fails a is skipped, then a single connection probes it once fail_timeout is over
+			upstreams = test_upstreams("round_robin", "1");
+			a = upstreams->pick(none);
+			upstreams->failed(a);
+			upstreams->failed(a);
+			assert(test_pick(upstreams) == "b" && test_pick(upstreams) == "c" && test_pick(upstreams) == "b");
+			usleep(1100000);
+			assert(test_pick(upstreams) == "c" && test_pick(upstreams) == "a");
+			assert(test_pick(upstreams) == "b" && test_pick(upstreams) == "c" && test_pick(upstreams) == "b");
+			upstreams->connected(a, chrono::milliseconds(10), false);
+			assert(test_pick(upstreams) == "c" && test_pick(upstreams) == "a");
+
+			// With all of them out, the first pick still gets one, a failover none
+			ZbUpstreams::upstream_ptr all[] = {upstreams->pick(none), upstreams->pick(none), upstreams->pick(none)};
+			for (size_t i = 0; i < 3; i++) {
+				upstreams->failed(all[i]);
+				upstreams->failed(all[i]);
+			}
+			ZbUpstreams::upstream_ptr fallback = upstreams->pick(none);
+			assert(fallback.get() != 0);
+			assert(upstreams->pick(vector<ZbUpstreams::upstream_ptr>(1, fallback)).get() == 0);
+
+			// A connection given a refusing upstream goes on to the next one
+			shared_ptr<io_service> service(new io_service());
+			tcp::acceptor acceptor(*service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+			unsigned short refusing;
+			{
+				tcp::acceptor closed(*service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+				refusing = closed.local_endpoint().port();
+			}
+			config_type hop;
+			hop["transport"] = "raw";
+			hop["upstreams"] = "127.0.0.1:" + boost::lexical_cast<string>(refusing) + ",127.0.0.1:" + boost::lexical_cast<string>(acceptor.local_endpoint().port());
+			shared_ptr<ZbTestTunnel> tunnel(new ZbTestTunnel(service, vector<chain_config_type>(1, chain_config_type(1, hop))));
+			ZbConnectionManager::pointer manager(new ZbConnectionManager("test"));
+
+			socket_ptr server(new tcp::socket(*service));
+			bool accepted = false;
+			acceptor.async_accept(*server, boost::bind(record_accept, &accepted, _1));
+			ZbConnection::pointer conn = manager->get_or_create_conn(service, tunnel);
+			socket_ptr client, in;
+			connect_test_sockets(service, client, in);
+			conn->start(ZbTransport::pointer(new ZbSocketTransport(in, service)));
+			poll_test_service(service, &accepted);
+
+			boost::asio::write(*client, boost::asio::buffer(string("over")));
+			assert(read_test_socket(service, server, 4) == "over");
+			// The refusing one counts a failure, so it is next in turn, and still in rotation
+			ZbUpstreams::upstream_ptr next = tunnel->upstreams()->pick(none);
+			assert(next->port == boost::lexical_cast<string>(refusing) && next->fails == 1);
+
+			manager->stop_all();
+			puts("Upstream test passed!");
+		}
+
+		/// Runs every test above, an assert or a thrown string fails it
+		void test_all()
+		{
+			encrypt_test();
+#ifndef WIN32
+			table_cache_test();
+#endif
+			coder_pool_test();
+			socket_transport_test();
+			evp_coder_test();
+			aead_coder_test();
+			mux_test();
+			hpack_test();
+			socks5_test();
+			race_test();
+			upstream_test();
+#ifdef ZB_HAS_SPLICE
+			splice_test();
+#endif
+		}
 	}
-}
\ No newline at end of file
+}
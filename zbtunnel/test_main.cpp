@@ -0,0 +1,19 @@
+#include "zbtunnel/headers.hpp"
+
+namespace zb {
+	namespace tunnel {
+		void test_all();
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	try {
+		zb::tunnel::test_all();
+	} catch (const std::string& e) {
+		std::cerr << "Test failed: " << e << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
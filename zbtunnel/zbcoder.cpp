@@ -7,6 +7,29 @@
 #include "zbtunnel/md5.h"
 #include <boost/integer.hpp>
 
+#ifdef WITH_OPENSSL
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
+
+#ifndef EVP_CTRL_AEAD_GET_TAG
+#define EVP_CTRL_AEAD_GET_TAG EVP_CTRL_GCM_GET_TAG
+#define EVP_CTRL_AEAD_SET_TAG EVP_CTRL_GCM_SET_TAG
+#endif
+#endif
+
+#ifndef WIN32
+#define ZB_HAS_TABLE_CACHE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// pshufb kernels for the table coder, picked at runtime
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ZB_HAS_SIMD_TABLE
+#include <immintrin.h>
+#endif
 
 #define OFFSET_ROL(p, o) ((uint64_t)(*(p + o)) << (8 * o))
 
@@ -14,51 +37,273 @@ namespace zb {
 	namespace tunnel {
 
 		ZbCoderPool* ZbCoderPool::instance_ = 0;
+		boost::once_flag ZbCoderPool::instance_flag_ = BOOST_ONCE_INIT;
+
+		ZbCoderPool::ZbCoderPool():snapshot_(0) {
+			snapshots_.push_back(shared_ptr<const pool_type>(new pool_type()));
+			snapshot_.store(snapshots_.back().get(), boost::memory_order_release);
+		}
+
+		void ZbCoderPool::create_instance() {
+			ZbCoderPool::instance_ = new ZbCoderPool();
+		}
 
 		ZbCoderPool* ZbCoderPool::get_instance() {
-			if (ZbCoderPool::instance_ == 0)
-				ZbCoderPool::instance_ = new ZbCoderPool();
+			boost::call_once(instance_flag_, &ZbCoderPool::create_instance);
 			return ZbCoderPool::instance_;
 		}
 
+		/// Lookups only read the current snapshot. A miss builds the coder and
+		/// publishes a copy of the snapshot with it under the lock.
 		ZbCoderPool::coder_type ZbCoderPool::get_coder(string method, string key) throw (string){
 			key_type k(method, key);
-			pool_type::iterator iter = pool_.find(k);
-			if (iter != pool_.end())
+			const pool_type *pool = snapshot_.load(boost::memory_order_acquire);
+			pool_type::const_iterator iter = pool->find(k);
+			if (iter != pool->end())
 				return (*iter).second;
 
+			boost::mutex::scoped_lock lock(mutex_);
+			pool = snapshot_.load(boost::memory_order_acquire);
+			iter = pool->find(k);
+			if (iter != pool->end())
+				return (*iter).second;
+
+			coder_type coder = create_coder(method, key);
+			shared_ptr<pool_type> next(new pool_type(*pool));
+			(*next)[k] = coder;
+			snapshots_.push_back(next);
+			snapshot_.store(next.get(), boost::memory_order_release);
+			return coder;
+		}
+
+		ZbCoderPool::coder_type ZbCoderPool::create_coder(const string& method, const string& key) {
 			if (key.empty())
 				throw string("empty key");
 
 			if (method.empty() || method.compare("table") == 0) {
-				ZbTableCoder *c = new ZbTableCoder(method, key);
-				pool_[k] = shared_ptr<ZbCoder>(c);
-				return pool_[k];
+				return coder_type(new ZbTableCoder(method, key, gconf.table_cache()));
+			}
+
+	#ifdef WITH_OPENSSL
+			static const struct {
+				const char *name;
+				const EVP_CIPHER *(*cipher)(void);
+				size_t iv_size;
+			} evp_methods[] = {
+				{"aes-128-cfb", EVP_aes_128_cfb128, 16},
+				{"aes-192-cfb", EVP_aes_192_cfb128, 16},
+				{"aes-256-cfb", EVP_aes_256_cfb128, 16},
+				{"aes-128-ctr", EVP_aes_128_ctr, 16},
+				{"aes-192-ctr", EVP_aes_192_ctr, 16},
+				{"aes-256-ctr", EVP_aes_256_ctr, 16},
+		#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+				{"chacha20", EVP_chacha20, 8},
+				{"chacha20-ietf", EVP_chacha20, 12},
+		#endif
+			};
+
+			for (size_t i = 0; i < sizeof(evp_methods) / sizeof(evp_methods[0]); i++) {
+				if (method.compare(evp_methods[i].name) == 0) {
+					return coder_type(new ZbEvpCoder(method, key, evp_methods[i].cipher(), evp_methods[i].iv_size));
+				}
 			}
 
+			static const struct {
+				const char *name;
+				const EVP_CIPHER *(*cipher)(void);
+			} aead_methods[] = {
+				{"aes-128-gcm", EVP_aes_128_gcm},
+				{"aes-192-gcm", EVP_aes_192_gcm},
+				{"aes-256-gcm", EVP_aes_256_gcm},
+		#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+				{"chacha20-ietf-poly1305", EVP_chacha20_poly1305},
+		#endif
+			};
+
+			for (size_t i = 0; i < sizeof(aead_methods) / sizeof(aead_methods[0]); i++) {
+				if (method.compare(aead_methods[i].name) == 0) {
+					return coder_type(new ZbAeadCoder(method, key, aead_methods[i].cipher()));
+				}
+			}
+	#endif
+
 			throw string("unsupported");
 		}
 
+		/// Scalar substitution, also used for the tails of the vector kernels
+		static void table_lookup(const uint8_t *table, const uint8_t *src, uint8_t *dst, int length) {
+			while (length > 0) {
+				*dst = table[*src];
+				dst++;
+				src++;
+				length--;
+			}
+		}
+
+#ifdef ZB_HAS_SIMD_TABLE
+		/*
+		* pshufb only looks up 16 entries, so the 256-entry table is used as 16
+		* sub-tables indexed by the low nibble. The 16 candidates are then narrowed
+		* down by the high nibble with a tree of blends, one level per bit: pblendvb
+		* picks by the top bit of each byte, so bit 4..7 is shifted up to bit 7 first.
+		**/
+		__attribute__((target("sse4.1")))
+		static void table_lookup_sse41(const uint8_t *table, const uint8_t *src, uint8_t *dst, int length) {
+			__m128i sub[16], p[8];
+			for (int k = 0; k < 16; k++)
+				sub[k] = _mm_loadu_si128((const __m128i*)(table + 16 * k));
+
+			const __m128i nibble = _mm_set1_epi8(0x0f);
+			while (length >= 16) {
+				__m128i v = _mm_loadu_si128((const __m128i*)src);
+				__m128i lo = _mm_and_si128(v, nibble);
+				__m128i m = _mm_slli_epi16(v, 3);
+				for (int k = 0; k < 8; k++)
+					p[k] = _mm_blendv_epi8(_mm_shuffle_epi8(sub[2 * k], lo), _mm_shuffle_epi8(sub[2 * k + 1], lo), m);
+				m = _mm_slli_epi16(v, 2);
+				for (int k = 0; k < 4; k++)
+					p[k] = _mm_blendv_epi8(p[2 * k], p[2 * k + 1], m);
+				m = _mm_slli_epi16(v, 1);
+				for (int k = 0; k < 2; k++)
+					p[k] = _mm_blendv_epi8(p[2 * k], p[2 * k + 1], m);
+				_mm_storeu_si128((__m128i*)dst, _mm_blendv_epi8(p[0], p[1], v));
+				src += 16;
+				dst += 16;
+				length -= 16;
+			}
+			table_lookup(table, src, dst, length);
+		}
+
+		/// Same as the sse4.1 kernel, vpshufb shuffles each 128-bit lane with its own copy of the sub-table
+		__attribute__((target("avx2")))
+		static void table_lookup_avx2(const uint8_t *table, const uint8_t *src, uint8_t *dst, int length) {
+			__m256i sub[16], p[8];
+			for (int k = 0; k < 16; k++)
+				sub[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(table + 16 * k)));
+
+			const __m256i nibble = _mm256_set1_epi8(0x0f);
+			while (length >= 32) {
+				__m256i v = _mm256_loadu_si256((const __m256i*)src);
+				__m256i lo = _mm256_and_si256(v, nibble);
+				__m256i m = _mm256_slli_epi16(v, 3);
+				for (int k = 0; k < 8; k++)
+					p[k] = _mm256_blendv_epi8(_mm256_shuffle_epi8(sub[2 * k], lo), _mm256_shuffle_epi8(sub[2 * k + 1], lo), m);
+				m = _mm256_slli_epi16(v, 2);
+				for (int k = 0; k < 4; k++)
+					p[k] = _mm256_blendv_epi8(p[2 * k], p[2 * k + 1], m);
+				m = _mm256_slli_epi16(v, 1);
+				for (int k = 0; k < 2; k++)
+					p[k] = _mm256_blendv_epi8(p[2 * k], p[2 * k + 1], m);
+				_mm256_storeu_si256((__m256i*)dst, _mm256_blendv_epi8(p[0], p[1], v));
+				src += 32;
+				dst += 32;
+				length -= 32;
+			}
+			table_lookup_sse41(table, src, dst, length);
+		}
+#endif
+
+		static ZbTableCoder::lookup_func select_table_lookup() {
+#ifdef ZB_HAS_SIMD_TABLE
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("avx2"))
+				return &table_lookup_avx2;
+			if (__builtin_cpu_supports("sse4.1"))
+				return &table_lookup_sse41;
+#endif
+			return &table_lookup;
+		}
+
+		ZbTableCoder::lookup_func ZbTableCoder::lookup_ = select_table_lookup();
+
 		// Shadow table coder
-		ZbTableCoder::ZbTableCoder(string method, string key):ZbCoder(method, key), enc_table_(0), dec_table_(0), initialized_(false) {
+		ZbTableCoder::ZbTableCoder(string method, string key, string cache_dir):ZbCoder(method, key), enc_table_(0), dec_table_(0), mapped_(0) {
 			if (key.empty()) {
 				throw string("empty key");
 			}
 
-			coder_worker_.reset(new boost::thread(boost::bind(&ZbTableCoder::make_table, this, key)));
+			if (cache_dir.empty()) {
+				make_table(key);
+				return;
+			}
+
+			// Keyed by method and the md5 of the key, so the key itself never hits the disk
+			string path = cache_dir + "/" + (method.empty() ? string("table") : method) + "-" + MD5(key).hexdigest() + ".tbl";
+			if (!load_table(path)) {
+				make_table(key);
+				save_table(path);
+			}
 		}
 
 		ZbTableCoder::~ZbTableCoder() {
+#ifdef ZB_HAS_TABLE_CACHE
+			if (mapped_) {
+				munmap(mapped_, 2 * TABLESIZE);
+				return;
+			}
+#endif
 			if (enc_table_) free(enc_table_);
 			if (dec_table_) free(dec_table_);
 		}
 
+		/// Maps a cached encrypt+decrypt table pair read only, rejecting files of the
+		/// wrong size or whose two halves are not inverse permutations.
+		bool ZbTableCoder::load_table(const string& path) {
+#ifdef ZB_HAS_TABLE_CACHE
+			int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0) return false;
+
+			struct stat st;
+			void *p = MAP_FAILED;
+			if (fstat(fd, &st) == 0 && st.st_size == 2 * TABLESIZE)
+				p = mmap(0, 2 * TABLESIZE, PROT_READ, MAP_SHARED, fd, 0);
+			close(fd);
+			if (p == MAP_FAILED) return false;
+
+			uint8_t *enc = (uint8_t*)p, *dec = enc + TABLESIZE;
+			for (int i = 0; i < TABLESIZE; ++i) {
+				if (dec[enc[i]] != i) {
+					gconf.log(gconf_type::DEBUG_CODER, gconf_type::ZBLOG_WARN, "ZbTableCoder", "Ignoring broken table cache " + path);
+					munmap(p, 2 * TABLESIZE);
+					return false;
+				}
+			}
+
+			mapped_ = p;
+			enc_table_ = enc;
+			dec_table_ = dec;
+			gconf.log(gconf_type::DEBUG_CODER, gconf_type::ZBLOG_DEBUG, "ZbTableCoder", "Loaded " + path);
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		/// Written to a temporary file and renamed, so concurrent starts never map a partial table
+		void ZbTableCoder::save_table(const string& path) {
+#ifdef ZB_HAS_TABLE_CACHE
+			string tmp = path + "." + boost::lexical_cast<string>(getpid());
+			int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+			bool ok = fd >= 0
+				&& write(fd, enc_table_, TABLESIZE) == TABLESIZE
+				&& write(fd, dec_table_, TABLESIZE) == TABLESIZE;
+			if (fd >= 0) ok = close(fd) == 0 && ok;
+
+			if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+				gconf.log(gconf_type::DEBUG_CODER, gconf_type::ZBLOG_WARN, "ZbTableCoder", "Unable to write table cache " + path);
+				unlink(tmp.c_str());
+			}
+#endif
+		}
+
 		void ZbTableCoder::make_table(string key) {
 			gconf.log(gconf_type::DEBUG_CODER, gconf_type::ZBLOG_DEBUG, "ZbTableCoder", "Initializing");
 			if (!enc_table_) enc_table_ = (uint8_t*)malloc(TABLESIZE);
 			if (!dec_table_) dec_table_ = (uint8_t*)malloc(TABLESIZE);
 
 			uint8_t *table = enc_table_;
+			uint8_t scratch[TABLESIZE];
+			uint16_t sort_keys[TABLESIZE];
 			uint64_t keynum[2];
 			int i = 0;
 
@@ -72,148 +317,226 @@ namespace zb {
 			}
 
 			for(i = 1; i < 1024; ++i) {
-				// Use only first 8 bytes of the hash
-				merge_sort(table, TABLESIZE, keynum[0], i);
+				// Use only first 8 bytes of the hash. A key is below 256 + 1024 so it fits in 16 bits
+				for (int j = 0; j < TABLESIZE; ++j) {
+					sort_keys[j] = (uint16_t)(keynum[0] % (uint64_t)(j + i));
+				}
+				stable_sort(table, scratch, sort_keys);
 			}
 
 			for(i = 0; i < 256; ++i) {
 				dec_table_[enc_table_[i]] = i;
 			}
 
-			initialized_ = true;
 			gconf.log(gconf_type::DEBUG_CODER, gconf_type::ZBLOG_DEBUG, "ZbTableCoder", "Initialized");
-			coder_worker_.reset();
-		}
-
-		void ZbTableCoder::wait_for_worker() {
-			if (!initialized_ && coder_worker_.get() != 0)
-				coder_worker_->join();
 		}
 
 		void ZbTableCoder::encrypt(uint8_t *src, uint8_t *dst, int length) {
-			wait_for_worker();
-
 			if (method_.empty() && enc_table_) {
-				while (length > 0) {
-					*dst = enc_table_[*src];
-					dst++;
-					src++;
-					length--;
-				}
+				lookup_(enc_table_, src, dst, length);
 			}
 		}
 
 		void ZbTableCoder::decrypt(uint8_t *src, uint8_t *dst, int length) {
-			wait_for_worker();
-
 			if (method_.empty() && dec_table_) {
-				while (length > 0) {
-					*dst = dec_table_[*src];
-					dst++;
-					src++;
-					length--;
+				lookup_(dec_table_, src, dst, length);
+			}
+		}
+
+		/// Bottom-up merge sort of the table by sort_keys[byte], ping-ponging
+		/// between data and scratch. Being stable it gives the same order as
+		/// the recursive merge sort of the original shadowsocks table.
+		void ZbTableCoder::stable_sort(uint8_t *data, uint8_t *scratch, const uint16_t *sort_keys) {
+			uint8_t *from = data, *to = scratch;
+
+			for (int width = 1; width < TABLESIZE; width *= 2) {
+				for (int start = 0; start < TABLESIZE; start += 2 * width) {
+					int l = start, lend = std::min(start + width, (int)TABLESIZE);
+					int r = lend, rend = std::min(start + 2 * width, (int)TABLESIZE);
+					int out = start;
+
+					while (l < lend && r < rend) {
+						// Ties go to the left run to keep it stable
+						if (sort_keys[from[l]] <= sort_keys[from[r]])
+							to[out++] = from[l++];
+						else
+							to[out++] = from[r++];
+					}
+					while (l < lend) to[out++] = from[l++];
+					while (r < rend) to[out++] = from[r++];
 				}
+				std::swap(from, to);
 			}
+
+			if (from != data)
+				memcpy(data, from, TABLESIZE);
 		}
 
-		void ZbTableCoder::merge_sort(uint8_t *data, int length, uint64_t keynum, int round) {
-			/* This is the middle index and also the length of the right array. */
-			uint8_t middle;
+	#ifdef WITH_OPENSSL
+		ZbEvpCoder::ZbEvpCoder(string method, string key, const EVP_CIPHER *cipher, size_t iv_size):ZbCoder(method, key), cipher_(cipher), iv_size_(iv_size) {
+			if (key.empty()) {
+				throw string("empty key");
+			}
 
-			/*
-			 * Pointers to the beginning of the left and right segment of the array
-			 * to be merged.
-			 */
-			uint8_t *left, *right;
+			if (EVP_BytesToKey(cipher_, EVP_md5(), 0, (const unsigned char*)key.data(), key.size(), 1, derived_key_, 0) <= 0)
+				throw string("unable to derive key for ") + method;
+		}
 
-			/* Length of the left segment of the array to be merged. */
-			int llength;
+		shared_ptr<ZbCoder> ZbEvpCoder::new_stream() {
+			return shared_ptr<ZbCoder>(new ZbEvpStreamCoder(method_, key_, cipher_, iv_size_, derived_key_));
+		}
 
-			if (length <= 1)
-				return;
+		/// derived_key belongs to the pooled coder, which lives as long as the pool
+		ZbEvpStreamCoder::ZbEvpStreamCoder(string method, string key, const EVP_CIPHER *cipher, size_t iv_size, const uint8_t *derived_key)
+			:ZbCoder(method, key), cipher_(cipher), iv_size_(iv_size), derived_key_(derived_key), enc_(0), dec_(0), dec_ready_(false) {
+			enc_ = EVP_CIPHER_CTX_new();
+			dec_ = EVP_CIPHER_CTX_new();
+			if (enc_ == 0 || dec_ == 0 || RAND_bytes(enc_iv_, (int)iv_size_) != 1) {
+				if (enc_) EVP_CIPHER_CTX_free(enc_);
+				if (dec_) EVP_CIPHER_CTX_free(dec_);
+				throw string("unable to create cipher context");
+			}
 
-			/* Let integer division truncate the value. */
-			middle = length / 2;
-
-			llength = length - middle;
-
-			/*
-			 * Set the pointers to the appropriate segments of the array to be merged.
-			 */
-			left = data;
-			right = data + llength;
-
-			merge_sort(left, llength, keynum, round);
-			merge_sort(right, middle, keynum, round);
-			merge(left, llength, right, middle, keynum, round);
-		}
-
-		void ZbTableCoder::merge(uint8_t *left, int llength, uint8_t *right, int rlength, uint64_t keynum, int round)
-		{
-			/* Temporary memory locations for the 2 segments of the array to merge. */
-			uint8_t *ltmp = (uint8_t *) malloc(llength * sizeof(uint8_t));
-			uint8_t *rtmp = (uint8_t *) malloc(rlength * sizeof(uint8_t));
-
-			/*
-			 * Pointers to the elements being sorted in the temporary memory locations.
-			 */
-			uint8_t *ll = ltmp;
-			uint8_t *rr = rtmp;
-
-			uint8_t *result = left;
-
-			/*
-			 * Copy the segment of the array to be merged into the temporary memory
-			 * locations.
-			 */
-			memcpy(ltmp, left, llength * sizeof(uint8_t));
-			memcpy(rtmp, right, rlength * sizeof(uint8_t));
-
-			while (llength > 0 && rlength > 0) {
-				if (keynum % (*ll + round) <= keynum % (*rr + round)) {
-					/*
-					 * Merge the first element from the left back into the main array
-					 * if it is smaller or equal to the one on the right.
-					 */
-					*result = *ll;
-					++ll;
-					--llength;
-				} else {
-					/*
-					 * Merge the first element from the right back into the main array
-					 * if it is smaller than the one on the left.
-					 */
-					*result = *rr;
-					++rr;
-					--rlength;
-				}
-				++result;
-			}
-			/*
-			 * All the elements from either the left or the right temporary array
-			 * segment have been merged back into the main array.  Append the remaining
-			 * elements from the other temporary array back into the main array.
-			 */
-			if (llength > 0)
-				while (llength > 0) {
-					/* Appending the rest of the left temporary array. */
-					*result = *ll;
-					++result;
-					++ll;
-					--llength;
-				}
-			else
-				while (rlength > 0) {
-					/* Appending the rest of the right temporary array. */
-					*result = *rr;
-					++result;
-					++rr;
-					--rlength;
+			init_context(enc_, enc_iv_, 1);
+		}
+
+		ZbEvpStreamCoder::~ZbEvpStreamCoder() {
+			EVP_CIPHER_CTX_free(enc_);
+			EVP_CIPHER_CTX_free(dec_);
+		}
+
+		/// OpenSSL's chacha20 takes a 16 byte iv, a 32 bit block counter followed by
+		/// a 96 bit nonce. Shorter shadowsocks nonces are right aligned after a zero
+		/// counter, which for the 8 byte one is also the layout of the original chacha20.
+		void ZbEvpStreamCoder::init_context(EVP_CIPHER_CTX *ctx, const uint8_t *iv, int enc) {
+			uint8_t full_iv[EVP_MAX_IV_LENGTH] = {0};
+			size_t cipher_iv = EVP_CIPHER_iv_length(cipher_);
+			assert(cipher_iv >= iv_size_ && cipher_iv <= sizeof(full_iv));
+			memcpy(full_iv + cipher_iv - iv_size_, iv, iv_size_);
+
+			if (EVP_CipherInit_ex(ctx, cipher_, 0, derived_key_, full_iv, enc) != 1)
+				throw string("unable to init cipher ") + method_;
+		}
+
+		void ZbEvpStreamCoder::decrypt_iv(const uint8_t *iv) {
+			init_context(dec_, iv, 0);
+			dec_ready_ = true;
+		}
+
+		void ZbEvpStreamCoder::encrypt(uint8_t *src, uint8_t *dst, int length) {
+			int outl = 0;
+			if (length > 0 && EVP_CipherUpdate(enc_, dst, &outl, src, length) != 1)
+				throw string("encryption failed");
+		}
+
+		void ZbEvpStreamCoder::decrypt(uint8_t *src, uint8_t *dst, int length) {
+			int outl = 0;
+			if (!dec_ready_)
+				throw string("decrypting before the iv is received");
+			if (length > 0 && EVP_CipherUpdate(dec_, dst, &outl, src, length) != 1)
+				throw string("decryption failed");
+		}
+
+		ZbAeadCoder::ZbAeadCoder(string method, string key, const EVP_CIPHER *cipher):ZbCoder(method, key), cipher_(cipher) {
+			if (key.empty()) {
+				throw string("empty key");
+			}
+
+			key_size_ = EVP_CIPHER_key_length(cipher_);
+			if (EVP_BytesToKey(cipher_, EVP_md5(), 0, (const unsigned char*)key.data(), key.size(), 1, master_key_, 0) <= 0)
+				throw string("unable to derive key for ") + method;
+		}
+
+		shared_ptr<ZbCoder> ZbAeadCoder::new_stream() {
+			return shared_ptr<ZbCoder>(new ZbAeadStreamCoder(method_, key_, cipher_, key_size_, master_key_));
+		}
+
+		/// master_key belongs to the pooled coder, which lives as long as the pool
+		ZbAeadStreamCoder::ZbAeadStreamCoder(string method, string key, const EVP_CIPHER *cipher, size_t key_size, const uint8_t *master_key)
+			:ZbCoder(method, key), cipher_(cipher), key_size_(key_size), master_key_(master_key), enc_(0), dec_(0), dec_ready_(false) {
+			enc_ = EVP_CIPHER_CTX_new();
+			dec_ = EVP_CIPHER_CTX_new();
+			if (enc_ == 0 || dec_ == 0 || RAND_bytes(enc_salt_, (int)key_size_) != 1) {
+				if (enc_) EVP_CIPHER_CTX_free(enc_);
+				if (dec_) EVP_CIPHER_CTX_free(dec_);
+				throw string("unable to create cipher context");
+			}
+
+			init_context(enc_, enc_salt_, 1);
+			memset(enc_nonce_, 0, sizeof(enc_nonce_));
+		}
+
+		ZbAeadStreamCoder::~ZbAeadStreamCoder() {
+			EVP_CIPHER_CTX_free(enc_);
+			EVP_CIPHER_CTX_free(dec_);
+		}
+
+		/// The subkey is HKDF-SHA1(master key, salt, "ss-subkey")
+		void ZbAeadStreamCoder::init_context(EVP_CIPHER_CTX *ctx, const uint8_t *salt, int enc) {
+			static const char info[] = "ss-subkey";
+			uint8_t prk[EVP_MAX_MD_SIZE], subkey[EVP_MAX_KEY_LENGTH + EVP_MAX_MD_SIZE], block[EVP_MAX_MD_SIZE + sizeof(info)];
+			unsigned int prk_size = 0, t_size = 0;
+
+			HMAC(EVP_sha1(), salt, (int)key_size_, master_key_, key_size_, prk, &prk_size);
+			for (uint8_t n = 1, *t = subkey; t < subkey + key_size_; t += t_size, n++) {
+				size_t block_size = 0;
+				if (n > 1) {
+					memcpy(block, t - t_size, t_size);
+					block_size = t_size;
 				}
+				memcpy(block + block_size, info, sizeof(info) - 1);
+				block_size += sizeof(info) - 1;
+				block[block_size++] = n;
+				HMAC(EVP_sha1(), prk, prk_size, block, block_size, t, &t_size);
+			}
+
+			if (EVP_CipherInit_ex(ctx, cipher_, 0, subkey, 0, enc) != 1)
+				throw string("unable to init cipher ") + method_;
+		}
+
+		void ZbAeadStreamCoder::decrypt_iv(const uint8_t *salt) {
+			init_context(dec_, salt, 0);
+			memset(dec_nonce_, 0, sizeof(dec_nonce_));
+			dec_ready_ = true;
+		}
+
+		/// Nonces are a little endian counter, bumped after every message
+		void ZbAeadStreamCoder::next_nonce(uint8_t *nonce) {
+			for (int i = 0; i < ZbAeadCoder::NONCE_SIZE && ++nonce[i] == 0; i++);
+		}
+
+		void ZbAeadStreamCoder::seal_begin() {
+			if (EVP_CipherInit_ex(enc_, 0, 0, 0, enc_nonce_, 1) != 1)
+				throw string("encryption failed");
+		}
+
+		void ZbAeadStreamCoder::seal_update(const uint8_t *src, uint8_t *dst, size_t length) {
+			int outl = 0;
+			if (EVP_CipherUpdate(enc_, dst, &outl, src, (int)length) != 1)
+				throw string("encryption failed");
+		}
+
+		void ZbAeadStreamCoder::seal_end(uint8_t *tag) {
+			uint8_t tmp[EVP_MAX_BLOCK_LENGTH];
+			int outl = 0;
+			if (EVP_CipherFinal_ex(enc_, tmp, &outl) != 1 || EVP_CIPHER_CTX_ctrl(enc_, EVP_CTRL_AEAD_GET_TAG, ZbAeadCoder::TAG_SIZE, tag) != 1)
+				throw string("encryption failed");
+			next_nonce(enc_nonce_);
+		}
 
-			/* Release the memory used for the temporary arrays. */
-			free(ltmp);
-			free(rtmp);
+		bool ZbAeadStreamCoder::open(const uint8_t *src, uint8_t *dst, size_t length, const uint8_t *tag) {
+			uint8_t tmp[EVP_MAX_BLOCK_LENGTH];
+			int outl = 0;
+			if (!dec_ready_)
+				throw string("decrypting before the salt is received");
+
+			bool ok = EVP_CipherInit_ex(dec_, 0, 0, 0, dec_nonce_, 0) == 1
+				&& EVP_CIPHER_CTX_ctrl(dec_, EVP_CTRL_AEAD_SET_TAG, ZbAeadCoder::TAG_SIZE, (void*)tag) == 1
+				&& EVP_CipherUpdate(dec_, dst, &outl, src, (int)length) == 1
+				&& EVP_CipherFinal_ex(dec_, tmp, &outl) == 1;
+			next_nonce(dec_nonce_);
+			return ok;
 		}
+	#endif
 	}
 }
@@ -25,6 +25,11 @@
 #pragma once
 
 #include "zbtunnel/zbconfig.hpp"
+#include <boost/atomic.hpp>
+
+#ifdef WITH_OPENSSL
+#include <openssl/evp.h>
+#endif
 
 namespace zb {
 	namespace tunnel {
@@ -43,6 +48,18 @@ namespace zb {
 			virtual void encrypt(uint8_t *src, uint8_t *dst, int length) = 0;
 			virtual void decrypt(uint8_t *src, uint8_t *dst, int length) = 0;
 
+			/// Bytes of iv sent ahead of each direction of a stream, 0 for coders without one
+			virtual size_t iv_size() {return 0;};
+			/// Coders with an iv keep cipher state per connection. The pooled coder only
+			/// holds the derived key and makes a fresh coder for every stream.
+			virtual shared_ptr<ZbCoder> new_stream() {throw string("not a stream coder");};
+			/// The iv this stream encrypts with, to be sent before any data
+			virtual const uint8_t* encrypt_iv() {return 0;};
+			/// Start decrypting with the iv received from the peer
+			virtual void decrypt_iv(const uint8_t *iv) {};
+			/// Non-zero for AEAD coders, whose data has to be framed in tagged chunks
+			virtual size_t tag_size() {return 0;};
+
 			string method() {return method_;};
 			string key() {return key_;};
 		};
@@ -54,7 +71,8 @@ namespace zb {
 				string method, key;
 				_key_type(string m, string k):method(m), key(k){};
 				bool operator < (const _key_type& k2) const{
-					return (this->method.compare(k2.method) + this->key.compare(k2.key)) < 0;
+					int c = this->method.compare(k2.method);
+					return c != 0 ? c < 0 : this->key.compare(k2.key) < 0;
 				};
 			} key_type;
 			typedef shared_ptr<ZbCoder> coder_type;
@@ -63,16 +81,28 @@ namespace zb {
 			coder_type get_coder(string method, string key) throw (string);
 
 		private:
-			explicit ZbCoderPool() {};
+			typedef map<key_type, coder_type> pool_type;
+
+			explicit ZbCoderPool();
+			static void create_instance();
+			coder_type create_coder(const string& method, const string& key);
 
 			static ZbCoderPool* instance_;
-			typedef map<key_type, coder_type> pool_type;
-			pool_type pool_;
+			static boost::once_flag instance_flag_;
+
+			// Readers use the current snapshot without locking. Snapshots are never
+			// modified once published and are all kept, since a reader may still hold
+			// an old one; there is one per distinct key, so they stay few.
+			boost::atomic<const pool_type*> snapshot_;
+			vector<shared_ptr<const pool_type> > snapshots_;
+			boost::mutex mutex_;
 		};
 
 		class ZbTableCoder: public ZbCoder {
 		public:
-			ZbTableCoder(string method, string key);
+			typedef void (*lookup_func)(const uint8_t *table, const uint8_t *src, uint8_t *dst, int length);
+
+			ZbTableCoder(string method, string key, string cache_dir = "");
 			~ZbTableCoder();
 
 			uint8_t *get_encrypt_table() {return enc_table_;}
@@ -82,15 +112,118 @@ namespace zb {
 			virtual void decrypt(uint8_t *src, uint8_t *dst, int length);
 
 		protected:
-			void wait_for_worker();
 			void make_table(string key);
-			void merge_sort(uint8_t *start, int length, uint64_t keynum, int round);
-			void merge(uint8_t *left, int llength, uint8_t *right, int rlength, uint64_t keynum, int round);
+			bool load_table(const string& path);
+			void save_table(const string& path);
+			static void stable_sort(uint8_t *data, uint8_t *scratch, const uint16_t *sort_keys);
 
 			enum {TABLESIZE = 256};
-			bool initialized_;
 			uint8_t *enc_table_, *dec_table_;
-			scoped_ptr<boost::thread> coder_worker_;
+			// Both tables, back to back, when they come from the cache file
+			void *mapped_;
+
+			// Substitution kernel for this cpu, src and dst may be the same buffer
+			static lookup_func lookup_;
+		};
+
+	#ifdef WITH_OPENSSL
+		/************************
+		* OpenSSL stream ciphers of shadowsocks, the key is derived from the
+		* password with EVP_BytesToKey(md5) once and kept in the pool.
+		**/
+		class ZbEvpCoder: public ZbCoder {
+		public:
+			ZbEvpCoder(string method, string key, const EVP_CIPHER *cipher, size_t iv_size);
+
+			virtual void encrypt(uint8_t *src, uint8_t *dst, int length) {throw string("stream coder used without a stream");};
+			virtual void decrypt(uint8_t *src, uint8_t *dst, int length) {throw string("stream coder used without a stream");};
+			virtual size_t iv_size() {return iv_size_;};
+			virtual shared_ptr<ZbCoder> new_stream();
+
+		protected:
+			const EVP_CIPHER *cipher_;
+			size_t iv_size_;
+			uint8_t derived_key_[EVP_MAX_KEY_LENGTH];
+		};
+
+		/// Cipher contexts of one connection, one per direction
+		class ZbEvpStreamCoder: public ZbCoder {
+		public:
+			ZbEvpStreamCoder(string method, string key, const EVP_CIPHER *cipher, size_t iv_size, const uint8_t *derived_key);
+			~ZbEvpStreamCoder();
+
+			virtual void encrypt(uint8_t *src, uint8_t *dst, int length);
+			virtual void decrypt(uint8_t *src, uint8_t *dst, int length);
+			virtual size_t iv_size() {return iv_size_;};
+			virtual const uint8_t* encrypt_iv() {return enc_iv_;};
+			virtual void decrypt_iv(const uint8_t *iv);
+
+		protected:
+			void init_context(EVP_CIPHER_CTX *ctx, const uint8_t *iv, int enc);
+
+			const EVP_CIPHER *cipher_;
+			size_t iv_size_;
+			const uint8_t *derived_key_;
+			EVP_CIPHER_CTX *enc_, *dec_;
+			bool dec_ready_;
+			uint8_t enc_iv_[EVP_MAX_IV_LENGTH];
+		};
+
+		/************************
+		* AEAD ciphers of shadowsocks. The pool keeps the master key, every
+		* direction of a stream derives a subkey from it and a random salt.
+		**/
+		class ZbAeadCoder: public ZbCoder {
+		public:
+			ZbAeadCoder(string method, string key, const EVP_CIPHER *cipher);
+
+			virtual void encrypt(uint8_t *src, uint8_t *dst, int length) {throw string("aead coder used without a stream");};
+			virtual void decrypt(uint8_t *src, uint8_t *dst, int length) {throw string("aead coder used without a stream");};
+			virtual size_t iv_size() {return key_size_;};
+			virtual size_t tag_size() {return TAG_SIZE;};
+			virtual shared_ptr<ZbCoder> new_stream();
+
+			enum {TAG_SIZE = 16, NONCE_SIZE = 12};
+
+		protected:
+			const EVP_CIPHER *cipher_;
+			size_t key_size_;
+			uint8_t master_key_[EVP_MAX_KEY_LENGTH];
+		};
+
+		/// AEAD state of one connection. Each direction keeps its context and nonce
+		/// counter; a seal or an open only sets the nonce, so nothing is allocated per chunk.
+		class ZbAeadStreamCoder: public ZbCoder {
+		public:
+			ZbAeadStreamCoder(string method, string key, const EVP_CIPHER *cipher, size_t key_size, const uint8_t *master_key);
+			~ZbAeadStreamCoder();
+
+			virtual void encrypt(uint8_t *src, uint8_t *dst, int length) {throw string("aead data has to be sealed");};
+			virtual void decrypt(uint8_t *src, uint8_t *dst, int length) {throw string("aead data has to be opened");};
+			virtual size_t iv_size() {return key_size_;};
+			virtual size_t tag_size() {return ZbAeadCoder::TAG_SIZE;};
+			virtual const uint8_t* encrypt_iv() {return enc_salt_;};
+			virtual void decrypt_iv(const uint8_t *salt);
+
+			/// Encrypts one message, which may be fed in several pieces
+			void seal_begin();
+			void seal_update(const uint8_t *src, uint8_t *dst, size_t length);
+			void seal_end(uint8_t *tag);
+			/// Decrypts and authenticates one message, src and dst may be the same
+			bool open(const uint8_t *src, uint8_t *dst, size_t length, const uint8_t *tag);
+
+		protected:
+			void init_context(EVP_CIPHER_CTX *ctx, const uint8_t *salt, int enc);
+			static void next_nonce(uint8_t *nonce);
+
+			const EVP_CIPHER *cipher_;
+			size_t key_size_;
+			const uint8_t *master_key_;
+			EVP_CIPHER_CTX *enc_, *dec_;
+			bool dec_ready_;
+			uint8_t enc_salt_[EVP_MAX_KEY_LENGTH];
+			uint8_t enc_nonce_[ZbAeadCoder::NONCE_SIZE], dec_nonce_[ZbAeadCoder::NONCE_SIZE];
 		};
+	#endif
 	}
 }
\ No newline at end of file
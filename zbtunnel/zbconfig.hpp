@@ -59,8 +59,23 @@ namespace zb {
 			ZB_GETTER_SETTER(log_filter, unsigned int);
 			ZB_GETTER_SETTER(log_level, log_level_type);
 			ZB_GETTER_SETTER(recycle, bool);
+			ZB_GETTER_SETTER(splice, bool);
+			ZB_GETTER_SETTER(reuse_port, bool);
 			ZB_GETTER_SETTER(preconnect, unsigned int);
 			ZB_GETTER_SETTER(max_reuse, unsigned int);
+			ZB_GETTER_SETTER(idle_timeout, unsigned int);
+			ZB_GETTER_SETTER(min_idle, unsigned int);
+			ZB_GETTER_SETTER(max_idle, unsigned int);
+			ZB_GETTER_SETTER(adaptive_preconnect, bool);
+			ZB_GETTER_SETTER(threads, unsigned int);
+			ZB_GETTER_SETTER(io_threads, unsigned int);
+			ZB_GETTER_SETTER(high_watermark, unsigned int);
+			ZB_GETTER_SETTER(low_watermark, unsigned int);
+			ZB_GETTER_SETTER(read_ahead, unsigned int);
+			ZB_GETTER_SETTER(dns_ttl, unsigned int);
+			ZB_GETTER_SETTER(dns_negative_ttl, unsigned int);
+			ZB_GETTER_SETTER(connect_delay, unsigned int);
+			ZB_GETTER_SETTER(table_cache, string);
 			ZB_GETTER_SETTER(out, std::ostream*);
 			ZB_GETTER_SETTER(log, log_func_type);
 		
@@ -76,8 +91,9 @@ namespace zb {
 
 		protected:
 			std::ostream* out_;
-			unsigned int log_filter_, preconnect_, max_reuse_;
-			bool recycle_;
+			unsigned int log_filter_, preconnect_, max_reuse_, idle_timeout_, min_idle_, max_idle_, threads_, io_threads_, high_watermark_, low_watermark_, read_ahead_, dns_ttl_, dns_negative_ttl_, connect_delay_;
+			bool recycle_, splice_, reuse_port_, adaptive_preconnect_;
+			string table_cache_;
 			log_level_type log_level_;
 			log_func_type log_;
 			static ZbConfig *instance_;
@@ -87,8 +103,22 @@ namespace zb {
 				log_level_ = ZBLOG_INFO;
 				log_filter_ = DEBUG_TUNNEL | DEBUG_CONNECTION | DEBUG_CONNECTION_MANAGER;
 				recycle_ = 0;
+				splice_ = true;
+				reuse_port_ = false;
 				preconnect_ = 0;
 				max_reuse_ = 10;
+				idle_timeout_ = 0;
+				min_idle_ = 0;
+				max_idle_ = 0;
+				adaptive_preconnect_ = false;
+				threads_ = 1;
+				io_threads_ = 0;
+				high_watermark_ = 65536;
+				low_watermark_ = 16384;
+				read_ahead_ = 0;
+				dns_ttl_ = 60;
+				dns_negative_ttl_ = 5;
+				connect_delay_ = 250;
 				log_ = boost::bind(&ZbConfig::_dummy_log, this, _1, _2, _3, _4);
 			}
 
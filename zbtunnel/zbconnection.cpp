@@ -17,11 +17,44 @@ namespace zb {
 			return p->shared_from_this();
 		}
 
-		ZbConnection::ZbConnection():state_(INIT),current_(0)
+		ZbConnection::pointer ZbConnection::create(shared_ptr<io_service>& service, client_ptr client, shared_ptr<ZbTransport> out)
 		{
+			pointer p(new ZbConnection());
+
+			p->client_ = client;
+			p->out_ = out;
+			p->state_ = CONNECTED;
+			p->mux_ = true;
+
+			return p;
+		}
+
+		ZbConnection::ZbConnection():state_(INIT),current_(0),high_watermark_(BUFSIZE),low_watermark_(0),mux_(false),shared_link_(false),chain_(-1),race_pending_(0)
+		{
+			for (int i = 0; i < 2; i++) {
+				rbuf_[i] = 0;
+				free_[i].push_back(buf_[i][0]);
+				free_[i].push_back(buf_[i][1]);
+				queued_[i] = piped_[i] = 0;
+				reading_[i] = writing_[i] = splicing_[i] = eof_[i] = splice_failed_[i] = false;
+				pipe_[i][0] = pipe_[i][1] = -1;
+			}
 		}
 
 		ZbConnection::~ZbConnection() {
+			BOOST_FOREACH(uint8_t* p, allocated_) {
+				delete[] p;
+			}
+
+#ifdef ZB_HAS_SPLICE
+			for (int i = 0; i < 2; i++) {
+				if (pipe_[i][0] >= 0) ::close(pipe_[i][0]);
+				if (pipe_[i][1] >= 0) ::close(pipe_[i][1]);
+			}
+#endif
+
+			if (upstream_.get() != 0) upstreams_->release(upstream_);
+
 			format f(" destroyed. in ref:%d out ref:%d");
 			f = f % in_.use_count() % out_.use_count();
 			gtrace("ZbConnection", f.str());
@@ -54,8 +87,13 @@ namespace zb {
 			if (state_ == CONNECTED) {
 				// Start transfer right away;
 				assert(in_.get() != 0);
-				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_INFO, "ZbConnection", to_string() + string(" reused, starting to transfer"));
-				if (in_.get()) in_->async_receive(buf_[0][0], BUFSIZE, bind(&ZbConnection::handle_transfer, shared_from_this(), _1, _2, 0));	
+				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_INFO, "ZbConnection", to_string() + (mux_ ? " multiplexed" : " reused") + ", starting to transfer");
+				select_relay(0);
+				select_relay(1);
+				start_read(0);
+				start_read(1);
+				// Flush what the server sent while we were waiting
+				start_write(1);
 				return;
 			}
 
@@ -73,32 +111,195 @@ namespace zb {
 
 			try {
 				state_ = CONNECTING;
-				// Create connection to server
-				if (c->endpoint_cache_.get() != 0) {
-					gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", to_string() + string(" is making first connection to cached endpoint"));
-					out_->async_connect(*(c->endpoint_cache_), bind(&ZbConnection::handle_connect, shared_from_this(), _1));
-				} else {
-					string host = CONFIG_GET(c->config_[0], "host", STATETHROW("host missing in conf0"));
-					string port = CONFIG_GET(c->config_[0], "port", STATETHROW("port missing in conf0"));
-					gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", to_string() + string(" is making first connection to ") + host + ":" + port);
-					out_->async_connect(host, port, bind(&ZbConnection::handle_connect, shared_from_this(), _1));
+				connect_started_ = chrono::steady_clock::now();
+				if (chain_ < 0) {
+					vector<chain_ptr> snapshots;
+					vector<size_t> chains = c->race_candidates(snapshots);
+					if (chains.size() > 1) {
+						start_race(chains, snapshots);
+						return;
+					}
+					chain_ = chains[0];
+					hops_ = snapshots[0];
+				}
+				assert(hops_.get() != 0);
+
+				upstreams_ = chain_ == 0 ? c->upstreams() : ZbUpstreams::pointer();
+				if (upstreams_.get() != 0) {
+					upstream_ = upstreams_->pick(tried_);
+					tried_.push_back(upstream_);
 				}
+				connect_first_hop();
 			} catch (std::exception &e) {
 				// Error connecting to remote
 				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_WARN, "ZbConnection", string("Start failed. ") + e.what());
-				c->last_error_ = e.what();
+				c->report_error(e.what());
 				stop(false);
 				return;
 			}
 		}
 
+		/// Connects to the first hop, the proxy of upstream_ if conf0 lists upstreams
+		void ZbConnection::connect_first_hop() {
+			ZbConnectionManager::pointer m = manager_.lock();
+
+			first_hop_started_ = chrono::steady_clock::now();
+			first_hop_ = (*hops_)[0];
+			if (upstream_.get() != 0) {
+				first_hop_["host"] = upstream_->host;
+				first_hop_["port"] = upstream_->port;
+			}
+
+#ifdef WITH_OPENSSL
+			// A stream on a shared h2 connection to the first hop skips TCP and TLS
+			string ttype = CONFIG_GET(first_hop_, "transport", string());
+			if (ttype.compare("h2") == 0) {
+				ZbTransport::pointer stream = m->h2_stream(first_hop_);
+				if (stream.get() != 0) {
+					gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", to_string() + string(" is opening a stream on a shared h2 connection"));
+					shared_link_ = true;
+					out_ = stream;
+					out_->init(bind(&ZbConnection::handle_init, shared_from_this(), _1));
+					return;
+				}
+			}
+#endif
+			// Layers above the socket read in small pieces
+			ZbSocketTransport* tp = dynamic_cast<ZbSocketTransport*>(out_.get());
+			if (tp != 0 && m.get() != 0) tp->read_ahead(m->read_ahead());
+
+			// Create connection to server, the shared resolver answers warm tunnels from its cache
+			string host = CONFIG_GET(first_hop_, "host", STATETHROW("host missing in conf0"));
+			string port = CONFIG_GET(first_hop_, "port", STATETHROW("port missing in conf0"));
+			gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", to_string() + string(" is making first connection to ") + host + ":" + port);
+			out_->async_connect(host, port, bind(&ZbConnection::handle_connect, shared_from_this(), _1));
+		}
+
+		/// Counts a failure of the first hop against its upstream and starts over
+		/// with another one, false if there is none left to try
+		bool ZbConnection::failover() {
+			if (upstream_.get() == 0 || state_ != CONNECTING) return false;
+
+			upstreams_->failed(upstream_);
+			upstreams_->release(upstream_);
+			upstream_ = upstreams_->pick(tried_);
+			if (upstream_.get() == 0) return false;
+			tried_.push_back(upstream_);
+
+			gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_INFO, "ZbConnection", to_string() + " failing over to " + upstream_->host + ":" + upstream_->port);
+			shared_ptr<io_service> service = out_->service();
+			out_->close();
+			out_.reset(new ZbSocketTransport(socket_ptr(new tcp::socket(*service)), service));
+			shared_link_ = false;
+			connect_first_hop();
+			return true;
+		}
+
+		/// Sets up each of chains through a connection of its own. The first one ready becomes
+		/// the outgoing end of this connection, the others are stopped.
+		void ZbConnection::start_race(const vector<size_t>& chains, const vector<chain_ptr>& snapshots) {
+			ZbConnectionManager::pointer m = manager_.lock();
+			assert(m.get() != 0);
+			shared_ptr<io_service> service = out_->service();
+
+			race_pending_ = chains.size();
+			for (size_t n = 0; n < chains.size(); n++) {
+				size_t i = chains[n];
+				ZbConnection::pointer racer = m->create_racer(service, client_, i, snapshots[n]);
+				racers_.push_back(racer);
+				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", to_string() + " is racing chain " + boost::lexical_cast<string>(i) + " as " + racer->to_string());
+				racer->build_chain(boost::bind(&ZbConnection::handle_race, shared_from_this(), racer, i, _1, _2));
+			}
+		}
+
+		void ZbConnection::handle_race(pointer racer, size_t chain, const error_code& error, shared_ptr<ZbTransport> out) {
+			racers_.erase(std::remove(racers_.begin(), racers_.end(), racer), racers_.end());
+			if (race_pending_ == 0) {
+				// Decided already, or this connection stopped
+				if (out.get() != 0) out->close();
+				return;
+			}
+
+			shared_ptr<ZbTunnel> c = client_.lock();
+			assert(c.get() != 0);
+			chrono::steady_clock::duration elapsed = chrono::steady_clock::now() - connect_started_;
+			race_pending_--;
+			if (error) {
+				c->race_done(chain, false, elapsed);
+				if (race_pending_ == 0) {
+					gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_WARN, "ZbConnection", to_string() + " failed on all chains raced");
+					stop(false);
+				}
+				return;
+			}
+
+			race_pending_ = 0;
+			c->race_done(chain, true, elapsed);
+			// The connection to the upstream is this one's now
+			upstreams_ = racer->upstreams_;
+			upstream_ = racer->upstream_;
+			racer->upstream_.reset();
+			vector<pointer> losers;
+			losers.swap(racers_);
+			BOOST_FOREACH(pointer& p, losers) {
+				c->race_cancelled(p->chain_);
+				p->stop(false);
+			}
+
+			gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", to_string() + " won by chain " + boost::lexical_cast<string>(chain));
+			chain_ = chain;
+			hops_ = racer->hops_;
+			out_ = out;
+			// The winner sampled the handshake time itself
+			chain_ready(false);
+		}
+
+		/// Connects through all the hops like a preconnection, but hands the chain
+		/// to handler instead of relaying. handler gets an error if it fails.
+		void ZbConnection::build_chain(const chain_handler_type& handler) {
+			chain_handler_ = handler;
+			start();
+		}
+
 		void ZbConnection::stop(bool recycle, bool remove)
 		{
-			if (in_.get() == 0 && (out_.get() == 0 || !out_->is_open())) return;
+			if (!chain_handler_.empty()) {
+				chain_handler_type handler;
+				handler.swap(chain_handler_);
+				handler(make_error_code(errc::not_connected), shared_ptr<ZbTransport>());
+			}
+
+			// A race in progress ends with its connection
+			if (!racers_.empty()) {
+				vector<pointer> racers;
+				racers.swap(racers_);
+				race_pending_ = 0;
+				BOOST_FOREACH(pointer& p, racers) {
+					p->stop(false);
+				}
+			}
+
+			if (in_.get() == 0 && (out_.get() == 0 || !out_->is_open())) {
+				// Nothing to close yet, but a connect in progress must not go on:
+				// closing cancels a pending resolve or the attempts to its addresses
+				if (state_ == CONNECTING) {
+					state_ = BAD;
+					if (out_.get() != 0) out_->close();
+					ZbConnectionManager::pointer m = manager_.lock();
+					if (remove && m.get() != 0) m->remove(shared_from_this());
+				}
+				return;
+			}
 
 			string err1 = in_.get() ? in_->last_error() : "";
 			string err2 = out_->last_error();
 
+			// A multiplexed stream ends with its client
+			if (mux_) recycle = false;
+			// Only an idle connection is handed on: an operation in flight would complete on
+			// the next client, and what is left in a pipe belongs to this one
+			if (reading_[0] || writing_[0] || writing_[1] || piped_[0] > 0 || piped_[1] > 0 || eof_[1]) recycle = false;
+
 			if (in_.get() == 0) {
 				recycle = false;
 			} else {
@@ -107,9 +308,7 @@ namespace zb {
 				in_.reset();
 			}
 
-			ZbTunnel::pointer c = client_.lock();
-			ZbConnectionManager::pointer m;
-			if (c.get() != 0) m = c->manager_;
+			ZbConnectionManager::pointer m = manager_.lock();
 			assert(m.get() != 0);
 
 			bool reused = false;
@@ -117,6 +316,11 @@ namespace zb {
 				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_INFO, "ZbConnection", to_string() + string(" to be recycled"));
 				reused = m->recycle(shared_from_this());
 			}
+
+			if (reused) {
+				// The next client is switched to splice() again once it is idle, see select_relay
+				splicing_[0] = splicing_[1] = eof_[0] = splice_failed_[0] = splice_failed_[1] = false;
+			}
 		
 			if (!reused) {
 				if (remove) m->remove(shared_from_this());
@@ -124,14 +328,38 @@ namespace zb {
 				if (!err1.empty()) gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", string("in: ") + err1);
 				if (!err2.empty()) gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", string("out: ") + err2);
 				gtrace("ZbConnection", (format("stopping. in ref:%d out ref:%d") % in_.use_count() % out_.use_count()).str());
+				state_ = BAD;
 				out_->close();
 				// Hold out_ in case there are some async ops to be finished
 			}
 		}
 
+		/// Cheap check of an idle outgoing connection. A non-blocking peek sees the EOF
+		/// or reset of a peer which went away, even if its read handler has not run yet.
+		bool ZbConnection::is_alive() {
+			if (state_ == BAD || out_.get() == 0 || !out_->is_open() || !out_->last_error().empty()) return false;
+			if (state_ != CONNECTED) return true;
+
+#ifdef MSG_DONTWAIT
+			socket_ptr s = out_->lowest_socket();
+			if (s.get() == 0) return true;
+
+			char c;
+			ssize_t n = ::recv(s->native_handle(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+			if (n == 0) return false;
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+#endif
+			return true;
+		}
+
 		void ZbConnection::handle_connect(const error_code& error) {
-			if (error) {
+			if (state_ == BAD) {
+				// Stopped while connecting, e.g. lost a race
+				if (!error) out_->close();
+				return;
+			} else if (error) {
 				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_WARN, "ZbConnection", to_string() + string(" connect error: ") + error.message());
+				if (current_ == 0 && failover()) return;
 				stop(false);
 				return;
 			} else {
@@ -142,15 +370,9 @@ namespace zb {
 			ZbTunnel::pointer c = client_.lock();
 			assert(c.get() != 0);
 
-			if (current_ == 0) {
-				if (c->endpoint_cache_.get() == 0) {
-					ZbSocketTransport* tp = dynamic_cast<ZbSocketTransport*>(out_.get());
-					if (tp) c->endpoint_cache_.reset(new tcp::endpoint(tp->get_endpoint()));
-				}
-			}
-		
-			if ((int)c->config_.size() > current_) {
-				conf = c->config_[current_];
+			const chain_config_type& chain = *hops_;
+			if ((int)chain.size() > current_) {
+				conf = current_ == 0 ? first_hop_ : chain[current_];
 				string ttype = CONFIG_GET(conf, "transport", STATETHROW("transport missing in conf"));
 		
 				try {
@@ -160,10 +382,12 @@ namespace zb {
 						out_.reset(new ZbHttpTransport(out_, conf));
 	#ifdef WITH_OPENSSL
 					else if (ttype.compare("https") == 0)
-						out_.reset(new ZbHttpsTransport(out_, conf));
+						out_.reset(new ZbHttpsTransport(out_, conf, c->ssl_context(chain_, current_)));
+					else if (ttype.compare("h2") == 0)
+						out_ = manager_.lock()->h2_connect(conf, out_, c->ssl_context(chain_, current_), current_ == 0, to_string());
 	#else
-					else if (ttype.compare("https") == 0)
-						THROW(string("https is only available when compiled with openssl"));
+					else if (ttype.compare("https") == 0 || ttype.compare("h2") == 0)
+						THROW(ttype + string(" is only available when compiled with openssl"));
 	#endif
 					else if (ttype.compare("socks5") == 0)
 						out_.reset(new ZbSocks5Transport(out_, conf));
@@ -189,35 +413,111 @@ namespace zb {
 
 		/// Init a new transport
 		void ZbConnection::handle_init(const error_code& error) {
-			if (error) {
+			if (state_ == BAD) {
+				if (!error) out_->close();
+				return;
+			} else if (error) {
 				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_WARN, "ZbConnection", to_string() + string(" init error: ") + error.message());
+				if (current_ == 0 && failover()) return;
 				stop(false);
 				return;
 			} else {
 				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", to_string() + string(" init succeeded."));
 			}
 
-			config_type conf;
-			ZbTunnel::pointer c = client_.lock();
-			assert(c.get() != 0);
+			if (current_ == 0 && upstream_.get() != 0) {
+				upstreams_->connected(upstream_, chrono::steady_clock::now() - first_hop_started_, !shared_link_);
+			}
 
-			if ((int)c->config_.size() > current_ + 1) {
-				conf = c->config_[current_ + 1];
+			config_type conf;
+			const chain_config_type& chain = *hops_;
+			if ((int)chain.size() > current_ + 1) {
+				conf = chain[current_ + 1];
 				string host = CONFIG_GET(conf, "host", STATETHROW("host missing in conf"));
 				string port = CONFIG_GET(conf, "port", STATETHROW("port missing in conf"));
 				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", to_string() + string(" is connecting to ") + host + ":" + port);
 				out_->async_connect(host, port, bind(&ZbConnection::handle_connect, shared_from_this(), _1));
 				current_++;
 			} else {
-				// Start transfer
-				state_ = CONNECTED;
-				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_INFO, "ZbConnection", to_string() + " connected, " + (in_.get() == 0 ? "waiting for incoming connection" : "starting to transfer"));
-				if (in_.get()) in_->async_receive(buf_[0][0], BUFSIZE, bind(&ZbConnection::handle_transfer, shared_from_this(), _1, _2, 0));		
-				out_->async_receive(buf_[1][0], BUFSIZE, bind(&ZbConnection::handle_transfer, shared_from_this(), _1, _2, 1));		
+				chain_ready(true);
 			}
 		}
 
+		/// All hops are set up, starts relaying or hands the chain over
+		void ZbConnection::chain_ready(bool sample) {
+			state_ = CONNECTED;
+			ZbConnectionManager::pointer m = manager_.lock();
+			assert(m.get() != 0);
+			if (sample) m->handshake_done(chrono::steady_clock::now() - connect_started_);
+
+			if (!chain_handler_.empty()) {
+				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_INFO, "ZbConnection", to_string() + " connected, handing the chain over");
+				chain_handler_type handler;
+				handler.swap(chain_handler_);
+				shared_ptr<ZbTransport> out = out_;
+				out_.reset();
+				m->remove(shared_from_this());
+				handler(error_code(), out);
+				return;
+			}
+
+			high_watermark_ = m->high_watermark();
+			low_watermark_ = std::min<size_t>(m->low_watermark(), high_watermark_);
+			gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_INFO, "ZbConnection", to_string() + " connected, " + (in_.get() == 0 ? "waiting for incoming connection" : "starting to transfer"));
+			select_relay(0);
+			select_relay(1);
+			start_read(0);
+			start_read(1);
+		}
+
+		/// Every direction has a queue of received chunks. Reading goes on while the
+		/// writer catches up, pauses once more than high_watermark_ bytes are queued
+		/// and resumes when the queue drains below low_watermark_. Chunks are handed
+		/// from the reader to the writer and recycled without copying.
+		uint8_t* ZbConnection::get_chunk(int direction) {
+			if (free_[direction].empty()) {
+				uint8_t* p = new uint8_t[BUFSIZE];
+				allocated_.push_back(p);
+				return p;
+			}
+
+			uint8_t* p = free_[direction].back();
+			free_[direction].pop_back();
+			return p;
+		}
+
+		void ZbConnection::start_read(int direction) {
+#ifdef ZB_HAS_SPLICE
+			if (splicing_[direction]) {
+				splice_read(direction);
+				return;
+			}
+#endif
+			ZbTransport::pointer& src = direction == 0 ? in_ : out_;
+			if (src.get() == 0 || reading_[direction]) return;
+
+			if (rbuf_[direction] == 0) rbuf_[direction] = get_chunk(direction);
+			reading_[direction] = true;
+			src->async_receive(rbuf_[direction], BUFSIZE, bind(&ZbConnection::handle_transfer, shared_from_this(), _1, _2, direction));
+		}
+
+		void ZbConnection::start_write(int direction) {
+#ifdef ZB_HAS_SPLICE
+			if (splicing_[direction]) {
+				splice_write(direction);
+				return;
+			}
+#endif
+			ZbTransport::pointer& dst = direction == 0 ? out_ : in_;
+			if (dst.get() == 0 || writing_[direction] || queue_[direction].empty()) return; // Hold the data until the incoming end arrives
+
+			chunk_type& chunk = queue_[direction].front();
+			writing_[direction] = true;
+			dst->async_send(chunk.first, chunk.second, bind(&ZbConnection::handle_write, shared_from_this(), _1, _2, direction));
+		}
+
 		void ZbConnection::handle_transfer(const error_code& error, size_t size, int direction) {
+			reading_[direction] = false;
 			if (error) {
 				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", to_string() + " dir:" + boost::lexical_cast<string>(direction) + " transfer interrupted:" + error.message());
 				stop(direction == 0); 
@@ -231,24 +531,195 @@ namespace zb {
 				return;
 			}
 
-			buf_type& buf = buf_[direction];
-			memcpy(buf[1], buf[0], size);
-			if (direction == 0) {
-				out_->async_send(buf[1], size, bind(&ZbConnection::handle_write, shared_from_this(), _1, _2, direction));
-				if (in_.get() != 0) in_->async_receive(buf[0], BUFSIZE, bind(&ZbConnection::handle_transfer, shared_from_this(), _1, _2, direction));		
-			} else {
-				if (in_.get() != 0) in_->async_send(buf[1], size, bind(&ZbConnection::handle_write,	shared_from_this(), _1, _2, direction));
-				out_->async_receive(buf[0], BUFSIZE, bind(&ZbConnection::handle_transfer, shared_from_this(), _1, _2, direction));		
+			if (size > 0) {
+				queue_[direction].push_back(chunk_type(rbuf_[direction], size));
+				queued_[direction] += size;
+				rbuf_[direction] = 0;
+				start_write(direction);
 			}
+
+			if (can_splice(direction)) {
+				// Stop reading until the queue is drained, then switch over
+				if (queue_[direction].empty()) {
+					select_relay(direction);
+					start_read(direction);
+				}
+			} else if (queued_[direction] < high_watermark_)
+				start_read(direction);
+			else
+				gdebug(gconf_type::DEBUG_CONNECTION, "ZbConnection", to_string() + " dir:" + boost::lexical_cast<string>(direction) + " reading paused");
 		}
 
 		void ZbConnection::handle_write(const boost::system::error_code& error, size_t bytes_transferred, int direction)
 		{
+			writing_[direction] = false;
 			if (error) {
 				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", string("Error writing:") + error.message());
 				stop(direction == 0);
 				return;
 			}
+
+			assert(!queue_[direction].empty());
+			chunk_type chunk = queue_[direction].front();
+			queue_[direction].pop_front();
+			queued_[direction] -= chunk.second;
+			free_[direction].push_back(chunk.first);
+
+			if (!reading_[direction] && queue_[direction].empty() && can_splice(direction)) {
+				select_relay(direction);
+				start_read(direction);
+				return;
+			}
+
+			if (!reading_[direction] && queued_[direction] <= low_watermark_ && !can_splice(direction))
+				start_read(direction);
+			start_write(direction);
+		}
+
+		/// Whether a direction relaying through buffers could be switched to splice(),
+		/// i.e. both of its ends are plain sockets
+		bool ZbConnection::can_splice(int direction) {
+#ifdef ZB_HAS_SPLICE
+			if (splicing_[direction] || splice_failed_[direction] || in_.get() == 0 || out_.get() == 0) return false;
+
+			ZbConnectionManager::pointer m = manager_.lock();
+			if (m.get() == 0 || !m->splice()) return false;
+
+			return in_->raw_socket().get() != 0 && out_->raw_socket().get() != 0;
+#else
+			return false;
+#endif
+		}
+
+		/// Switch a direction to splice() when both of its ends are plain sockets.
+		/// Only an idle direction is switched, so no data is left in the queue. A busy
+		/// one is switched by handle_transfer or handle_write once it drained.
+		void ZbConnection::select_relay(int direction) {
+#ifdef ZB_HAS_SPLICE
+			if (reading_[direction] || writing_[direction] || !queue_[direction].empty() || !can_splice(direction)) return;
+
+			socket_ptr src = direction == 0 ? in_->raw_socket() : out_->raw_socket();
+			socket_ptr dst = direction == 0 ? out_->raw_socket() : in_->raw_socket();
+
+			if (pipe_[direction][0] < 0 && ::pipe2(pipe_[direction], O_NONBLOCK | O_CLOEXEC) != 0) {
+				pipe_[direction][0] = pipe_[direction][1] = -1;
+				splice_failed_[direction] = true;
+				return;
+			}
+
+			error_code ec;
+			src->native_non_blocking(true, ec);
+			if (!ec) dst->native_non_blocking(true, ec);
+			if (ec) {
+				splice_failed_[direction] = true;
+				return;
+			}
+
+			splicing_[direction] = true;
+			gdebug(gconf_type::DEBUG_CONNECTION, "ZbConnection", to_string() + " dir:" + boost::lexical_cast<string>(direction) + " splicing");
+#endif
+		}
+
+#ifdef ZB_HAS_SPLICE
+		void ZbConnection::splice_read(int direction) {
+			ZbTransport::pointer& src = direction == 0 ? in_ : out_;
+			if (src.get() == 0 || reading_[direction] || eof_[direction] || piped_[direction] >= PIPESIZE) return;
+
+			socket_ptr s = src->raw_socket();
+			if (s.get() == 0) return;
+			reading_[direction] = true;
+			s->async_read_some(boost::asio::null_buffers(), bind(&ZbConnection::handle_splice_read, shared_from_this(), _1, direction));
+		}
+
+		void ZbConnection::handle_splice_read(const error_code& error, int direction) {
+			reading_[direction] = false;
+			ZbTransport::pointer& src = direction == 0 ? in_ : out_;
+			socket_ptr s = src.get() != 0 ? src->raw_socket() : socket_ptr();
+			if (error || s.get() == 0) {
+				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", to_string() + " dir:" + boost::lexical_cast<string>(direction) + " splice interrupted:" + (error ? error.message() : "closed"));
+				stop(direction == 0);
+				return;
+			}
+
+			if (!splicing_[direction]) {
+				// Recycled while waiting, see stop()
+				select_relay(direction);
+				start_read(direction);
+				return;
+			}
+
+			ssize_t n = ::splice(s->native_handle(), 0, pipe_[direction][1], 0, PIPESIZE - piped_[direction], SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n < 0 && (errno == EINVAL || errno == ENOSYS) && piped_[direction] == 0) {
+				// Not supported by this kind of socket, go on with buffers
+				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", to_string() + " splice not supported, falling back");
+				splicing_[direction] = false;
+				splice_failed_[direction] = true;
+				start_read(direction);
+				return;
+			}
+
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", to_string() + " dir:" + boost::lexical_cast<string>(direction) + " splice interrupted:" + strerror(errno));
+				stop(direction == 0);
+				return;
+			}
+
+			if (n == 0) {
+				eof_[direction] = true;
+				if (piped_[direction] == 0) {
+					gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", to_string() + " dir:" + boost::lexical_cast<string>(direction) + " transfer interrupted:end of file");
+					stop(direction == 0);
+				}
+				return;
+			}
+
+			if (n > 0) {
+				piped_[direction] += n;
+				splice_write(direction);
+			}
+			splice_read(direction);
+		}
+
+		void ZbConnection::splice_write(int direction) {
+			ZbTransport::pointer& dst = direction == 0 ? out_ : in_;
+			if (dst.get() == 0 || writing_[direction] || piped_[direction] == 0) return; // Hold the data until the incoming end arrives
+
+			socket_ptr s = dst->raw_socket();
+			if (s.get() == 0) {
+				stop(false);
+				return;
+			}
+
+			ssize_t n = ::splice(pipe_[direction][0], 0, s->native_handle(), 0, piped_[direction], SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", string("Error splicing:") + strerror(errno));
+				stop(direction == 0);
+				return;
+			}
+
+			if (n > 0) piped_[direction] -= n;
+			if (piped_[direction] > 0) {
+				writing_[direction] = true;
+				s->async_write_some(boost::asio::null_buffers(), bind(&ZbConnection::handle_splice_write, shared_from_this(), _1, direction));
+			} else if (eof_[direction]) {
+				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", to_string() + " dir:" + boost::lexical_cast<string>(direction) + " transfer interrupted:end of file");
+				stop(direction == 0);
+				return;
+			}
+
+			splice_read(direction);
+		}
+
+		void ZbConnection::handle_splice_write(const error_code& error, int direction) {
+			writing_[direction] = false;
+			if (error) {
+				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_DEBUG, "ZbConnection", string("Error splicing:") + error.message());
+				stop(direction == 0);
+				return;
+			}
+
+			splice_write(direction);
 		}
+#endif
 	}
 }
\ No newline at end of file
@@ -25,6 +25,8 @@
 #pragma once
 
 #include "zbtunnel/zbconfig.hpp"
+#include "zbtunnel/zbupstream.hpp"
+#include <boost/chrono/chrono.hpp>
 
 namespace zb {
 	namespace tunnel {
@@ -38,38 +40,85 @@ namespace zb {
 		{
 			friend class ZbConnectionManager;
 		public:
-			enum {BUFSIZE = 8192};
+			enum {BUFSIZE = 8192, PIPESIZE = 65536};
 			typedef shared_ptr<ZbConnection> pointer;
 			typedef weak_ptr<ZbTunnel> client_ptr;
-			typedef uint8_t buf_type[2][BUFSIZE]; // 0 for read, 1 for write
+			typedef uint8_t buf_type[2][BUFSIZE]; // initial chunks of the write queue
+			typedef std::pair<uint8_t*, size_t> chunk_type;
+			typedef boost::function<void (const error_code&, shared_ptr<ZbTransport>)> chain_handler_type;
 
 			~ZbConnection();
 		
 			static pointer create(shared_ptr<io_service>& io_service, client_ptr client);
+			/// A connection relaying to an outgoing end which is already usable, e.g. a multiplexed stream
+			static pointer create(shared_ptr<io_service>& io_service, client_ptr client, shared_ptr<ZbTransport> out);
 
 			string to_string();
 			template <typename TransportPointer>
 			void start(TransportPointer in);
 			void start();
+			void build_chain(const chain_handler_type& handler);
 			void stop(bool recycle, bool remove = true);
+			bool is_alive();
+			/// Whether direction relays with splice() instead of buffers
+			bool splicing(int direction) {return splicing_[direction];}
 
 			ZB_GETTER_SETTER(id, int);
 			ZB_GETTER_SETTER(owner, string);
 
 		private:
 			ZbConnection();
+			void connect_first_hop();
+			bool failover();
+			void start_race(const vector<size_t>& chains, const vector<chain_ptr>& snapshots);
+			void handle_race(pointer racer, size_t chain, const error_code& error, shared_ptr<ZbTransport> out);
+			void chain_ready(bool sample);
 			void handle_connect(const error_code& error);
 			void handle_init(const error_code& error);
 			void handle_transfer(const error_code& error, size_t size, int direction);
 			void handle_write(const error_code& error, size_t bytes_transferred, int direction);
+			void start_read(int direction);
+			void start_write(int direction);
+			uint8_t* get_chunk(int direction);
+			bool can_splice(int direction);
+			void select_relay(int direction);
+#ifdef ZB_HAS_SPLICE
+			void splice_read(int direction);
+			void splice_write(int direction);
+			void handle_splice_read(const error_code& error, int direction);
+			void handle_splice_write(const error_code& error, int direction);
+#endif
 			string _state_throw(string msg);
 
 			int current_, id_;
 			string owner_;
 			buf_type buf_[2]; // two directions
+			uint8_t *rbuf_[2]; // chunk owned by the pending read
+			std::deque<chunk_type> queue_[2]; // received chunks waiting for the writer, front is being sent
+			std::vector<uint8_t*> free_[2], allocated_;
+			size_t queued_[2], high_watermark_, low_watermark_;
+			bool reading_[2], writing_[2];
+			bool splicing_[2], eof_[2];
+			bool splice_failed_[2]; // relay with buffers, splice() did not work for the ends
+			int pipe_[2][2]; // kernel buffer of each direction when splicing
+			size_t piped_[2];
 			client_ptr client_;
+			weak_ptr<ZbConnectionManager> manager_;
 			shared_ptr<ZbTransport> in_, out_;
+			chain_handler_type chain_handler_; // takes the outgoing chain once it is ready
+			bool mux_;
 			enum {INIT, CONNECTING, CONNECTED, BAD} state_;
+			chrono::steady_clock::time_point idle_since_; // when it was put into the reusable pool
+			chrono::steady_clock::time_point connect_started_, first_hop_started_;
+			config_type first_hop_; // conf0 with the host and port of upstream_
+			shared_ptr<ZbUpstreams> upstreams_;
+			ZbUpstreams::upstream_ptr upstream_;
+			vector<ZbUpstreams::upstream_ptr> tried_;
+			bool shared_link_; // the first hop is a stream on a connection set up before
+			int chain_; // the chain of the tunnel this goes through, -1 until chosen
+			chain_ptr hops_; // the hops of chain_ as of when it was chosen
+			vector<pointer> racers_; // connections setting up the chains raced for this one
+			size_t race_pending_;
 		};
 	}
 }
\ No newline at end of file
@@ -26,13 +26,19 @@
 
 #include "zbtunnel/zbconfig.hpp"
 #include "zbtunnel/zbconnection.hpp"
+#include "zbtunnel/zbmux.hpp"
+#include "zbtunnel/zbh2.hpp"
+#include <boost/asio/deadline_timer.hpp>
+#include <cmath>
 
 namespace zb {
 	namespace tunnel {
 
 		class ZbTunnel;
 
-		class ZbConnectionManager
+		/// Keeps the connections of one event loop. It is only used from the thread
+		/// running that loop, so it needs no locking.
+		class ZbConnectionManager: public boost::enable_shared_from_this<ZbConnectionManager>
 		{
 		public:
 			typedef shared_ptr<ZbConnectionManager> pointer;
@@ -42,12 +48,46 @@ namespace zb {
 				max_reuse_ = 0;
 				preconnect_ = 0;
 				recycle_ = false;
+				idle_timeout_ = 0;
+				min_idle_ = 0;
+				max_idle_ = 0;
+				generation_ = 0;
+				adaptive_ = false;
+				mux_ = 0;
+				target_idle_ = 0;
+				accepts_ = 0;
+				accept_rate_ = 0;
+				handshake_time_ = 0;
+				splice_ = gconf.splice();
 				id_ = 0;
+				high_watermark_ = gconf.high_watermark();
+				low_watermark_ = gconf.low_watermark();
+				read_ahead_ = gconf.read_ahead();
 			};
 
 			ZB_GETTER_SETTER(max_reuse, int);
 			ZB_GETTER_SETTER(preconnect, int);
 			ZB_GETTER_SETTER(recycle, bool);
+			ZB_GETTER_SETTER(idle_timeout, unsigned int);
+			ZB_GETTER_SETTER(min_idle, unsigned int);
+			ZB_GETTER_SETTER(max_idle, unsigned int);
+			ZB_GETTER_SETTER(adaptive, bool);
+			ZB_GETTER_SETTER(mux, unsigned int);
+
+			/// The warm pool size chosen from the observed load, 0 unless adaptive
+			unsigned int target_idle() {
+				return target_idle_;
+			}
+
+			/// Feeds the time a new chain took from the first connect to ready
+			void handshake_done(chrono::steady_clock::duration elapsed) {
+				double t = chrono::duration_cast<chrono::microseconds>(elapsed).count() / 1e6;
+				handshake_time_ = handshake_time_ == 0 ? t : (EWMA_WEIGHT * t + (100 - EWMA_WEIGHT) * handshake_time_) / 100;
+			}
+			ZB_GETTER_SETTER(splice, bool);
+			ZB_GETTER_SETTER(high_watermark, unsigned int);
+			ZB_GETTER_SETTER(low_watermark, unsigned int);
+			ZB_GETTER_SETTER(read_ahead, unsigned int);
 
 			void add(ZbConnection::pointer conn) {
 				conns_.insert(conn);
@@ -70,7 +110,21 @@ namespace zb {
 					conns_.erase(p);
 				}
 
+				stop_maintenance();
 				kill_reusable();
+
+				vector<ZbMuxSession::pointer> sessions(sessions_);
+				BOOST_FOREACH(ZbMuxSession::pointer& s, sessions) {
+					s->close();
+				}
+#ifdef WITH_OPENSSL
+				h2_session_map h2_sessions(h2_sessions_);
+				for (h2_session_map::iterator it = h2_sessions.begin(); it != h2_sessions.end(); ++it) {
+					BOOST_FOREACH(ZbH2Session::pointer& s, it->second) {
+						s->close();
+					}
+				}
+#endif
 			}
 
 			void kill_reusable() {
@@ -90,42 +144,255 @@ namespace zb {
 					return false;
 				}
 
+				conn->idle_since_ = chrono::steady_clock::now();
 				reusable_conns_.insert(conn);
 				conns_.erase(conn);
 				return true;
 			}
 
+			/// Hands out an idle connection which is still usable, dropping the ones
+			/// which have been idle longer than idle_timeout_ seconds or whose peer is gone.
+			/// Dropped ones are replaced in the background.
 			ZbConnection::pointer get_or_create_conn(shared_ptr<io_service>& service, ZbConnection::client_ptr client) {
 				ZbConnection::pointer p, q;
-				if (reusable_conns_.size() > 0) {
-					p = *(reusable_conns_.begin());
-					reusable_conns_.erase(p);
+				int dropped = 0;
+				accepts_++;
+				while (p.get() == 0 && reusable_conns_.size() > 0) {
+					q = *(reusable_conns_.begin());
+					reusable_conns_.erase(q);
+					if (is_expired(q) || !q->is_alive()) {
+						gconf.log(gconf_type::DEBUG_CONNECTION_MANAGER, gconf_type::ZBLOG_INFO, "ZbConnectionManager", q->to_string() + string(" dropped from reusable pool"));
+						q->stop(false, false);
+						dropped++;
+						continue;
+					}
+					p = q;
 					conns_.insert(p);
-				} else {
-					p = ZbConnection::create(service, client);
-					p->id(id_++);
-					p->owner(name_);
+				}
+
+				if (p.get() == 0) {
+					p = create_conn(service, client);
 					conns_.insert(p);
+					refill(service, client, preconnect_);
+				} else if (dropped > 0 || warm_deficit() > 0) {
+					service->post(boost::bind(&ZbConnectionManager::refill, shared_from_this(), service, client, std::max(dropped, warm_deficit())));
+				}
+				return p;
+			}
 
-					int i = preconnect_;
-					while (i-- > 0 && reusable_conns_.size() < max_reuse_) {
-						q = ZbConnection::create(service, client);
-						q->id(id_++);
-						q->owner(name_);
-						q->start();
-						reusable_conns_.insert(q);
-						gdebug(gconf_type::DEBUG_CONNECTION_MANAGER, "ZbConnectionManager", q->to_string() + string(" is created for preconnecting."));
-					}
+			/// A connection relaying over a stream of one of up to mux_ shared chains.
+			/// A new chain is only set up while the least busy one is in use.
+			ZbConnection::pointer get_mux_conn(shared_ptr<io_service>& service, ZbConnection::client_ptr client) {
+				ZbMuxSession::pointer session;
+				BOOST_FOREACH(ZbMuxSession::pointer& s, sessions_) {
+					if (s->is_open() && (session.get() == 0 || s->streams() < session->streams())) session = s;
+				}
+
+				if (session.get() == 0 || (session->streams() > 0 && sessions_.size() < mux_)) {
+					ZbConnection::pointer c = create_conn(service, client);
+					session.reset(new ZbMuxSession(service, c->to_string()));
+					add_session(session);
+					conns_.insert(c);
+					c->build_chain(boost::bind(&ZbMuxSession::handle_chain, session, _1, _2));
 				}
+
+				ZbConnection::pointer p = ZbConnection::create(service, client, session->open_stream());
+				p->manager_ = shared_from_this();
+				p->id(id_++);
+				p->owner(name_);
+				p->high_watermark_ = high_watermark_;
+				p->low_watermark_ = std::min(low_watermark_, high_watermark_);
+				conns_.insert(p);
 				return p;
 			}
 
+			/// A connection setting up chain of the tunnel, with the hops in snapshot, for a race.
+			/// See ZbConnection::start_race
+			ZbConnection::pointer create_racer(shared_ptr<io_service>& service, ZbConnection::client_ptr client, size_t chain, chain_ptr snapshot) {
+				ZbConnection::pointer p = create_conn(service, client);
+				p->chain_ = chain;
+				p->hops_ = snapshot;
+				conns_.insert(p);
+				return p;
+			}
+
+			/// Keeps track of a session until it closes, and closes it on stop_all()
+			void add_session(ZbMuxSession::pointer session) {
+				sessions_.push_back(session);
+				session->close_handler(boost::bind(&ZbConnectionManager::remove_session, shared_from_this(), _1));
+			}
+
+			void remove_session(ZbMuxSession::pointer session) {
+				sessions_.erase(std::remove(sessions_.begin(), sessions_.end(), session), sessions_.end());
+			}
+
+#ifdef WITH_OPENSSL
+			/// A new stream on an h2 connection to the proxy in conf which has room
+			/// for it, null if there is none yet
+			ZbTransport::pointer h2_stream(config_type& conf) {
+				h2_session_map::iterator it = h2_sessions_.find(h2_key(conf));
+				if (it == h2_sessions_.end()) return ZbTransport::pointer();
+				BOOST_FOREACH(ZbH2Session::pointer& s, it->second) {
+					if (s->can_open()) return s->create_stream();
+				}
+				return ZbTransport::pointer();
+			}
+
+			/// Speaks h2 over link, a new connection named name to the proxy in conf.
+			/// A shared connection carries the streams of later connections too.
+			ZbTransport::pointer h2_connect(config_type& conf, ZbTransport::pointer link, ZbSslContext::pointer ctx, bool shared, const string& name) {
+				ZbH2Session::pointer session(new ZbH2Session(link, conf, ctx, name));
+				if (shared) {
+					h2_sessions_[h2_key(conf)].push_back(session);
+					session->close_handler(boost::bind(&ZbConnectionManager::remove_h2_session, shared_from_this(), h2_key(conf), _1));
+				}
+				session->start();
+				return session->create_stream();
+			}
+
+			void remove_h2_session(string key, ZbH2Session::pointer session) {
+				vector<ZbH2Session::pointer>& v = h2_sessions_[key];
+				v.erase(std::remove(v.begin(), v.end(), session), v.end());
+				if (v.empty()) h2_sessions_.erase(key);
+			}
+#endif
+
+			/// Keeps between min_idle_ and max_idle_ connections warm, checking every
+			/// MAINTAIN_INTERVAL seconds. Called again after a config reload.
+			void start_maintenance(shared_ptr<io_service> service, ZbConnection::client_ptr client) {
+				stop_maintenance();
+				if (min_idle_ == 0 && max_idle_ == 0 && idle_timeout_ == 0 && !adaptive_) return;
+
+				if (timer_.get() == 0) timer_.reset(new boost::asio::deadline_timer(*service));
+				maintain(service, client, generation_);
+			}
+
+			void stop_maintenance() {
+				generation_++;
+				if (timer_.get() != 0) timer_->cancel();
+			}
+
+			void maintain(shared_ptr<io_service> service, ZbConnection::client_ptr client, unsigned int generation) {
+				if (generation != generation_) return;
+
+				if (adaptive_) adapt();
+				prune();
+				if (warm_deficit() > 0) {
+					refill(service, client, warm_deficit());
+				}
+				if (max_idle_ > 0) trim(max_idle_);
+
+				timer_->expires_from_now(boost::posix_time::seconds((long)MAINTAIN_INTERVAL));
+				timer_->async_wait(boost::bind(&ZbConnectionManager::_handle_timer, shared_from_this(), _1, service, client, generation));
+			}
+
+			/// Starts up to n new connections for the reusable pool
+			void refill(shared_ptr<io_service> service, ZbConnection::client_ptr client, int n) {
+				while (n-- > 0 && reusable_conns_.size() < max_reuse_) {
+					ZbConnection::pointer q = create_conn(service, client);
+					q->start();
+					q->idle_since_ = chrono::steady_clock::now();
+					reusable_conns_.insert(q);
+					gdebug(gconf_type::DEBUG_CONNECTION_MANAGER, "ZbConnectionManager", q->to_string() + string(" is created for preconnecting."));
+				}
+			}
+
 		protected:
 			typedef std::set<ZbConnection::pointer> conn_set;
+			// seconds between checks, weight of a new sample and pool size over the estimate, in percent
+			enum {MAINTAIN_INTERVAL = 1, EWMA_WEIGHT = 30, HEADROOM = 150};
+
+			unsigned int warm_target() {
+				return std::max(min_idle_, target_idle_);
+			}
+
+			/// How many the reusable pool is short of warm_target(), 0 if it is not
+			int warm_deficit() {
+				return reusable_conns_.size() < warm_target() ? (int)(warm_target() - reusable_conns_.size()) : 0;
+			}
+
+			/// Little's law: the connections consumed while one is being set up, with
+			/// some headroom for bursts, capped by max_idle_ and max_reuse_
+			void adapt() {
+				accept_rate_ = (EWMA_WEIGHT * (double)accepts_ / MAINTAIN_INTERVAL + (100 - EWMA_WEIGHT) * accept_rate_) / 100;
+				accepts_ = 0;
+				// Let the estimate reach zero on a quiet tunnel instead of tailing off forever
+				if (accept_rate_ < 0.01) accept_rate_ = 0;
+
+				unsigned int limit = max_idle_ > 0 ? std::min(max_idle_, max_reuse_) : max_reuse_;
+				unsigned int target = std::min<unsigned int>(limit, (unsigned int)std::ceil(accept_rate_ * handshake_time_ * HEADROOM / 100));
+				if (target != target_idle_) {
+					gconf.log(gconf_type::DEBUG_CONNECTION_MANAGER, gconf_type::ZBLOG_INFO, "ZbConnectionManager", name_ + ": warm pool target " + boost::lexical_cast<string>(target)
+						+ " for " + (format("%.2f accepts/s, %.0f ms handshake") % accept_rate_ % (handshake_time_ * 1000)).str());
+					target_idle_ = target;
+				}
+			}
+
+			void _handle_timer(const error_code& error, shared_ptr<io_service> service, ZbConnection::client_ptr client, unsigned int generation) {
+				if (error) return;
+				maintain(service, client, generation);
+			}
+
+			/// Drops idle connections which are expired or whose peer is gone
+			void prune() {
+				conn_set::iterator it = reusable_conns_.begin();
+				while (it != reusable_conns_.end()) {
+					ZbConnection::pointer q = *it;
+					if (is_expired(q) || !q->is_alive()) {
+						gconf.log(gconf_type::DEBUG_CONNECTION_MANAGER, gconf_type::ZBLOG_INFO, "ZbConnectionManager", q->to_string() + string(" dropped from reusable pool"));
+						reusable_conns_.erase(it++);
+						q->stop(false, false);
+					} else {
+						++it;
+					}
+				}
+			}
+
+			/// Stops the longest idle connections until at most n are left
+			void trim(size_t n) {
+				while (reusable_conns_.size() > n) {
+					conn_set::iterator oldest = reusable_conns_.begin();
+					for (conn_set::iterator it = reusable_conns_.begin(); it != reusable_conns_.end(); ++it) {
+						if ((*it)->idle_since_ < (*oldest)->idle_since_) oldest = it;
+					}
+					ZbConnection::pointer q = *oldest;
+					reusable_conns_.erase(oldest);
+					gdebug(gconf_type::DEBUG_CONNECTION_MANAGER, "ZbConnectionManager", q->to_string() + string(" trimmed from reusable pool"));
+					q->stop(false, false);
+				}
+			}
+
+			ZbConnection::pointer create_conn(shared_ptr<io_service>& service, ZbConnection::client_ptr client) {
+				ZbConnection::pointer p = ZbConnection::create(service, client);
+				p->manager_ = shared_from_this();
+				p->id(id_++);
+				p->owner(name_);
+				return p;
+			}
+
+#ifdef WITH_OPENSSL
+			typedef std::map<string, vector<ZbH2Session::pointer> > h2_session_map;
+
+			static string h2_key(config_type& conf) {
+				string host = CONFIG_GET(conf, "host", string());
+				string port = CONFIG_GET(conf, "port", string());
+				return host + ":" + port;
+			}
+#endif
+
+			bool is_expired(ZbConnection::pointer conn) {
+				return idle_timeout_ > 0 && chrono::steady_clock::now() - conn->idle_since_ > chrono::seconds(idle_timeout_);
+			}
 
 			string name_;
-			unsigned int preconnect_, max_reuse_, id_;
-			bool recycle_;
+			unsigned int preconnect_, max_reuse_, id_, high_watermark_, low_watermark_, idle_timeout_, min_idle_, max_idle_, generation_, target_idle_, accepts_, mux_, read_ahead_;
+			double accept_rate_, handshake_time_;
+			bool recycle_, splice_, adaptive_;
+			scoped_ptr<boost::asio::deadline_timer> timer_;
+			vector<ZbMuxSession::pointer> sessions_;
+#ifdef WITH_OPENSSL
+			h2_session_map h2_sessions_;
+#endif
 			conn_set conns_;
 			conn_set reusable_conns_;
 		};
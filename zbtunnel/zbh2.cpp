@@ -0,0 +1,844 @@
+#include "zbtunnel/zbh2.hpp"
+
+#ifdef WITH_OPENSSL
+namespace zb {
+	namespace tunnel {
+
+		// RFC 7541 Appendix A
+		static const char* const hpack_static_table[][2] = {
+			{":authority", ""}, {":method", "GET"}, {":method", "POST"},
+			{":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+			{":scheme", "https"}, {":status", "200"}, {":status", "204"},
+			{":status", "206"}, {":status", "304"}, {":status", "400"},
+			{":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+			{"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""},
+			{"accept", ""}, {"access-control-allow-origin", ""}, {"age", ""},
+			{"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+			{"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""},
+			{"content-length", ""}, {"content-location", ""}, {"content-range", ""},
+			{"content-type", ""}, {"cookie", ""}, {"date", ""},
+			{"etag", ""}, {"expect", ""}, {"expires", ""},
+			{"from", ""}, {"host", ""}, {"if-match", ""},
+			{"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+			{"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""},
+			{"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+			{"proxy-authorization", ""}, {"range", ""}, {"referer", ""},
+			{"refresh", ""}, {"retry-after", ""}, {"server", ""},
+			{"set-cookie", ""}, {"strict-transport-security", ""}, {"transfer-encoding", ""},
+			{"user-agent", ""}, {"vary", ""}, {"via", ""},
+			{"www-authenticate", ""},
+		};
+
+		// RFC 7541 Appendix B, code and bit length of every symbol, 256 is EOS
+		static const uint32_t hpack_huffman_codes[257] = {
+			0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+			0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+			0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+			0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+			0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+			0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+			0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+			0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+			0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+			0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+			0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+			0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+			0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+			0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+			0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+			0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+			0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+			0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+			0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+			0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+			0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+			0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+			0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+			0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+			0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+			0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+			0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+			0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+			0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+			0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+			0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+			0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+			0x3fffffff,
+		};
+		static const uint8_t hpack_huffman_lengths[257] = {
+			13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+			28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+			6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+			5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+			13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+			7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+			15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+			6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+			20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+			24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+			22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+			21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+			26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+			19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+			20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+			26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+			30,
+		};
+
+		enum {HPACK_STATIC_SIZE = 61, HPACK_DEFAULT_TABLE_SIZE = 4096};
+
+		/// Decoding tree of the huffman code, built once from the table above
+		struct ZbHuffmanTree {
+			std::vector<int> child[2];
+			std::vector<int> symbol;
+
+			ZbHuffmanTree() {
+				child[0].push_back(-1);
+				child[1].push_back(-1);
+				symbol.push_back(-1);
+				for (int s = 0; s < 257; s++) {
+					int node = 0;
+					for (int i = hpack_huffman_lengths[s] - 1; i >= 0; i--) {
+						int bit = (hpack_huffman_codes[s] >> i) & 1;
+						if (child[bit][node] < 0) {
+							child[bit][node] = symbol.size();
+							child[0].push_back(-1);
+							child[1].push_back(-1);
+							symbol.push_back(-1);
+						}
+						node = child[bit][node];
+					}
+					symbol[node] = s;
+				}
+			}
+		};
+
+		static const ZbHuffmanTree huffman_tree;
+
+		ZbHpack::ZbHpack():size_(0), max_size_(HPACK_DEFAULT_TABLE_SIZE) {
+		}
+
+		void ZbHpack::encode_int(std::vector<uint8_t>& out, uint8_t first, int prefix, size_t v) {
+			size_t mask = (1 << prefix) - 1;
+			if (v < mask) {
+				out.push_back(first | v);
+				return;
+			}
+
+			out.push_back(first | mask);
+			for (v -= mask; v >= 128; v >>= 7)
+				out.push_back((v & 0x7f) | 0x80);
+			out.push_back(v);
+		}
+
+		void ZbHpack::encode(std::vector<uint8_t>& out, size_t name_index, const string& value) {
+			encode_int(out, 0, 4, name_index);
+			encode_int(out, 0, 7, value.size());
+			out.insert(out.end(), value.begin(), value.end());
+		}
+
+		bool ZbHpack::decode_int(const uint8_t*& p, const uint8_t* end, int prefix, size_t& v) {
+			size_t mask = (1 << prefix) - 1;
+			if (p >= end) return false;
+			v = *p++ & mask;
+			if (v < mask) return true;
+
+			for (int shift = 0; shift <= 28; shift += 7) {
+				if (p >= end) return false;
+				uint8_t b = *p++;
+				v += (size_t)(b & 0x7f) << shift;
+				if ((b & 0x80) == 0) return true;
+			}
+			return false;
+		}
+
+		bool ZbHpack::decode_huffman(const uint8_t* p, size_t size, string& s) {
+			int node = 0, depth = 0;
+			bool ones = true; // padding has to be a prefix of EOS
+			for (size_t i = 0; i < size; i++) {
+				for (int b = 7; b >= 0; b--) {
+					int bit = (p[i] >> b) & 1;
+					node = huffman_tree.child[bit][node];
+					if (node < 0) return false;
+					depth++;
+					ones = ones && bit;
+					int sym = huffman_tree.symbol[node];
+					if (sym >= 0) {
+						if (sym == 256) return false;
+						s += (char)sym;
+						node = depth = 0;
+						ones = true;
+					}
+				}
+			}
+			return depth < 8 && ones;
+		}
+
+		bool ZbHpack::decode_string(const uint8_t*& p, const uint8_t* end, string& s) {
+			if (p >= end) return false;
+			bool huffman = (*p & 0x80) != 0;
+			size_t len;
+			if (!decode_int(p, end, 7, len) || len > (size_t)(end - p)) return false;
+
+			s.clear();
+			if (huffman) {
+				if (!decode_huffman(p, len, s)) return false;
+			} else {
+				s.assign((const char*)p, len);
+			}
+			p += len;
+			return true;
+		}
+
+		bool ZbHpack::lookup(size_t index, header_type& h) {
+			if (index == 0) return false;
+			if (index <= HPACK_STATIC_SIZE) {
+				h = header_type(hpack_static_table[index - 1][0], hpack_static_table[index - 1][1]);
+				return true;
+			}
+			if (index - HPACK_STATIC_SIZE > dynamic_.size()) return false;
+			h = dynamic_[index - HPACK_STATIC_SIZE - 1];
+			return true;
+		}
+
+		void ZbHpack::insert(const header_type& h) {
+			size_t size = h.first.size() + h.second.size() + 32;
+			if (size > max_size_) {
+				dynamic_.clear();
+				size_ = 0;
+				return;
+			}
+			dynamic_.push_front(h);
+			size_ += size;
+			evict();
+		}
+
+		void ZbHpack::evict() {
+			while (size_ > max_size_ && !dynamic_.empty()) {
+				size_ -= dynamic_.back().first.size() + dynamic_.back().second.size() + 32;
+				dynamic_.pop_back();
+			}
+		}
+
+		bool ZbHpack::decode(const uint8_t* data, size_t size, header_list& headers) {
+			const uint8_t* p = data;
+			const uint8_t* end = data + size;
+			while (p < end) {
+				size_t index;
+				header_type h;
+				uint8_t b = *p;
+				if (b & 0x80) {
+					// Indexed
+					if (!decode_int(p, end, 7, index) || !lookup(index, h)) return false;
+					headers.push_back(h);
+				} else if ((b & 0xe0) == 0x20) {
+					// Dynamic table size update, we never allow more than the default
+					if (!decode_int(p, end, 5, index) || index > HPACK_DEFAULT_TABLE_SIZE) return false;
+					max_size_ = index;
+					evict();
+				} else {
+					// Literal, with incremental indexing or without
+					bool indexing = (b & 0xc0) == 0x40;
+					if (!decode_int(p, end, indexing ? 6 : 4, index)) return false;
+					if (index > 0) {
+						if (!lookup(index, h)) return false;
+					} else if (!decode_string(p, end, h.first)) {
+						return false;
+					}
+					if (!decode_string(p, end, h.second)) return false;
+					if (indexing) insert(h);
+					headers.push_back(h);
+				}
+			}
+			return true;
+		}
+
+		/////////////////////////////////////
+		ZbH2Stream::ZbH2Stream(shared_ptr<ZbH2Session> session, shared_ptr<io_service> service)
+			:ZbTransport(ZbTransport::pointer()), session_(session), id_(0), closed_(false),
+			recv_pos_(0), consumed_(0), read_data_(0), read_size_(0),
+			send_data_(0), send_size_(0), send_pos_(0), send_window_(0)
+		{
+			io_service_ = service;
+		}
+
+		socket_ptr ZbH2Stream::lowest_socket() {
+			return session_->tls_->lowest_socket();
+		}
+
+		void ZbH2Stream::close() {
+			if (closed_) return;
+			closed_ = true;
+
+			error_code aborted = make_error_code(errc::operation_canceled);
+			if (!connect_handler_.empty()) {
+				invoke_callback(boost::bind(connect_handler_, aborted));
+				connect_handler_.clear();
+			}
+			if (!read_handler_.empty()) {
+				invoke_callback(boost::bind(read_handler_, aborted, 0));
+				read_handler_.clear();
+			}
+			if (!send_handler_.empty()) {
+				invoke_callback(boost::bind(send_handler_, aborted, 0));
+				send_handler_.clear();
+			}
+			session_->stream_closed(boost::static_pointer_cast<ZbH2Stream>(shared_from_this()));
+		}
+
+		void ZbH2Stream::init(const connect_handler_type& handler) {
+			session_->when_ready(handler);
+		}
+
+		void ZbH2Stream::async_connect(string host, string port, const connect_handler_type& handler) {
+			if (closed_ || id_ != 0) {
+				invoke_callback(boost::bind(handler, make_error_code(errc::connection_already_in_progress)));
+				return;
+			}
+
+			string authority = host.find(':') != string::npos ? "[" + host + "]:" + port : host + ":" + port;
+			gdebug(gconf_type::DEBUG_HTTP, "ZbH2Stream", string("CONNECT ") + authority);
+			session_->open(boost::static_pointer_cast<ZbH2Stream>(shared_from_this()), authority, handler);
+		}
+
+		void ZbH2Stream::async_send(const data_type data,const size_t size, const write_handler_type& handler) {
+			if (closed_ || error_) {
+				invoke_callback(boost::bind(handler, error_ ? error_ : make_error_code(errc::connection_aborted), 0));
+				return;
+			}
+
+			send_data_ = data;
+			send_size_ = size;
+			send_pos_ = 0;
+			send_handler_ = handler;
+			session_->schedule(boost::static_pointer_cast<ZbH2Stream>(shared_from_this()));
+		}
+
+		void ZbH2Stream::async_receive(const data_type& data, const size_t& size, const read_handler_type& handler) {
+			if (closed_) {
+				invoke_callback(boost::bind(handler, make_error_code(errc::connection_aborted), 0));
+				return;
+			}
+
+			read_data_ = data;
+			read_size_ = size;
+			read_handler_ = handler;
+			complete_read();
+		}
+
+		/// Hands buffered payload or the end of the stream to a pending read. Only
+		/// payload handed on opens the flow control windows again.
+		void ZbH2Stream::complete_read() {
+			if (read_handler_.empty()) return;
+
+			read_handler_type handler;
+			handler.swap(read_handler_);
+
+			if (recv_pos_ < recv_.size()) {
+				size_t n = std::min(read_size_, recv_.size() - recv_pos_);
+				memcpy(read_data_, &recv_[recv_pos_], n);
+				recv_pos_ += n;
+				if (recv_pos_ == recv_.size()) {
+					recv_.clear();
+					recv_pos_ = 0;
+				}
+				session_->consumed(boost::static_pointer_cast<ZbH2Stream>(shared_from_this()), n);
+				invoke_callback(boost::bind(handler, no_error_, n));
+			} else if (error_) {
+				invoke_callback(boost::bind(handler, error_, 0));
+			} else {
+				handler.swap(read_handler_);
+			}
+		}
+
+		void ZbH2Stream::deliver(const uint8_t* data, size_t size) {
+			if (closed_) return;
+			recv_.insert(recv_.end(), data, data + size);
+			complete_read();
+		}
+
+		void ZbH2Stream::finish(const error_code& error) {
+			if (error_) return;
+			error_ = error;
+			if (last_error_.empty()) last_error_ = error.message();
+
+			if (!connect_handler_.empty()) {
+				invoke_callback(boost::bind(connect_handler_, error));
+				connect_handler_.clear();
+			}
+			if (!send_handler_.empty()) {
+				invoke_callback(boost::bind(send_handler_, error, 0));
+				send_handler_.clear();
+			}
+			complete_read();
+		}
+
+		/////////////////////////////////////
+		ZbH2Session::ZbH2Session(ZbTransport::pointer link, config_type& conf, ZbSslContext::pointer ctx, string name)
+			:service_(link->service()), name_(name), ready_(false), closed_(false), goaway_(false), writing_(false), reading_(false),
+			next_id_(1), send_window_(DEFAULT_WINDOW), peer_initial_window_(DEFAULT_WINDOW),
+			peer_max_frame_(MAX_FRAME_SIZE), peer_max_streams_(0x7fffffff), consumed_(0),
+			header_stream_(0), header_end_stream_(false), rend_(0)
+		{
+			tls_.reset(new ZbHttpsTransport(link, conf, ctx));
+			tls_->alpn(string("\x02h2", 3));
+		}
+
+		ZbH2Session::~ZbH2Session() {
+			gtrace("ZbH2Session", name_ + " destroyed");
+		}
+
+		void ZbH2Session::start() {
+			tls_->init(boost::bind(&ZbH2Session::handle_handshake, shared_from_this(), _1));
+		}
+
+		void ZbH2Session::close() {
+			fail(make_error_code(errc::connection_aborted));
+		}
+
+		ZbH2Stream::pointer ZbH2Session::create_stream() {
+			return ZbH2Stream::pointer(new ZbH2Stream(shared_from_this(), service_));
+		}
+
+		void ZbH2Session::handle_handshake(const error_code& error) {
+			if (error) {
+				gconf.log(gconf_type::DEBUG_HTTP, gconf_type::ZBLOG_WARN, "ZbH2Session", name_ + " handshake failed: " + error.message());
+				fail(error);
+				return;
+			}
+
+			if (tls_->selected_alpn().compare("h2") != 0) {
+				gconf.log(gconf_type::DEBUG_HTTP, gconf_type::ZBLOG_WARN, "ZbH2Session", name_ + " the proxy does not speak h2");
+				fail(make_error_code(errc::protocol_not_supported));
+				return;
+			}
+
+			// The preface goes ahead of anything queued
+			std::vector<uint8_t> frames;
+			frames.swap(pending_);
+			static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+			pending_.assign(preface, preface + sizeof(preface) - 1);
+
+			uint8_t settings[] = {
+				0, 2, 0, 0, 0, 0, // no push
+				0, 4, (uint8_t)(STREAM_WINDOW >> 24), (uint8_t)(STREAM_WINDOW >> 16), (uint8_t)(STREAM_WINDOW >> 8), (uint8_t)STREAM_WINDOW};
+			add_frame(SETTINGS, 0, 0, settings, sizeof(settings));
+			add_window_update(0, SESSION_WINDOW - DEFAULT_WINDOW);
+			pending_.insert(pending_.end(), frames.begin(), frames.end());
+
+			gconf.log(gconf_type::DEBUG_HTTP, gconf_type::ZBLOG_INFO, "ZbH2Session", name_ + " connected");
+			ready_ = true;
+			BOOST_FOREACH(ZbTransport::connect_handler_type& h, waiters_) {
+				service_->post(boost::bind(h, error_code()));
+			}
+			waiters_.clear();
+
+			start_read();
+			flush();
+		}
+
+		void ZbH2Session::when_ready(const ZbTransport::connect_handler_type& handler) {
+			if (closed_)
+				service_->post(boost::bind(handler, make_error_code(errc::connection_aborted)));
+			else if (ready_)
+				service_->post(boost::bind(handler, error_code()));
+			else
+				waiters_.push_back(handler);
+		}
+
+		/// Ends the connection and every stream on it
+		void ZbH2Session::fail(const error_code& error) {
+			if (closed_) return;
+			closed_ = true;
+			gconf.log(gconf_type::DEBUG_HTTP, gconf_type::ZBLOG_INFO, "ZbH2Session", name_ + " closed: " + error.message());
+
+			pointer self = shared_from_this();
+			tls_->close();
+
+			BOOST_FOREACH(ZbTransport::connect_handler_type& h, waiters_) {
+				service_->post(boost::bind(h, error));
+			}
+			waiters_.clear();
+
+			stream_map streams;
+			streams.swap(streams_);
+			for (stream_map::iterator it = streams.begin(); it != streams.end(); ++it)
+				it->second->finish(make_error_code(errc::connection_reset));
+
+			sendable_.clear();
+			pending_.clear();
+			pending_done_.clear();
+			if (!close_handler_.empty()) close_handler_(self);
+		}
+
+		/// Tells the proxy why the connection ends. Nothing is read or framed after
+		/// the GOAWAY, the session fails once it is written.
+		void ZbH2Session::go_away(uint32_t code, const error_code& error) {
+			if (closed_ || closing_) return;
+			closing_ = error;
+			goaway_ = true;
+			sendable_.clear();
+
+			// We never accept streams, so the last one processed is 0
+			uint8_t data[8] = {0, 0, 0, 0, (uint8_t)(code >> 24), (uint8_t)(code >> 16), (uint8_t)(code >> 8), (uint8_t)code};
+			add_frame(GOAWAY, 0, 0, data, sizeof(data));
+			flush();
+		}
+
+		/// Ends a stream the proxy broke the rules on, the rest of the connection goes on
+		void ZbH2Session::reset(ZbH2Stream::pointer stream, uint32_t code) {
+			streams_.erase(stream->id_);
+			uint8_t data[4] = {(uint8_t)(code >> 24), (uint8_t)(code >> 16), (uint8_t)(code >> 8), (uint8_t)code};
+			add_frame(RST_STREAM, 0, stream->id_, data, sizeof(data));
+			consumed(ZbH2Stream::pointer(), stream->recv_.size() - stream->recv_pos_);
+
+			stream->last_error_ = "stream reset by us, code " + boost::lexical_cast<string>(code);
+			stream->finish(make_error_code(errc::protocol_error));
+		}
+
+		void ZbH2Session::open(ZbH2Stream::pointer stream, const string& authority, const ZbTransport::connect_handler_type& handler) {
+			if (closed_ || goaway_) {
+				service_->post(boost::bind(handler, make_error_code(errc::connection_aborted)));
+				return;
+			}
+
+			stream->id_ = next_id_;
+			stream->send_window_ = peer_initial_window_;
+			stream->connect_handler_ = handler;
+			streams_[next_id_] = stream;
+
+			std::vector<uint8_t> block;
+			ZbHpack::encode(block, 2, "CONNECT"); // :method
+			ZbHpack::encode(block, 1, authority); // :authority
+			add_frame(HEADERS, END_HEADERS, next_id_, &block[0], block.size());
+			next_id_ += 2;
+			flush();
+		}
+
+		void ZbH2Session::stream_closed(ZbH2Stream::pointer stream) {
+			if (stream->id_ == 0 || streams_.erase(stream->id_) == 0 || closed_) return;
+
+			uint8_t cancel[4] = {0, 0, 0, CANCEL};
+			add_frame(RST_STREAM, 0, stream->id_, cancel, sizeof(cancel));
+			// What the stream never read still counts against the connection
+			consumed(ZbH2Stream::pointer(), stream->recv_.size() - stream->recv_pos_);
+
+			if (goaway_ && streams_.empty())
+				close();
+			else
+				flush();
+		}
+
+		/// Opens the windows again for payload which has been handed on
+		void ZbH2Session::consumed(ZbH2Stream::pointer stream, size_t size) {
+			if (closed_ || size == 0) return;
+
+			if (stream.get() != 0 && streams_.count(stream->id_) > 0 && !stream->error_) {
+				stream->consumed_ += size;
+				if (stream->consumed_ >= STREAM_WINDOW / 2) {
+					add_window_update(stream->id_, stream->consumed_);
+					stream->consumed_ = 0;
+				}
+			}
+
+			consumed_ += size;
+			if (consumed_ >= SESSION_WINDOW / 2) {
+				add_window_update(0, consumed_);
+				consumed_ = 0;
+			}
+			flush();
+		}
+
+		void ZbH2Session::add_frame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t* data, size_t size) {
+			uint8_t header[FRAME_HEADER_SIZE] = {
+				(uint8_t)(size >> 16), (uint8_t)(size >> 8), (uint8_t)size, type, flags,
+				(uint8_t)((id >> 24) & 0x7f), (uint8_t)(id >> 16), (uint8_t)(id >> 8), (uint8_t)id};
+			pending_.insert(pending_.end(), header, header + FRAME_HEADER_SIZE);
+			if (size > 0) pending_.insert(pending_.end(), data, data + size);
+		}
+
+		void ZbH2Session::add_window_update(uint32_t id, size_t increment) {
+			uint8_t data[4] = {(uint8_t)((increment >> 24) & 0x7f), (uint8_t)(increment >> 16), (uint8_t)(increment >> 8), (uint8_t)increment};
+			add_frame(WINDOW_UPDATE, 0, id, data, sizeof(data));
+		}
+
+		void ZbH2Session::schedule(ZbH2Stream::pointer stream) {
+			sendable_.push_back(stream);
+			pump();
+			flush();
+		}
+
+		/// Frames pending writes as far as the windows allow. A stream out of window
+		/// waits for its WINDOW_UPDATE, the rest wait for the connection's.
+		void ZbH2Session::pump() {
+			if (closing_) return;
+			while (!sendable_.empty() && send_window_ > 0) {
+				ZbH2Stream::pointer s = sendable_.front();
+				sendable_.pop_front();
+				if (s->closed_ || s->error_ || s->send_handler_.empty() || streams_.count(s->id_) == 0) continue;
+
+				while (s->send_pos_ < s->send_size_ && s->send_window_ > 0 && send_window_ > 0) {
+					size_t n = std::min<int64_t>(std::min<int64_t>(s->send_size_ - s->send_pos_, peer_max_frame_), std::min(s->send_window_, send_window_));
+					add_frame(DATA, 0, s->id_, s->send_data_ + s->send_pos_, n);
+					s->send_pos_ += n;
+					s->send_window_ -= n;
+					send_window_ -= n;
+				}
+
+				if (s->send_pos_ == s->send_size_) {
+					pending_done_.push_back(boost::bind(s->send_handler_, error_code(), s->send_size_));
+					s->send_handler_.clear();
+				} else if (s->send_window_ > 0) {
+					sendable_.push_front(s);
+				}
+			}
+		}
+
+		void ZbH2Session::flush() {
+			if (closed_ || !ready_ || writing_ || pending_.empty()) return;
+
+			pending_.swap(sending_);
+			pending_done_.swap(sending_done_);
+			writing_ = true;
+			tls_->async_send(&sending_[0], sending_.size(), boost::bind(&ZbH2Session::handle_write, shared_from_this(), _1, _2));
+		}
+
+		void ZbH2Session::handle_write(const error_code& error, size_t size) {
+			writing_ = false;
+			if (error) {
+				fail(error);
+				return;
+			}
+
+			BOOST_FOREACH(ZbTransport::callback_type& done, sending_done_) {
+				service_->post(done);
+			}
+			sending_done_.clear();
+			sending_.clear();
+			if (closing_ && pending_.empty()) {
+				fail(closing_);
+				return;
+			}
+			flush();
+		}
+
+		void ZbH2Session::start_read() {
+			if (closed_ || reading_) return;
+			reading_ = true;
+			tls_->async_receive(rbuf_ + rend_, RBUF_SIZE - rend_, boost::bind(&ZbH2Session::handle_read, shared_from_this(), _1, _2));
+		}
+
+		void ZbH2Session::handle_read(const error_code& error, size_t size) {
+			reading_ = false;
+			if (closed_ || closing_) return;
+			if (error) {
+				fail(error);
+				return;
+			}
+
+			rend_ += size;
+			size_t pos = 0;
+			while (rend_ - pos >= FRAME_HEADER_SIZE) {
+				uint8_t* h = rbuf_ + pos;
+				size_t len = ((size_t)h[0] << 16) | ((size_t)h[1] << 8) | h[2];
+				uint32_t id = ((uint32_t)(h[5] & 0x7f) << 24) | ((uint32_t)h[6] << 16) | ((uint32_t)h[7] << 8) | h[8];
+				if (len > MAX_FRAME_SIZE) {
+					go_away(FRAME_SIZE_ERROR, make_error_code(errc::message_size));
+					return;
+				}
+				if (rend_ - pos < FRAME_HEADER_SIZE + len) break;
+
+				if (!dispatch(h[3], h[4], id, h + FRAME_HEADER_SIZE, len)) {
+					gconf.log(gconf_type::DEBUG_HTTP, gconf_type::ZBLOG_WARN, "ZbH2Session", name_ + " protocol error in frame type " + boost::lexical_cast<string>((int)h[3]));
+					go_away(PROTOCOL_ERROR, make_error_code(errc::protocol_error));
+					return;
+				}
+				if (closed_ || closing_) return;
+				pos += FRAME_HEADER_SIZE + len;
+			}
+
+			memmove(rbuf_, rbuf_ + pos, rend_ - pos);
+			rend_ -= pos;
+			pump();
+			flush();
+			start_read();
+		}
+
+		/// Returns false on a connection error
+		bool ZbH2Session::dispatch(uint8_t type, uint8_t flags, uint32_t id, const uint8_t* data, size_t size) {
+			// A header block may not be interrupted
+			if (header_stream_ != 0 && (type != CONTINUATION || id != header_stream_)) return false;
+
+			stream_map::iterator it = streams_.find(id);
+			ZbH2Stream::pointer s = it == streams_.end() ? ZbH2Stream::pointer() : it->second;
+
+			switch (type) {
+			case DATA: {
+				if (id == 0) return false;
+				const uint8_t* p = data;
+				size_t n = size;
+				if (flags & PADDED) {
+					if (size < 1 || data[0] >= size) return false;
+					p = data + 1;
+					n = size - 1 - data[0];
+				}
+				// Padding and data for streams we dropped are never read, give the window back now
+				if (s.get() != 0 && s->connect_handler_.empty()) {
+					s->deliver(p, n);
+					consumed(s, size - n);
+				} else {
+					consumed(ZbH2Stream::pointer(), size);
+				}
+				if ((flags & END_STREAM) && s.get() != 0) s->finish(boost::asio::error::eof);
+				break;
+			}
+			case HEADERS: {
+				if (id == 0) return false;
+				size_t off = 0, pad = 0;
+				if (flags & PADDED) {
+					if (size < 1) return false;
+					pad = data[0];
+					off = 1;
+				}
+				if (flags & PRIORITY_FLAG) off += 5;
+				if (off + pad > size) return false;
+
+				header_block_.assign(data + off, data + size - pad);
+				header_stream_ = id;
+				header_end_stream_ = (flags & END_STREAM) != 0;
+				if (flags & END_HEADERS) return handle_headers(id, header_end_stream_);
+				break;
+			}
+			case CONTINUATION:
+				if (header_stream_ == 0) return false;
+				header_block_.insert(header_block_.end(), data, data + size);
+				if (flags & END_HEADERS) return handle_headers(id, header_end_stream_);
+				break;
+			case RST_STREAM:
+				if (size != 4 || id == 0) return false;
+				if (s.get() != 0) {
+					streams_.erase(it);
+					s->last_error_ = "stream reset by the proxy, code " + boost::lexical_cast<string>((int)data[3]);
+					s->finish(make_error_code(errc::connection_reset));
+				}
+				break;
+			case SETTINGS:
+				if (id != 0) return false;
+				if (flags & ACK) break;
+				return handle_settings(data, size);
+			case PUSH_PROMISE:
+				// Disabled by our settings
+				return false;
+			case PING:
+				if (size != 8 || id != 0) return false;
+				if ((flags & ACK) == 0) add_frame(PING, ACK, 0, data, size);
+				break;
+			case GOAWAY: {
+				if (size < 8 || id != 0) return false;
+				uint32_t last = ((uint32_t)(data[0] & 0x7f) << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+				gconf.log(gconf_type::DEBUG_HTTP, gconf_type::ZBLOG_INFO, "ZbH2Session", name_ + " is going away");
+				goaway_ = true;
+				// Streams the proxy has not seen are failed, the others may finish
+				while (!streams_.empty() && streams_.rbegin()->first > last) {
+					ZbH2Stream::pointer t = streams_.rbegin()->second;
+					streams_.erase(t->id_);
+					t->finish(make_error_code(errc::connection_reset));
+				}
+				if (streams_.empty()) close();
+				break;
+			}
+			case WINDOW_UPDATE: {
+				if (size != 4) return false;
+				uint32_t increment = ((uint32_t)(data[0] & 0x7f) << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+				if (id == 0) {
+					if (increment == 0) return false;
+					if (send_window_ + increment > MAX_WINDOW) {
+						gconf.log(gconf_type::DEBUG_HTTP, gconf_type::ZBLOG_WARN, "ZbH2Session", name_ + " connection window overflow");
+						go_away(FLOW_CONTROL_ERROR, make_error_code(errc::protocol_error));
+						break;
+					}
+					send_window_ += increment;
+				} else if (s.get() != 0) {
+					if (increment == 0)
+						reset(s, PROTOCOL_ERROR);
+					else if (s->send_window_ + increment > MAX_WINDOW)
+						reset(s, FLOW_CONTROL_ERROR);
+					else {
+						s->send_window_ += increment;
+						if (!s->send_handler_.empty()) sendable_.push_back(s);
+					}
+				}
+				break;
+			}
+			default:
+				// PRIORITY and unknown frames are ignored
+				break;
+			}
+			return true;
+		}
+
+		bool ZbH2Session::handle_settings(const uint8_t* data, size_t size) {
+			if (size % 6 != 0) return false;
+
+			for (size_t i = 0; i < size; i += 6) {
+				uint16_t key = ((uint16_t)data[i] << 8) | data[i + 1];
+				uint32_t value = ((uint32_t)data[i + 2] << 24) | ((uint32_t)data[i + 3] << 16) | ((uint32_t)data[i + 4] << 8) | data[i + 5];
+				switch (key) {
+				case 3: // MAX_CONCURRENT_STREAMS
+					peer_max_streams_ = value;
+					break;
+				case 4: { // INITIAL_WINDOW_SIZE applies to open streams too
+					if (value > MAX_WINDOW) return false;
+					int64_t delta = (int64_t)value - peer_initial_window_;
+					peer_initial_window_ = value;
+					for (stream_map::iterator it = streams_.begin(); it != streams_.end(); ++it) {
+						it->second->send_window_ += delta;
+						if (delta > 0 && !it->second->send_handler_.empty()) sendable_.push_back(it->second);
+					}
+					break;
+				}
+				case 5: // MAX_FRAME_SIZE
+					if (value < MAX_FRAME_SIZE || value > 0xffffff) return false;
+					peer_max_frame_ = value;
+					break;
+				}
+			}
+
+			add_frame(SETTINGS, ACK, 0, 0, 0);
+			return true;
+		}
+
+		bool ZbH2Session::handle_headers(uint32_t id, bool end_stream) {
+			header_stream_ = 0;
+			ZbHpack::header_list headers;
+			if (!hpack_.decode(header_block_.empty() ? 0 : &header_block_[0], header_block_.size(), headers)) return false;
+
+			stream_map::iterator it = streams_.find(id);
+			if (it == streams_.end()) return true;
+			ZbH2Stream::pointer s = it->second;
+
+			if (!s->connect_handler_.empty()) {
+				string status;
+				BOOST_FOREACH(ZbHpack::header_type& h, headers) {
+					if (h.first.compare(":status") == 0) status = h.second;
+				}
+				// Informational answers come before the real one
+				if (!status.empty() && status[0] == '1' && !end_stream) return true;
+
+				ZbTransport::connect_handler_type handler;
+				handler.swap(s->connect_handler_);
+				if (!status.empty() && status[0] == '2') {
+					gdebug(gconf_type::DEBUG_HTTP, "ZbH2Session", name_ + " stream " + boost::lexical_cast<string>(id) + " connected");
+					service_->post(boost::bind(handler, error_code()));
+				} else {
+					s->last_error_ = "proxy answered " + (status.empty() ? string("without status") : status);
+					service_->post(boost::bind(handler, make_error_code(errc::permission_denied)));
+				}
+			}
+
+			if (end_stream) s->finish(boost::asio::error::eof);
+			return true;
+		}
+	}
+}
+#endif // WITH_OPENSSL
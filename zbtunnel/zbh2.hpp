@@ -0,0 +1,185 @@
+/******************************************************************************
+* The MIT License (MIT)
+*
+* Copyright (c) 2013 yufeiwu@gmail.com
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*******************************************************************************/
+
+#pragma once
+
+#include "zbtunnel/zbtransport.hpp"
+
+#ifdef WITH_OPENSSL
+namespace zb {
+	namespace tunnel {
+
+		/// The parts of HPACK (RFC 7541) a CONNECT client needs. Requests are sent as
+		/// literals which never touch the tables, responses are decoded in full.
+		/// A decoder belongs to one connection because of its dynamic table.
+		class ZbHpack
+		{
+		public:
+			typedef std::pair<string, string> header_type;
+			typedef std::vector<header_type> header_list;
+
+			ZbHpack();
+
+			/// A literal without indexing, named by a static table entry
+			static void encode(std::vector<uint8_t>& out, size_t name_index, const string& value);
+			bool decode(const uint8_t* data, size_t size, header_list& headers);
+
+		protected:
+			static void encode_int(std::vector<uint8_t>& out, uint8_t first, int prefix, size_t v);
+			static bool decode_int(const uint8_t*& p, const uint8_t* end, int prefix, size_t& v);
+			static bool decode_huffman(const uint8_t* p, size_t size, string& s);
+			bool decode_string(const uint8_t*& p, const uint8_t* end, string& s);
+			bool lookup(size_t index, header_type& h);
+			void insert(const header_type& h);
+			void evict();
+
+			std::deque<header_type> dynamic_; // newest first
+			size_t size_, max_size_;
+		};
+
+		class ZbH2Session;
+
+		/// One CONNECT tunnel on a shared HTTP/2 connection. init() waits for the
+		/// connection, async_connect() sends the CONNECT request.
+		class ZbH2Stream: public ZbTransport
+		{
+			friend class ZbH2Session;
+		public:
+			typedef shared_ptr<ZbH2Stream> pointer;
+
+			ZbH2Stream(shared_ptr<ZbH2Session> session, shared_ptr<io_service> service);
+
+			virtual bool is_open() {return !closed_ && !error_;}
+			virtual socket_ptr lowest_socket();
+			virtual void close();
+			virtual void init(const connect_handler_type& handler);
+			virtual void async_connect(string host, string port, const connect_handler_type& handler);
+			virtual void async_send(const data_type data,const size_t size, const write_handler_type& handler);
+			virtual void async_receive(const data_type& data, const size_t& size, const read_handler_type& handler);
+
+		protected:
+			void deliver(const uint8_t* data, size_t size);
+			void finish(const error_code& error);
+			void complete_read();
+
+			shared_ptr<ZbH2Session> session_;
+			uint32_t id_;
+			bool closed_;
+			error_code error_;
+			connect_handler_type connect_handler_; // until the proxy answers the CONNECT
+
+			std::vector<uint8_t> recv_;
+			size_t recv_pos_, consumed_;
+			data_type read_data_;
+			size_t read_size_;
+			read_handler_type read_handler_;
+
+			data_type send_data_;
+			size_t send_size_, send_pos_;
+			int64_t send_window_;
+			write_handler_type send_handler_;
+		};
+
+		/// An HTTP/2 connection over TLS to a proxy, carrying one CONNECT stream per
+		/// tunnel connection with connection and stream level flow control.
+		class ZbH2Session: public boost::enable_shared_from_this<ZbH2Session>
+		{
+			friend class ZbH2Stream;
+		public:
+			typedef shared_ptr<ZbH2Session> pointer;
+			typedef boost::function<void (pointer)> close_handler_type;
+
+			enum {FRAME_HEADER_SIZE = 9, MAX_FRAME_SIZE = 16384, DEFAULT_WINDOW = 65535,
+				STREAM_WINDOW = 1 << 20, SESSION_WINDOW = 1 << 24, RBUF_SIZE = 65536};
+			enum {DATA = 0, HEADERS = 1, PRIORITY = 2, RST_STREAM = 3, SETTINGS = 4, PUSH_PROMISE = 5,
+				PING = 6, GOAWAY = 7, WINDOW_UPDATE = 8, CONTINUATION = 9};
+			enum {END_STREAM = 0x1, ACK = 0x1, END_HEADERS = 0x4, PADDED = 0x8, PRIORITY_FLAG = 0x20};
+			enum {PROTOCOL_ERROR = 1, FLOW_CONTROL_ERROR = 3, FRAME_SIZE_ERROR = 6, CANCEL = 8};
+			enum {MAX_WINDOW = 0x7fffffff};
+
+			/// link is the established connection to the proxy, TLS is done on top of it
+			ZbH2Session(ZbTransport::pointer link, config_type& conf, ZbSslContext::pointer ctx, string name);
+			~ZbH2Session();
+
+			void start();
+			void close();
+			ZbH2Stream::pointer create_stream();
+			/// Whether another tunnel may use this connection
+			bool can_open() {return !closed_ && !goaway_ && streams_.size() < peer_max_streams_;}
+			string name() {return name_;}
+
+			ZB_GETTER_SETTER(close_handler, close_handler_type);
+
+		protected:
+			typedef std::map<uint32_t, ZbH2Stream::pointer> stream_map;
+
+			void handle_handshake(const error_code& error);
+			void fail(const error_code& error);
+			void go_away(uint32_t code, const error_code& error);
+			void reset(ZbH2Stream::pointer stream, uint32_t code);
+			void when_ready(const ZbTransport::connect_handler_type& handler);
+			void open(ZbH2Stream::pointer stream, const string& authority, const ZbTransport::connect_handler_type& handler);
+			void stream_closed(ZbH2Stream::pointer stream);
+			void consumed(ZbH2Stream::pointer stream, size_t size);
+			void add_frame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t* data, size_t size);
+			void add_window_update(uint32_t id, size_t increment);
+			void schedule(ZbH2Stream::pointer stream);
+			void pump();
+			void flush();
+			void start_read();
+			void handle_write(const error_code& error, size_t size);
+			void handle_read(const error_code& error, size_t size);
+			bool dispatch(uint8_t type, uint8_t flags, uint32_t id, const uint8_t* data, size_t size);
+			bool handle_settings(const uint8_t* data, size_t size);
+			bool handle_headers(uint32_t id, bool end_stream);
+
+			shared_ptr<io_service> service_;
+			string name_;
+			shared_ptr<ZbHttpsTransport> tls_;
+			close_handler_type close_handler_;
+			bool ready_, closed_, goaway_, writing_, reading_;
+			error_code closing_; // set once our GOAWAY is queued, the session fails after writing it
+			uint32_t next_id_;
+			stream_map streams_;
+			std::deque<ZbH2Stream::pointer> sendable_; // streams with data to frame
+			std::vector<ZbTransport::connect_handler_type> waiters_; // init() calls before the handshake is done
+
+			int64_t send_window_; // of the connection
+			int64_t peer_initial_window_;
+			size_t peer_max_frame_, peer_max_streams_, consumed_;
+
+			ZbHpack hpack_;
+			std::vector<uint8_t> header_block_; // HEADERS and CONTINUATION fragments
+			uint32_t header_stream_;
+			bool header_end_stream_;
+
+			std::vector<uint8_t> pending_, sending_;
+			std::vector<ZbTransport::callback_type> pending_done_, sending_done_;
+
+			uint8_t rbuf_[RBUF_SIZE];
+			size_t rend_;
+		};
+	}
+}
+#endif // WITH_OPENSSL
@@ -0,0 +1,333 @@
+#include "zbtunnel/zbmux.hpp"
+
+namespace zb {
+	namespace tunnel {
+
+		ZbMuxStream::ZbMuxStream(shared_ptr<ZbMuxSession> session, uint32_t id, shared_ptr<io_service> service)
+			:ZbTransport(ZbTransport::pointer()), session_(session), id_(id), closed_(false),
+			recv_pos_(0), consumed_(0), recv_window_(ZbMuxSession::WINDOW), read_data_(0), read_size_(0),
+			send_data_(0), send_size_(0), send_pos_(0), send_window_(ZbMuxSession::WINDOW)
+		{
+			io_service_ = service;
+		}
+
+		void ZbMuxStream::close() {
+			if (closed_) return;
+			closed_ = true;
+
+			error_code aborted = make_error_code(errc::operation_canceled);
+			if (!read_handler_.empty()) {
+				invoke_callback(boost::bind(read_handler_, aborted, 0));
+				read_handler_.clear();
+			}
+			if (!send_handler_.empty()) {
+				invoke_callback(boost::bind(send_handler_, aborted, 0));
+				send_handler_.clear();
+			}
+			session_->stream_closed(boost::static_pointer_cast<ZbMuxStream>(shared_from_this()));
+		}
+
+		void ZbMuxStream::async_send(const data_type data,const size_t size, const write_handler_type& handler) {
+			if (closed_ || error_) {
+				invoke_callback(boost::bind(handler, error_ ? error_ : make_error_code(errc::connection_aborted), 0));
+				return;
+			}
+
+			send_data_ = data;
+			send_size_ = size;
+			send_pos_ = 0;
+			send_handler_ = handler;
+			session_->schedule(boost::static_pointer_cast<ZbMuxStream>(shared_from_this()));
+		}
+
+		void ZbMuxStream::async_receive(const data_type& data, const size_t& size, const read_handler_type& handler) {
+			if (closed_) {
+				invoke_callback(boost::bind(handler, make_error_code(errc::connection_aborted), 0));
+				return;
+			}
+
+			read_data_ = data;
+			read_size_ = size;
+			read_handler_ = handler;
+			complete_read();
+		}
+
+		/// Hands buffered payload or the end of the stream to a pending read, and
+		/// acknowledges what has been handed on once it adds up to half a window
+		void ZbMuxStream::complete_read() {
+			if (read_handler_.empty()) return;
+
+			read_handler_type handler;
+			handler.swap(read_handler_);
+
+			if (recv_pos_ < recv_.size()) {
+				size_t n = std::min(read_size_, recv_.size() - recv_pos_);
+				memcpy(read_data_, &recv_[recv_pos_], n);
+				recv_pos_ += n;
+				if (recv_pos_ == recv_.size()) {
+					recv_.clear();
+					recv_pos_ = 0;
+				}
+
+				consumed_ += n;
+				if (consumed_ >= ZbMuxSession::WINDOW / 2) {
+					session_->add_ack(id_, consumed_);
+					session_->flush();
+					recv_window_ += consumed_;
+					consumed_ = 0;
+				}
+				invoke_callback(boost::bind(handler, no_error_, n));
+			} else if (error_) {
+				invoke_callback(boost::bind(handler, error_, 0));
+			} else {
+				handler.swap(read_handler_);
+			}
+		}
+
+		void ZbMuxStream::deliver(const uint8_t* data, size_t size) {
+			if (closed_) return;
+			recv_.insert(recv_.end(), data, data + size);
+			complete_read();
+		}
+
+		void ZbMuxStream::finish(const error_code& error) {
+			if (error_) return;
+			error_ = error;
+			last_error_ = error.message();
+
+			if (!send_handler_.empty()) {
+				invoke_callback(boost::bind(send_handler_, error, 0));
+				send_handler_.clear();
+			}
+			complete_read();
+		}
+
+		/////////////////////////////////////
+		ZbMuxSession::ZbMuxSession(shared_ptr<io_service> service, string name)
+			:service_(service), name_(name), closed_(false), writing_(false), reading_(false), next_id_(1), rend_(0)
+		{
+		}
+
+		ZbMuxSession::~ZbMuxSession() {
+			gtrace("ZbMuxSession", name_ + " destroyed");
+		}
+
+		ZbMuxStream::pointer ZbMuxSession::open_stream() {
+			ZbMuxStream::pointer stream(new ZbMuxStream(shared_from_this(), next_id_++, service_));
+			if (closed_) {
+				stream->finish(make_error_code(errc::connection_aborted));
+				return stream;
+			}
+
+			streams_[stream->id()] = stream;
+			add_frame(stream->id(), OPEN, 0, 0);
+			flush();
+			return stream;
+		}
+
+		void ZbMuxSession::handle_chain(const error_code& error, ZbTransport::pointer link) {
+			if (error) {
+				gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_WARN, "ZbMuxSession", name_ + " unable to connect: " + error.message());
+				fail(error);
+				return;
+			}
+
+			gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_INFO, "ZbMuxSession", name_ + " connected, carrying " + boost::lexical_cast<string>(streams_.size()) + " streams");
+			link_ = link;
+			if (closed_) {
+				link_->close();
+				return;
+			}
+			start_read();
+			flush();
+		}
+
+		void ZbMuxSession::start(ZbTransport::pointer link, const accept_handler_type& handler) {
+			link_ = link;
+			accept_handler_ = handler;
+			gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_INFO, "ZbMuxSession", name_ + " accepted");
+			start_read();
+		}
+
+		void ZbMuxSession::close() {
+			fail(make_error_code(errc::connection_aborted));
+		}
+
+		/// Ends the session and every stream on it
+		void ZbMuxSession::fail(const error_code& error) {
+			if (closed_) return;
+			closed_ = true;
+			gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_INFO, "ZbMuxSession", name_ + " closed: " + error.message());
+
+			pointer self = shared_from_this();
+			if (link_.get() != 0) link_->close();
+
+			stream_map streams;
+			streams.swap(streams_);
+			for (stream_map::iterator it = streams.begin(); it != streams.end(); ++it)
+				it->second->finish(make_error_code(errc::connection_reset));
+
+			ready_.clear();
+			pending_.clear();
+			pending_done_.clear();
+			if (!close_handler_.empty()) close_handler_(self);
+		}
+
+		void ZbMuxSession::add_frame(uint32_t id, uint8_t type, const uint8_t* data, size_t size) {
+			uint8_t header[HEADER_SIZE] = {
+				(uint8_t)(id >> 24), (uint8_t)(id >> 16), (uint8_t)(id >> 8), (uint8_t)id,
+				type, 0, (uint8_t)(size >> 8), (uint8_t)size};
+			pending_.insert(pending_.end(), header, header + HEADER_SIZE);
+			if (size > 0) pending_.insert(pending_.end(), data, data + size);
+		}
+
+		void ZbMuxSession::add_ack(uint32_t id, size_t count) {
+			if (closed_) return;
+			uint8_t data[4] = {(uint8_t)(count >> 24), (uint8_t)(count >> 16), (uint8_t)(count >> 8), (uint8_t)count};
+			add_frame(id, ACK, data, 4);
+		}
+
+		void ZbMuxSession::schedule(ZbMuxStream::pointer stream) {
+			ready_.push_back(stream);
+			pump();
+			flush();
+		}
+
+		/// Frames the pending writes as far as their windows allow. A write is done
+		/// once the batch holding its last frame has been sent. Streams which ran out
+		/// of window are picked up again by the peer's ACK.
+		void ZbMuxSession::pump() {
+			while (!ready_.empty()) {
+				ZbMuxStream::pointer s = ready_.front();
+				ready_.pop_front();
+				if (s->closed_ || s->send_handler_.empty()) continue;
+
+				while (s->send_pos_ < s->send_size_ && s->send_window_ > 0) {
+					size_t n = std::min(std::min(s->send_size_ - s->send_pos_, s->send_window_), (size_t)MAX_PAYLOAD);
+					add_frame(s->id_, DATA, s->send_data_ + s->send_pos_, n);
+					s->send_pos_ += n;
+					s->send_window_ -= n;
+				}
+
+				if (s->send_pos_ == s->send_size_) {
+					pending_done_.push_back(boost::bind(s->send_handler_, error_code(), s->send_size_));
+					s->send_handler_.clear();
+				}
+			}
+		}
+
+		void ZbMuxSession::flush() {
+			if (closed_ || link_.get() == 0 || writing_ || pending_.empty()) return;
+
+			pending_.swap(sending_);
+			pending_done_.swap(sending_done_);
+			writing_ = true;
+			link_->async_send(&sending_[0], sending_.size(), boost::bind(&ZbMuxSession::handle_write, shared_from_this(), _1, _2));
+		}
+
+		void ZbMuxSession::handle_write(const error_code& error, size_t size) {
+			writing_ = false;
+			if (error) {
+				fail(error);
+				return;
+			}
+
+			BOOST_FOREACH(ZbTransport::callback_type& done, sending_done_) {
+				service_->post(done);
+			}
+			sending_done_.clear();
+			sending_.clear();
+			flush();
+		}
+
+		void ZbMuxSession::start_read() {
+			if (closed_ || reading_) return;
+			reading_ = true;
+			link_->async_receive(rbuf_ + rend_, RBUF_SIZE - rend_, boost::bind(&ZbMuxSession::handle_read, shared_from_this(), _1, _2));
+		}
+
+		void ZbMuxSession::handle_read(const error_code& error, size_t size) {
+			reading_ = false;
+			if (closed_) return;
+			if (error) {
+				fail(error);
+				return;
+			}
+
+			rend_ += size;
+			size_t pos = 0;
+			while (rend_ - pos >= HEADER_SIZE) {
+				uint8_t* h = rbuf_ + pos;
+				uint32_t id = ((uint32_t)h[0] << 24) | ((uint32_t)h[1] << 16) | ((uint32_t)h[2] << 8) | h[3];
+				size_t len = ((size_t)h[6] << 8) | h[7];
+				if (len > MAX_PAYLOAD) {
+					fail(make_error_code(errc::bad_message));
+					return;
+				}
+				if (rend_ - pos < HEADER_SIZE + len) break;
+
+				dispatch(id, h[4], h + HEADER_SIZE, len);
+				if (closed_) return;
+				pos += HEADER_SIZE + len;
+			}
+
+			memmove(rbuf_, rbuf_ + pos, rend_ - pos);
+			rend_ -= pos;
+			pump();
+			flush();
+			start_read();
+		}
+
+		void ZbMuxSession::dispatch(uint32_t id, uint8_t type, const uint8_t* data, size_t size) {
+			stream_map::iterator it = streams_.find(id);
+			ZbMuxStream::pointer s = it == streams_.end() ? ZbMuxStream::pointer() : it->second;
+
+			switch (type) {
+			case OPEN:
+				if (accept_handler_.empty() || s.get() != 0) {
+					fail(make_error_code(errc::protocol_error));
+					return;
+				}
+				s.reset(new ZbMuxStream(shared_from_this(), id, service_));
+				streams_[id] = s;
+				accept_handler_(s);
+				break;
+			case DATA:
+				// Data racing with our CLOSE is dropped
+				if (s.get() == 0) break;
+				if (size > s->recv_window_) {
+					gconf.log(gconf_type::DEBUG_CONNECTION, gconf_type::ZBLOG_WARN, "ZbMuxSession", name_ + " stream " + boost::lexical_cast<string>(id) + " overran its window");
+					fail(make_error_code(errc::bad_message));
+					return;
+				}
+				s->recv_window_ -= size;
+				s->deliver(data, size);
+				break;
+			case ACK:
+				if (size != 4) {
+					fail(make_error_code(errc::bad_message));
+					return;
+				}
+				if (s.get() != 0) {
+					s->send_window_ += ((size_t)data[0] << 24) | ((size_t)data[1] << 16) | ((size_t)data[2] << 8) | data[3];
+					if (!s->send_handler_.empty()) ready_.push_back(s);
+				}
+				break;
+			case CLOSE:
+				if (s.get() != 0) {
+					streams_.erase(it);
+					s->finish(boost::asio::error::eof);
+				}
+				break;
+			default:
+				fail(make_error_code(errc::bad_message));
+			}
+		}
+
+		void ZbMuxSession::stream_closed(ZbMuxStream::pointer stream) {
+			if (streams_.erase(stream->id()) == 0 || closed_) return;
+			add_frame(stream->id(), CLOSE, 0, 0);
+			flush();
+		}
+	}
+}
@@ -0,0 +1,143 @@
+/******************************************************************************
+* The MIT License (MIT)
+*
+* Copyright (c) 2013 yufeiwu@gmail.com
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*******************************************************************************/
+
+#pragma once
+
+#include "zbtunnel/zbtransport.hpp"
+
+namespace zb {
+	namespace tunnel {
+
+		class ZbMuxSession;
+
+		/// One client stream carried by a ZbMuxSession. To ZbConnection it is just
+		/// another transport, connected as soon as it is created.
+		class ZbMuxStream: public ZbTransport
+		{
+			friend class ZbMuxSession;
+		public:
+			typedef shared_ptr<ZbMuxStream> pointer;
+
+			ZbMuxStream(shared_ptr<ZbMuxSession> session, uint32_t id, shared_ptr<io_service> service);
+
+			uint32_t id() {return id_;}
+
+			virtual bool is_open() {return !closed_;}
+			virtual void close();
+			virtual void async_send(const data_type data,const size_t size, const write_handler_type& handler);
+			virtual void async_receive(const data_type& data, const size_t& size, const read_handler_type& handler);
+
+		protected:
+			void deliver(const uint8_t* data, size_t size);
+			void finish(const error_code& error);
+			void complete_read();
+
+			shared_ptr<ZbMuxSession> session_;
+			uint32_t id_;
+			bool closed_;
+			error_code error_; // set once the peer closed the stream or the session died
+
+			// Received payload not read yet starts at recv_pos_. The peer may send
+			// recv_window_ more bytes until we acknowledge some.
+			std::vector<uint8_t> recv_;
+			size_t recv_pos_, consumed_, recv_window_;
+			data_type read_data_;
+			size_t read_size_;
+			read_handler_type read_handler_;
+
+			// The write in progress, framed up to send_pos_
+			data_type send_data_;
+			size_t send_size_, send_pos_, send_window_;
+			write_handler_type send_handler_;
+		};
+
+		/// Carries many streams over one outgoing chain or accepted connection.
+		/// Frames are stream id (4 bytes), type (1), reserved (1), payload length (2)
+		/// followed by the payload, all big endian. A stream may have at most WINDOW
+		/// bytes in flight in each direction, the receiver acknowledges what it has
+		/// handed on with ACK frames carrying a 4 byte count.
+		class ZbMuxSession: public boost::enable_shared_from_this<ZbMuxSession>
+		{
+			friend class ZbMuxStream;
+		public:
+			typedef shared_ptr<ZbMuxSession> pointer;
+			typedef boost::function<void (ZbMuxStream::pointer)> accept_handler_type;
+			typedef boost::function<void (pointer)> close_handler_type;
+
+			enum {HEADER_SIZE = 8, MAX_PAYLOAD = 16384, WINDOW = 262144, RBUF_SIZE = 65536};
+			enum {OPEN = 0, DATA = 1, ACK = 2, CLOSE = 3};
+
+			ZbMuxSession(shared_ptr<io_service> service, string name);
+			~ZbMuxSession();
+
+			/// Client side. Streams may be opened before the chain is ready, their
+			/// data is held until then.
+			ZbMuxStream::pointer open_stream();
+			void handle_chain(const error_code& error, ZbTransport::pointer link);
+
+			/// Server side. The peer opens the streams and handler gets each new one.
+			void start(ZbTransport::pointer link, const accept_handler_type& handler);
+
+			void close();
+			bool is_open() {return !closed_;}
+			size_t streams() {return streams_.size();}
+			string name() {return name_;}
+
+			ZB_GETTER_SETTER(close_handler, close_handler_type);
+
+		protected:
+			typedef std::map<uint32_t, ZbMuxStream::pointer> stream_map;
+
+			void fail(const error_code& error);
+			void add_frame(uint32_t id, uint8_t type, const uint8_t* data, size_t size);
+			void add_ack(uint32_t id, size_t count);
+			void schedule(ZbMuxStream::pointer stream);
+			void pump();
+			void flush();
+			void start_read();
+			void handle_write(const error_code& error, size_t size);
+			void handle_read(const error_code& error, size_t size);
+			void dispatch(uint32_t id, uint8_t type, const uint8_t* data, size_t size);
+			void stream_closed(ZbMuxStream::pointer stream);
+
+			shared_ptr<io_service> service_;
+			string name_;
+			ZbTransport::pointer link_;
+			accept_handler_type accept_handler_;
+			close_handler_type close_handler_;
+			bool closed_, writing_, reading_;
+			uint32_t next_id_;
+			stream_map streams_;
+			std::deque<ZbMuxStream::pointer> ready_; // streams with data to frame
+
+			// Frames collect in pending_ while sending_ is on the wire. The handlers
+			// of the writes framed into a batch are run when it has been sent.
+			std::vector<uint8_t> pending_, sending_;
+			std::vector<ZbTransport::callback_type> pending_done_, sending_done_;
+
+			uint8_t rbuf_[RBUF_SIZE];
+			size_t rend_;
+		};
+	}
+}
@@ -0,0 +1,173 @@
+#include "zbtunnel/zbresolver.hpp"
+
+namespace zb {
+	namespace tunnel {
+
+		ZbResolver* ZbResolver::instance_ = 0;
+		boost::once_flag ZbResolver::instance_flag_ = BOOST_ONCE_INIT;
+
+		ZbResolver::ZbResolver() {
+			work_.reset(new io_service::work(service_));
+			thread_.reset(new boost::thread(boost::bind(&ZbResolver::run, this)));
+		}
+
+		void ZbResolver::create_instance() {
+			ZbResolver::instance_ = new ZbResolver();
+		}
+
+		ZbResolver* ZbResolver::get_instance() {
+			boost::call_once(instance_flag_, &ZbResolver::create_instance);
+			return ZbResolver::instance_;
+		}
+
+		void ZbResolver::run() {
+			service_.run();
+		}
+
+		void ZbResolver::resolve(const string& host, const string& port, shared_ptr<io_service> service, const handler_type& handler) {
+			// Numeric addresses need no lookup
+			error_code ec;
+			boost::asio::ip::address address = boost::asio::ip::address::from_string(host, ec);
+			if (!ec && !port.empty() && port.find_first_not_of("0123456789") == string::npos) {
+				endpoints_ptr endpoints(new endpoints_type(1, tcp::endpoint(address, (unsigned short)atoi(port.c_str()))));
+				service->post(boost::bind(handler, error_code(), endpoints));
+				return;
+			}
+
+			boost::mutex::scoped_lock lock(mutex_);
+			shared_ptr<entry_type>& entry = cache_[host + ":" + port];
+			if (entry.get() == 0) {
+				entry.reset(new entry_type());
+				entry->host = host;
+				entry->port = port;
+			}
+			entry->used = true;
+
+			// A refresh in progress still serves the current addresses
+			bool resolved = entry->endpoints.get() != 0 || entry->error;
+			if (resolved && boost::asio::deadline_timer::traits_type::now() < entry->expires) {
+				service->post(boost::bind(handler, entry->error, entry->endpoints));
+				return;
+			}
+
+			entry->waiters.push_back(waiter_type(service, handler));
+			if (!entry->resolving) start_lookup(entry);
+		}
+
+		void ZbResolver::prefer(const string& host, const string& port, const tcp::endpoint& endpoint) {
+			boost::mutex::scoped_lock lock(mutex_);
+			cache_type::iterator it = cache_.find(host + ":" + port);
+			if (it == cache_.end() || it->second->endpoints.get() == 0 || it->second->preferred == endpoint)
+				return;
+
+			entry_type& entry = *it->second;
+			entry.preferred = endpoint;
+			// The addresses may be in use by a connect, reorder a copy
+			shared_ptr<endpoints_type> endpoints(new endpoints_type(*entry.endpoints));
+			order(*endpoints, endpoint);
+			entry.endpoints = endpoints;
+		}
+
+		/// Puts preferred first, then alternates the address families as in RFC 8305,
+		/// starting with the family the system prefers or else the other one than preferred's
+		void ZbResolver::order(endpoints_type& endpoints, const tcp::endpoint& preferred) {
+			if (endpoints.empty()) return;
+
+			bool found = std::find(endpoints.begin(), endpoints.end(), preferred) != endpoints.end();
+			tcp family = found ? preferred.protocol() : endpoints.front().protocol();
+			endpoints_type same, other;
+			BOOST_FOREACH(const tcp::endpoint& e, endpoints) {
+				if (e == preferred) continue;
+				if (e.protocol() == family)
+					same.push_back(e);
+				else
+					other.push_back(e);
+			}
+
+			endpoints_type& first = found ? other : same;
+			endpoints_type& second = found ? same : other;
+			endpoints.clear();
+			if (found) endpoints.push_back(preferred);
+			for (size_t i = 0; i < std::max(first.size(), second.size()); i++) {
+				if (i < first.size()) endpoints.push_back(first[i]);
+				if (i < second.size()) endpoints.push_back(second[i]);
+			}
+		}
+
+		/// Called with mutex_ held
+		void ZbResolver::start_lookup(shared_ptr<entry_type> entry) {
+			entry->resolving = true;
+			gconf.log(gconf_type::DEBUG_SOCKET, gconf_type::ZBLOG_DEBUG, "ZbResolver", string("Resolving ") + entry->host + ":" + entry->port);
+
+			shared_ptr<tcp::resolver> resolver(new tcp::resolver(service_));
+			tcp::resolver::query query(entry->host, entry->port, tcp::resolver::query::all_matching | tcp::resolver::query::numeric_service);
+			resolver->async_resolve(query, boost::bind(&ZbResolver::handle_resolve, this, entry, _1, _2, resolver));
+		}
+
+		void ZbResolver::handle_resolve(shared_ptr<entry_type> entry, const error_code& error, tcp::resolver::iterator iterator, shared_ptr<tcp::resolver> resolver) {
+			shared_ptr<endpoints_type> endpoints;
+			error_code ec = error;
+			if (!ec) {
+				endpoints.reset(new endpoints_type(iterator, tcp::resolver::iterator()));
+				if (endpoints->empty()) ec = boost::asio::error::host_not_found;
+			}
+
+			boost::posix_time::ptime now = boost::asio::deadline_timer::traits_type::now();
+			boost::posix_time::ptime refresh;
+			vector<waiter_type> waiters;
+			endpoints_ptr result;
+			{
+				boost::mutex::scoped_lock lock(mutex_);
+				entry->resolving = false;
+				entry->used = false;
+
+				if (!ec) {
+					unsigned int ttl = gconf.dns_ttl();
+					order(*endpoints, entry->preferred);
+					entry->endpoints = endpoints;
+					entry->error = ec;
+					entry->expires = now + boost::posix_time::seconds(ttl);
+					// Refresh a little before they expire, if they are still in use by then
+					refresh = entry->expires - boost::posix_time::seconds(std::min(ttl / 2, std::max(ttl / 10, 1u)));
+					gconf.log(gconf_type::DEBUG_SOCKET, gconf_type::ZBLOG_DEBUG, "ZbResolver", entry->host + ":" + entry->port + " resolved to " +
+						boost::lexical_cast<string>(endpoints->size()) + " addresses");
+				} else if (entry->endpoints.get() == 0 || now >= entry->expires) {
+					entry->endpoints.reset();
+					entry->error = ec;
+					entry->expires = now + boost::posix_time::seconds(gconf.dns_negative_ttl());
+					refresh = entry->expires;
+					gconf.log(gconf_type::DEBUG_SOCKET, gconf_type::ZBLOG_DEBUG, "ZbResolver", entry->host + ":" + entry->port + " failed: " + ec.message());
+				} else {
+					// A failed refresh keeps the addresses until they expire
+					refresh = entry->expires;
+				}
+
+				ec = entry->error;
+				result = entry->endpoints;
+				waiters.swap(entry->waiters);
+				if (entry->timer.get() == 0) entry->timer.reset(new boost::asio::deadline_timer(service_));
+				entry->timer->expires_at(refresh);
+				entry->timer->async_wait(boost::bind(&ZbResolver::handle_timer, this, entry, _1));
+			}
+
+			BOOST_FOREACH(waiter_type& w, waiters) {
+				w.first->post(boost::bind(w.second, ec, result));
+			}
+		}
+
+		/// Refreshes addresses used since the last lookup, forgets the others
+		void ZbResolver::handle_timer(shared_ptr<entry_type> entry, const error_code& error) {
+			if (error) return;
+
+			boost::mutex::scoped_lock lock(mutex_);
+			if (entry->resolving) return;
+
+			cache_type::iterator it = cache_.find(entry->host + ":" + entry->port);
+			if (entry->used && entry->endpoints.get() != 0 && boost::asio::deadline_timer::traits_type::now() < entry->expires) {
+				start_lookup(entry);
+			} else if (it != cache_.end() && it->second == entry) {
+				cache_.erase(it);
+			}
+		}
+	}
+}
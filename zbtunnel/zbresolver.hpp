@@ -0,0 +1,89 @@
+/******************************************************************************
+* The MIT License (MIT)
+*
+* Copyright (c) 2013 yufeiwu@gmail.com
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*******************************************************************************/
+
+#pragma once
+
+#include "zbtunnel/zbconfig.hpp"
+#include <boost/asio/deadline_timer.hpp>
+
+namespace zb {
+	namespace tunnel {
+
+		/************************
+		* Process wide cache of name lookups. Every address of a name is kept for
+		* dns_ttl seconds, failures for dns_negative_ttl. Concurrent lookups of a
+		* name share one query, and names in use are resolved again shortly before
+		* they expire, so warm tunnels never wait for the resolver. Addresses come
+		* with the families interleaved and the last one to connect first.
+		**/
+		class ZbResolver
+		{
+		public:
+			typedef vector<tcp::endpoint> endpoints_type;
+			typedef shared_ptr<const endpoints_type> endpoints_ptr;
+			typedef boost::function<void (const error_code&, endpoints_ptr)> handler_type;
+
+			static ZbResolver* get_instance();
+
+			/// handler runs on service with all addresses of host:port, or the error
+			void resolve(const string& host, const string& port, shared_ptr<io_service> service, const handler_type& handler);
+
+			/// Remembers the address of host:port that connected, later lookups return it first
+			void prefer(const string& host, const string& port, const tcp::endpoint& endpoint);
+
+		private:
+			typedef std::pair<shared_ptr<io_service>, handler_type> waiter_type;
+			typedef struct _entry_type {
+				string host, port;
+				endpoints_ptr endpoints;
+				tcp::endpoint preferred;
+				error_code error;
+				boost::posix_time::ptime expires;
+				bool resolving, used;
+				vector<waiter_type> waiters;
+				scoped_ptr<boost::asio::deadline_timer> timer;
+				_entry_type():resolving(false), used(false) {};
+			} entry_type;
+			typedef map<string, shared_ptr<entry_type> > cache_type;
+
+			explicit ZbResolver();
+			static void create_instance();
+			void run();
+			void start_lookup(shared_ptr<entry_type> entry);
+			void handle_resolve(shared_ptr<entry_type> entry, const error_code& error, tcp::resolver::iterator iterator, shared_ptr<tcp::resolver> resolver);
+			void handle_timer(shared_ptr<entry_type> entry, const error_code& error);
+			static void order(endpoints_type& endpoints, const tcp::endpoint& preferred);
+
+			static ZbResolver* instance_;
+			static boost::once_flag instance_flag_;
+
+			// Lookups and timers run on a loop of their own
+			io_service service_;
+			scoped_ptr<io_service::work> work_;
+			scoped_ptr<boost::thread> thread_;
+			cache_type cache_;
+			boost::mutex mutex_;
+		};
+	}
+}
@@ -27,12 +27,16 @@
 #include "zbtunnel/zbconfig.hpp"
 #include "zbtunnel/zbcoder.hpp"
 #include "zbtunnel/base64.h"
+#include "zbtunnel/zbresolver.hpp"
 
 #include <boost/asio/steady_timer.hpp>
 #include <boost/chrono/chrono.hpp>
 #ifdef WITH_OPENSSL
 #include <boost/asio/ssl.hpp>
 #endif
+#ifdef ZB_HAS_KTLS
+#include <openssl/kdf.h>
+#endif
 
 
 namespace zb {
@@ -69,6 +73,10 @@ namespace zb {
 				return *io_service_;
 			}
 
+			shared_ptr<io_service> service() {
+				return io_service_;
+			}
+
 			string last_error() {
 				return last_error_;
 			}
@@ -80,11 +88,29 @@ namespace zb {
 				return last_error_.empty();
 			}
 
+			/// The socket carrying this transport's payload unchanged, or null.
+			/// Layers which transform the payload have to return null.
+			virtual socket_ptr raw_socket() {
+				if (parent_.get() != 0)
+					return parent_->raw_socket();
+
+				return socket_ptr();
+			}
+
+			/// The socket at the bottom of the chain, whatever the layers above do with the payload
+			virtual socket_ptr lowest_socket() {
+				if (parent_.get() != 0)
+					return parent_->lowest_socket();
+
+				return socket_ptr();
+			}
+
 			virtual void async_connect(string host, string port, const connect_handler_type& handler) {};
 			virtual void async_connect(const tcp::endpoint& endpoint, const connect_handler_type& handler) {
 				async_connect(endpoint.address().to_string(), boost::lexical_cast<string>(endpoint.port()), handler);
 			}
-			virtual void handle_read_data(data_type data, size_t size) {};
+			/// Transforms received data in place and returns how much of it is payload
+			virtual size_t handle_read_data(data_type data, size_t size) {return size;};
 			virtual void handle_write_data(data_type data, size_t size) {};
 
 			virtual void close() {
@@ -114,7 +140,7 @@ namespace zb {
 				const read_handler_type& handler)
 			{
 				assert(parent_.get() != 0);
-				const read_handler_type& r = boost::bind(&ZbTransport::_read_handler, shared_from_this(), _1, _2, data, handler);
+				const read_handler_type& r = boost::bind(&ZbTransport::_read_handler, shared_from_this(), _1, _2, data, size, handler);
 				parent_->async_receive(data, size, r);
 			}
 
@@ -126,12 +152,19 @@ namespace zb {
 				async_receive(data, size, handler);
 			}
 
-			void _read_handler(const error_code& error, const size_t size, const data_type data, 
+			void _read_handler(const error_code& error, const size_t size, const data_type data, const size_t capacity,
 				const read_handler_type& handler)
 			{
-				if (!error)
-					handle_read_data(data, size);
-				invoke_callback(boost::bind(handler, error, size));		
+				size_t payload = size;
+				if (!error) {
+					payload = handle_read_data(data, size);
+					// The layer kept all of it, e.g. an iv, so there is nothing to hand up yet
+					if (payload == 0 && size > 0) {
+						async_receive(data, capacity, handler);
+						return;
+					}
+				}
+				invoke_callback(boost::bind(handler, error, payload));		
 			}
 
 			void _dummy_write_handler(const error_code& error, const size_t size) {}
@@ -299,15 +332,41 @@ namespace zb {
 		{
 		protected:
 			socket_ptr socket_;
-			scoped_ptr<tcp::resolver> resolver_;
+			// Read-ahead buffer, [ahead_pos_, ahead_end_) not handed out yet
+			vector<uint8_t> ahead_;
+			size_t ahead_pos_, ahead_end_;
+
+			// Connection attempts racing to the addresses of a host, the first to connect becomes socket_
+			typedef struct _race_type {
+				string host, port;
+				ZbResolver::endpoints_ptr endpoints;
+				size_t next, pending;
+				vector<socket_ptr> attempts;
+				scoped_ptr<boost::asio::deadline_timer> timer;
+				error_code error;
+				bool done;
+				connect_handler_type handler;
+				_race_type():next(0), pending(0), done(false) {};
+			} race_type;
+			shared_ptr<race_type> race_;
 
 		public:
 			typedef shared_ptr<ZbSocketTransport> pointer;
 
-			ZbSocketTransport(const socket_ptr& socket, shared_ptr<io_service> service):ZbTransport(ZbTransport::pointer()), socket_(socket) {
+			ZbSocketTransport(const socket_ptr& socket, shared_ptr<io_service> service):ZbTransport(ZbTransport::pointer()), socket_(socket), ahead_pos_(0), ahead_end_(0) {
 				io_service_ = service;
 			};
 
+			/// Reads up to size bytes at once and serves smaller reads from them, 0 turns it off
+			void read_ahead(size_t size) {
+				if (buffered() == 0) ahead_.resize(size);
+			}
+
+			/// Bytes read from the socket but not handed out yet
+			size_t buffered() {
+				return ahead_end_ - ahead_pos_;
+			}
+
 			const tcp::endpoint get_endpoint() {
 				assert(socket_.get() != 0);
 				return socket_->remote_endpoint();
@@ -322,19 +381,34 @@ namespace zb {
 				return socket_.get() != 0 && socket_->is_open();
 			}
 
+			virtual socket_ptr raw_socket() {
+				// Reading the socket directly would skip what is buffered
+				if (buffered() > 0)
+					return socket_ptr();
+
+				return socket_;
+			}
+
+			virtual socket_ptr lowest_socket() {
+				return socket_;
+			}
+
 			virtual void close() {
-				if (socket_.get() != 0 && socket_->is_open()) {
-					socket_->close();
+				if (race_.get() != 0) {
+					// Like closing a connecting socket, the handler learns it was aborted
+					connect_handler_type handler = race_->handler;
+					_end_race(race_);
+					invoke_callback(boost::bind(handler, make_error_code(boost::asio::error::operation_aborted)));
+				}
+				if (socket_.get() != 0) {
+					// Also stops a connect waiting for the resolver
+					if (socket_->is_open()) socket_->close();
 					socket_.reset();
 				}
 			}
 
 			virtual void async_connect(string host, string port, const connect_handler_type& handler) {
-				resolver_.reset(new tcp::resolver(*io_service_));
-				tcp::resolver::query socks_query(host, port, tcp::resolver::query::all_matching | tcp::resolver::query::numeric_service);
-			
-				gconf.log(gconf_type::DEBUG_SOCKS, gconf_type::ZBLOG_DEBUG, "ZbSocketTransport", string("Resolving ") + host + ":" + port);
-				resolver_->async_resolve(socks_query, boost::bind(&ZbSocketTransport::_handle_resolve, boost::static_pointer_cast<ZbSocketTransport>(shared_from_this()), _1, _2, handler));
+				ZbResolver::get_instance()->resolve(host, port, io_service_, boost::bind(&ZbSocketTransport::_handle_resolve, boost::static_pointer_cast<ZbSocketTransport>(shared_from_this()), _1, _2, host, port, handler));
 			};
 
 			virtual void async_connect(const tcp::endpoint& endpoint, const connect_handler_type& handler) {
@@ -345,21 +419,95 @@ namespace zb {
 				socket_->async_connect(endpoint, boost::bind(&ZbSocketTransport::_handle_connected, boost::static_pointer_cast<ZbSocketTransport>(shared_from_this()), _1, handler));
 			}
 
-			void _handle_resolve(const error_code& error, tcp::resolver::iterator iterator, const connect_handler_type& handler) {
+			void _handle_resolve(const error_code& error, ZbResolver::endpoints_ptr endpoints, string host, string port, const connect_handler_type& handler) {
 				if (error) {
 					last_error_ = error.message();
 					invoke_callback(boost::bind(handler, error));
 					return;
 				}
 
-				if (socket_.get() == 0 || socket_->is_open()) {
+				if (socket_.get() == 0) {
+					invoke_callback(boost::bind(handler, make_error_code(boost::asio::error::operation_aborted)));
+					return;
+				}
+
+				if (socket_->is_open() || race_.get() != 0) {
 					invoke_callback(boost::bind(handler, make_error_code(errc::connection_already_in_progress)));
 					return;
 				}
 
-				gconf.log(gconf_type::DEBUG_SOCKS, gconf_type::ZBLOG_DEBUG, "ZbSocketTransport", "Resolved");
-				boost::function<void (const error_code&, const tcp::resolver::iterator&)> h = boost::bind(&ZbSocketTransport::_handle_connected, boost::static_pointer_cast<ZbSocketTransport>(shared_from_this()), _1, handler);
-				boost::asio::async_connect(*socket_, iterator, h);
+				if (endpoints->size() == 1) {
+					async_connect(endpoints->front(), handler);
+					return;
+				}
+
+				// Start with the first address and add another each connect_delay, or as soon as one fails
+				race_.reset(new race_type());
+				race_->host = host;
+				race_->port = port;
+				race_->endpoints = endpoints;
+				race_->handler = handler;
+				race_->timer.reset(new boost::asio::deadline_timer(*io_service_));
+				_race_next(race_);
+			}
+
+			void _race_next(shared_ptr<race_type> race) {
+				size_t i = race->next++;
+				const tcp::endpoint& endpoint = (*race->endpoints)[i];
+				gconf.log(gconf_type::DEBUG_SOCKET, gconf_type::ZBLOG_DEBUG, "ZbSocketTransport", string("Attempting ") + endpoint.address().to_string() + " for " + race->host);
+
+				socket_ptr s(new tcp::socket(*io_service_));
+				race->attempts.push_back(s);
+				race->pending++;
+				s->async_connect(endpoint, boost::bind(&ZbSocketTransport::_handle_race_connected, boost::static_pointer_cast<ZbSocketTransport>(shared_from_this()), _1, race, i));
+
+				if (race->next < race->endpoints->size()) {
+					race->timer->expires_from_now(boost::posix_time::milliseconds(gconf.connect_delay()));
+					race->timer->async_wait(boost::bind(&ZbSocketTransport::_handle_race_timer, boost::static_pointer_cast<ZbSocketTransport>(shared_from_this()), _1, race));
+				}
+			}
+
+			void _handle_race_timer(const error_code& error, shared_ptr<race_type> race) {
+				if (error || race->done || race->next >= race->endpoints->size())
+					return;
+				_race_next(race);
+			}
+
+			void _handle_race_connected(const error_code& error, shared_ptr<race_type> race, size_t i) {
+				race->pending--;
+				if (race->done)
+					return;
+
+				if (error) {
+					race->error = error;
+					if (race->next < race->endpoints->size()) {
+						race->timer->cancel();
+						_race_next(race);
+					} else if (race->pending == 0) {
+						_end_race(race);
+						last_error_ = error.message();
+						_handle_connected(error, race->handler);
+					}
+					return;
+				}
+
+				// Keep the winner and drop the others
+				socket_ = race->attempts[i];
+				race->attempts[i].reset();
+				_end_race(race);
+				ZbResolver::get_instance()->prefer(race->host, race->port, (*race->endpoints)[i]);
+				_handle_connected(error, race->handler);
+			}
+
+			void _end_race(shared_ptr<race_type> race) {
+				race->done = true;
+				race->timer->cancel();
+				BOOST_FOREACH(socket_ptr& s, race->attempts) {
+					error_code ec;
+					if (s.get() != 0) s->close(ec);
+				}
+				race->attempts.clear();
+				if (race_ == race) race_.reset();
 			}
 
 			void _handle_connected(const error_code& error, const connect_handler_type& handler) {
@@ -377,30 +525,82 @@ namespace zb {
 					return;
 				}
 				gdebug(gconf_type::DEBUG_SOCKS, "ZbSocketTransport", string("Sending: ") + boost::lexical_cast<string>(size) + " bytes");
-				socket_->async_send(boost::asio::buffer(data, size), handler);
+				boost::asio::async_write(*socket_, boost::asio::buffer(data, size), handler);
 			};
 
 			virtual void async_receive(const data_type& data, const size_t& size,
 				const read_handler_type& handler)
 			{
+				// A zero sized read only stands for a post, e.g. from asio's ssl
+				if (size == 0 || buffered() > 0) {
+					size_t n = std::min(size, buffered());
+					if (n > 0) {
+						memcpy(data, ahead_.data() + ahead_pos_, n);
+						ahead_pos_ += n;
+					}
+					invoke_callback(boost::bind(handler, no_error_, n));
+					return;
+				}
+
 				if (socket_.get() == 0 || !socket_->is_open()) {
 					invoke_callback(boost::bind(handler, make_error_code(errc::connection_aborted), 0));
 					return;
 				}
+
+				if (size < ahead_.size()) {
+					socket_->async_read_some(boost::asio::buffer(ahead_), boost::bind(&ZbSocketTransport::_handle_read_ahead, boost::static_pointer_cast<ZbSocketTransport>(shared_from_this()), _1, _2, data, size, handler));
+					return;
+				}
 				socket_->async_read_some(boost::asio::buffer(data, size), handler);
 			};
+
+			void _handle_read_ahead(const error_code& error, size_t bytes, data_type data, size_t size, const read_handler_type& handler) {
+				size_t n = std::min(size, bytes);
+				memcpy(data, &ahead_[0], n);
+				ahead_pos_ = n;
+				ahead_end_ = bytes;
+				handler(n > 0 ? no_error_ : error, n);
+			}
 		}; // ZbSocketTransport
 
 		///////////////////////////////////////////
 		class ZbShadowTransport: public ZbTransport
 		{
 		protected:
+			enum {IV_MAX_SIZE = 32};
+
 			ZbCoderPool::coder_type coder_;
 			string method, key;
-			uint8_t buf[256];
+			uint8_t buf[256 + IV_MAX_SIZE];
+			// The peer's iv, collected from the first bytes received
+			uint8_t remote_iv_[IV_MAX_SIZE];
+			size_t remote_iv_size_;
+
+		#ifdef WITH_OPENSSL
+			// AEAD methods send [length][tag][payload][tag] chunks after a salt,
+			// so both directions go through buffers of this transport.
+			enum {MAX_PAYLOAD = 0x3fff, RBUF_SIZE = 2 * (2 + MAX_PAYLOAD + 2 * ZbAeadCoder::TAG_SIZE)};
+
+			typedef struct {
+				const uint8_t *data;
+				size_t size;
+				write_handler_type handler;
+			} write_request;
+
+			shared_ptr<ZbAeadStreamCoder> aead_;
+			// Sends queued while one is in flight go out together in the next one
+			std::vector<write_request> queued_, sending_;
+			std::vector<uint8_t> wbuf_, rbuf_;
+			bool writing_, completing_, salt_sent_, salt_received_;
+			// rbuf_ holds decrypted payload in [plain_pos_, plain_end_) and unparsed data in [rpos_, rend_)
+			size_t rpos_, rend_, plain_pos_, plain_end_, payload_size_;
+			data_type read_data_;
+			size_t read_size_;
+			read_handler_type read_handler_;
+		#endif
 
 		public:
-			ZbShadowTransport(pointer& parent, config_type& conf):ZbTransport(parent) {
+			ZbShadowTransport(pointer& parent, config_type& conf):ZbTransport(parent), remote_iv_size_(0) {
 				method = CONFIG_GET(conf, "method", "");
 				key = CONFIG_GET(conf, "key", THROW("shadow key missing"));
 
@@ -408,6 +608,23 @@ namespace zb {
 				assert(cp != 0);
 
 				coder_ = cp->get_coder(method, key);
+				if (coder_->iv_size() > 0)
+					coder_ = coder_->new_stream();
+				assert(coder_->iv_size() <= IV_MAX_SIZE);
+
+			#ifdef WITH_OPENSSL
+				if (coder_->tag_size() > 0) {
+					aead_ = boost::static_pointer_cast<ZbAeadStreamCoder>(coder_);
+					writing_ = completing_ = salt_sent_ = salt_received_ = false;
+					rpos_ = rend_ = plain_pos_ = plain_end_ = payload_size_ = 0;
+					read_data_ = 0;
+					read_size_ = 0;
+				}
+			#endif
+			}
+
+			virtual socket_ptr raw_socket() {
+				return socket_ptr();
 			}
 
 			virtual void async_connect(string host, string port, const connect_handler_type& handler) {
@@ -421,16 +638,43 @@ namespace zb {
 				uint8_t h = (uint8_t)(port_ >> 8), l = (uint8_t)(port_ & 0xff);
 				s << "\x03"  << (char)host.size() << host <<  h << l;
 				string s2 = s.str();
-				memcpy(buf, s2.data(), s2.size() < sizeof(buf) ? s2.size() : sizeof(buf));
-				async_send((const data_type)(buf), s2.size(), boost::bind(&ZbTransport::_dummy_write_handler, boost::static_pointer_cast<ZbShadowTransport>(shared_from_this()), _1, _2));
+			#ifdef WITH_OPENSSL
+				if (aead_.get() != 0) {
+					size_t size = std::min(s2.size(), sizeof(buf));
+					memcpy(buf, s2.data(), size);
+					async_send((const data_type)(buf), size, boost::bind(&ZbTransport::_dummy_write_handler, boost::static_pointer_cast<ZbShadowTransport>(shared_from_this()), _1, _2));
+					invoke_callback(boost::bind(handler, error_code()));
+					return;
+				}
+			#endif
+				// Stream ciphers send their iv in the clear ahead of the address
+				size_t iv_size = coder_->iv_size();
+				if (iv_size > 0)
+					memcpy(buf, coder_->encrypt_iv(), iv_size);
+				size_t size = std::min(s2.size(), sizeof(buf) - iv_size);
+				memcpy(buf + iv_size, s2.data(), size);
+				handle_write_data(buf + iv_size, size);
+				parent_->async_send((const data_type)(buf), iv_size + size, boost::bind(&ZbTransport::_dummy_write_handler, boost::static_pointer_cast<ZbShadowTransport>(shared_from_this()), _1, _2));
 
 				invoke_callback(boost::bind(handler, error_code()));
 			};
 
-			virtual void handle_read_data(data_type data, size_t size) {
+			virtual size_t handle_read_data(data_type data, size_t size) {
 				assert(coder_.get() != 0);
+				size_t iv_size = coder_->iv_size();
+				if (remote_iv_size_ < iv_size) {
+					size_t n = std::min(size, iv_size - remote_iv_size_);
+					memcpy(remote_iv_ + remote_iv_size_, data, n);
+					remote_iv_size_ += n;
+					size -= n;
+					memmove(data, data + n, size);
+					if (remote_iv_size_ < iv_size) return 0;
+					coder_->decrypt_iv(remote_iv_);
+				}
+
 				coder_->decrypt(data, data, size);
 				gdebug(gconf_type::DEBUG_SHADOW, "ZbShadowTransport", string("decoded: ") + string((char*)data, size));
+				return size;
 			};
 
 			virtual void handle_write_data(data_type data, size_t size) {
@@ -438,6 +682,189 @@ namespace zb {
 				gdebug(gconf_type::DEBUG_SHADOW, "ZbShadowTransport", string("encoded: ") + string((char*)data, size));
 				coder_->encrypt(data, data, size);
 			};
+
+		#ifdef WITH_OPENSSL
+			virtual void async_send(const data_type data, const size_t size,
+				const write_handler_type& handler)
+			{
+				if (aead_.get() == 0) {
+					ZbTransport::async_send(data, size, handler);
+					return;
+				}
+
+				write_request r = {data, size, handler};
+				queued_.push_back(r);
+				if (!writing_ && !completing_)
+					_flush_aead();
+			}
+
+			virtual void async_receive(const data_type& data, const size_t& size,
+				const read_handler_type& handler)
+			{
+				if (aead_.get() == 0) {
+					ZbTransport::async_receive(data, size, handler);
+					return;
+				}
+
+				read_data_ = data;
+				read_size_ = size;
+				read_handler_ = handler;
+				_deliver_aead();
+			}
+
+			/// Seals everything queued into wbuf_ as one send. Chunks are filled up to
+			/// MAX_PAYLOAD across the queued buffers, which are read directly with no
+			/// copy, and the length and payload of a chunk are sealed back to back.
+			void _flush_aead() {
+				sending_.swap(queued_);
+				size_t total = 0;
+				for (size_t i = 0; i < sending_.size(); i++)
+					total += sending_[i].size;
+
+				const size_t tag = ZbAeadCoder::TAG_SIZE;
+				size_t salt = salt_sent_ ? 0 : aead_->iv_size();
+				size_t chunks = (total + MAX_PAYLOAD - 1) / MAX_PAYLOAD;
+				size_t needed = salt + total + chunks * (2 + 2 * tag);
+				if (wbuf_.size() < needed)
+					wbuf_.resize(needed);
+
+				uint8_t *out = &wbuf_[0];
+				if (salt > 0) {
+					memcpy(out, aead_->encrypt_iv(), salt);
+					out += salt;
+					salt_sent_ = true;
+				}
+
+				size_t req = 0, req_pos = 0;
+				while (total > 0) {
+					size_t payload = std::min<size_t>(total, MAX_PAYLOAD);
+					uint8_t len[2] = {(uint8_t)(payload >> 8), (uint8_t)(payload & 0xff)};
+					aead_->seal_begin();
+					aead_->seal_update(len, out, 2);
+					aead_->seal_end(out + 2);
+					out += 2 + tag;
+
+					aead_->seal_begin();
+					for (size_t left = payload; left > 0;) {
+						size_t n = std::min(left, sending_[req].size - req_pos);
+						aead_->seal_update(sending_[req].data + req_pos, out, n);
+						out += n;
+						left -= n;
+						req_pos += n;
+						if (req_pos == sending_[req].size) {
+							req++;
+							req_pos = 0;
+						}
+					}
+					aead_->seal_end(out);
+					out += tag;
+					total -= payload;
+				}
+
+				writing_ = true;
+				parent_->async_send(&wbuf_[0], out - &wbuf_[0], boost::bind(&ZbShadowTransport::_handle_aead_write, boost::static_pointer_cast<ZbShadowTransport>(shared_from_this()), _1, _2));
+			}
+
+			void _handle_aead_write(const error_code& error, const size_t) {
+				writing_ = false;
+				// Sends made by the handlers are queued and flushed after the loop, in order
+				completing_ = true;
+				for (size_t i = 0; i < sending_.size(); i++)
+					sending_[i].handler(error, error ? 0 : sending_[i].size);
+				completing_ = false;
+				sending_.clear();
+
+				if (!queued_.empty())
+					_flush_aead();
+			}
+
+			/// Hands decrypted payload to the pending read, reading more from the parent
+			/// when rbuf_ does not hold a complete chunk. A chunk which fits the reader's
+			/// buffer is decrypted straight into it.
+			void _deliver_aead() {
+				const size_t tag = ZbAeadCoder::TAG_SIZE;
+
+				while (plain_pos_ == plain_end_) {
+					size_t avail = rend_ - rpos_;
+					uint8_t *p = rbuf_.empty() ? 0 : &rbuf_[rpos_];
+
+					if (!salt_received_) {
+						if (avail < aead_->iv_size()) break;
+						aead_->decrypt_iv(p);
+						rpos_ += aead_->iv_size();
+						salt_received_ = true;
+					} else if (payload_size_ == 0) {
+						if (avail < 2 + tag) break;
+						uint8_t len[2];
+						if (!aead_->open(p, len, 2, p + 2)) {
+							_fail_aead_read();
+							return;
+						}
+						size_t size = (len[0] << 8) | len[1];
+						rpos_ += 2 + tag;
+						if (size == 0 || size > MAX_PAYLOAD) {
+							_fail_aead_read("shadow chunk length out of range");
+							return;
+						}
+						payload_size_ = size;
+					} else {
+						if (avail < payload_size_ + tag) break;
+						if (payload_size_ <= read_size_) {
+							if (!aead_->open(p, read_data_, payload_size_, p + payload_size_)) {
+								_fail_aead_read();
+								return;
+							}
+							size_t n = payload_size_;
+							rpos_ += payload_size_ + tag;
+							payload_size_ = 0;
+							invoke_callback(boost::bind(read_handler_, error_code(), n));
+							return;
+						}
+
+						if (!aead_->open(p, p, payload_size_, p + payload_size_)) {
+							_fail_aead_read();
+							return;
+						}
+						plain_pos_ = rpos_;
+						plain_end_ = rpos_ + payload_size_;
+						rpos_ += payload_size_ + tag;
+						payload_size_ = 0;
+					}
+				}
+
+				if (plain_pos_ < plain_end_) {
+					size_t n = std::min(read_size_, plain_end_ - plain_pos_);
+					memcpy(read_data_, &rbuf_[plain_pos_], n);
+					plain_pos_ += n;
+					invoke_callback(boost::bind(read_handler_, error_code(), n));
+					return;
+				}
+
+				if (rbuf_.empty())
+					rbuf_.resize(RBUF_SIZE);
+				if (rpos_ > 0 && rbuf_.size() - rend_ < RBUF_SIZE / 2) {
+					memmove(&rbuf_[0], &rbuf_[rpos_], rend_ - rpos_);
+					rend_ -= rpos_;
+					plain_pos_ = plain_end_ = rpos_ = 0;
+				}
+				parent_->async_receive(&rbuf_[rend_], rbuf_.size() - rend_, boost::bind(&ZbShadowTransport::_handle_aead_read, boost::static_pointer_cast<ZbShadowTransport>(shared_from_this()), _1, _2));
+			}
+
+			void _handle_aead_read(const error_code& error, const size_t size) {
+				if (error) {
+					invoke_callback(boost::bind(read_handler_, error, 0));
+					return;
+				}
+
+				rend_ += size;
+				_deliver_aead();
+			}
+
+			void _fail_aead_read(const string& message = "shadow chunk failed authentication") {
+				last_error_ = message;
+				invoke_callback(boost::bind(read_handler_, make_error_code(errc::bad_message), 0));
+			}
+		#endif
 		}; // ZbShadowTransport
 
 		//////////////////////////////////////////
@@ -543,22 +970,109 @@ namespace zb {
 				ZbTransport::pointer p_;
 			};
 
+		/// An ssl context shared by all connections through one https or h2 hop.
+		/// It keeps the latest client session of every host:port, session ids and
+		/// TLS 1.3 tickets alike, so later handshakes take the abbreviated path.
+		class ZbSslContext
+		{
+		public:
+			typedef shared_ptr<ZbSslContext> pointer;
+
+			ZbSslContext(config_type& conf):full_(0), resumed_(0) {
+				string ssl_type = CONFIG_GET(conf, "ssl_type", "sslv23");
+				if (ssl_type.compare("tls1") == 0)
+					ctx_.reset(new boost::asio::ssl::context(boost::asio::ssl::context::tlsv1));
+				else
+					ctx_.reset(new boost::asio::ssl::context(boost::asio::ssl::context::sslv23));
+
+				// Sessions are only stored here, openssl's own cache is server side
+				SSL_CTX_set_session_cache_mode(ctx_->native_handle(), SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+				SSL_CTX_sess_set_new_cb(ctx_->native_handle(), &ZbSslContext::_new_session);
+				SSL_CTX_set_ex_data(ctx_->native_handle(), ctx_ex_index(), this);
+			}
+
+			~ZbSslContext() {
+				for (session_map::iterator it = sessions_.begin(); it != sessions_.end(); ++it)
+					SSL_SESSION_free(it->second);
+			}
+
+			boost::asio::ssl::context& context() {return *ctx_;}
+
+			/// Lets ssl resume the session of key, and keep the ones it gets
+			void prepare(SSL* ssl, const string* key) {
+				SSL_set_ex_data(ssl, ex_index(), (void*)key);
+				boost::mutex::scoped_lock lock(mutex_);
+				session_map::iterator it = sessions_.find(*key);
+				if (it != sessions_.end()) SSL_set_session(ssl, it->second);
+			}
+
+			void handshake_done(SSL* ssl) {
+				if (SSL_session_reused(ssl))
+					resumed_++;
+				else
+					full_++;
+			}
+
+			unsigned long full_handshakes() {return full_;}
+			unsigned long resumed_handshakes() {return resumed_;}
+
+		protected:
+			typedef map<string, SSL_SESSION*> session_map;
+
+			static int ex_index() {
+				static int index = SSL_get_ex_new_index(0, 0, 0, 0, 0);
+				return index;
+			}
+
+			static int ctx_ex_index() {
+				static int index = SSL_CTX_get_ex_new_index(0, 0, 0, 0, 0);
+				return index;
+			}
+
+			/// Called by openssl with every new session, a ticket may come any time after the handshake
+			static int _new_session(SSL* ssl, SSL_SESSION* session) {
+				const string* key = (const string*)SSL_get_ex_data(ssl, ex_index());
+				ZbSslContext* self = (ZbSslContext*)SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ctx_ex_index());
+				if (key == 0 || self == 0) return 0;
+	#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+				// TLS 1.3 may announce sessions which can't be resumed, before it every new session can
+				if (!SSL_SESSION_is_resumable(session)) return 0;
+	#endif
+
+				boost::mutex::scoped_lock lock(self->mutex_);
+				SSL_SESSION*& slot = self->sessions_[*key];
+				if (slot != 0) SSL_SESSION_free(slot);
+				slot = session;
+				// We own the reference now
+				return 1;
+			}
+
+			scoped_ptr<boost::asio::ssl::context> ctx_;
+			boost::mutex mutex_;
+			session_map sessions_;
+			boost::atomic<unsigned long> full_, resumed_;
+		};
+
 		class ZbHttpsTransport: public ZbHttpTransport
 		{
 		protected:
 			typedef boost::asio::ssl::stream<ZbTransportHolder> stream_type;
 			typedef shared_ptr<stream_type> stream_ptr;
 			stream_ptr stream_;
-			scoped_ptr<boost::asio::ssl::context> ctx;
+			ZbSslContext::pointer ctx;
 					ZbTransportHolder holder_;
+			string session_key_, alpn_;
+			// Records are done by the kernel once the keys are handed over, per direction
+			bool ktls_, ktls_tx_, ktls_rx_;
 
 		public:
-			ZbHttpsTransport(pointer& parent, config_type& conf):ZbHttpTransport(parent, conf) {
-				string ssl_type = CONFIG_GET(conf, "ssl_type", "sslv23");
-				if (ssl_type.compare("sslv23") == 0)
-					ctx.reset(new boost::asio::ssl::context(boost::asio::ssl::context::sslv23));
-				else if (ssl_type.compare("tls1") == 0)
-					ctx.reset(new boost::asio::ssl::context(boost::asio::ssl::context::tlsv1));
+			/// Without a shared ctx the connection gets one of its own
+			ZbHttpsTransport(pointer& parent, config_type& conf, ZbSslContext::pointer shared_ctx = ZbSslContext::pointer()):ZbHttpTransport(parent, conf), ctx(shared_ctx), ktls_tx_(false), ktls_rx_(false) {
+				if (ctx.get() == 0) ctx.reset(new ZbSslContext(conf));
+				ktls_ = (CONFIG_GET_INT(conf, "ktls", 0)) != 0;
+				string host = CONFIG_GET(conf, "host", "");
+				string port = CONFIG_GET(conf, "port", "");
+				session_key_ = host + ":" + port;
 			}
 
 			~ZbHttpsTransport() {
@@ -567,149 +1081,450 @@ namespace zb {
 				holder_.p();
 			}
 
+			virtual socket_ptr raw_socket() {
+				if (ktls_tx_ && ktls_rx_)
+					return parent_->raw_socket();
+
+				return socket_ptr();
+			}
+
+			/// Offers the protocols, in wire format, during the handshake
+			void alpn(const string& protos) {
+				alpn_ = protos;
+			}
+
+			/// The protocol the server picked, empty if none
+			string selected_alpn() {
+				const unsigned char* p = 0;
+				unsigned int len = 0;
+				if (stream_.get() != 0) SSL_get0_alpn_selected(stream_->native_handle(), &p, &len);
+				return p != 0 ? string((const char*)p, len) : string();
+			}
+
 			virtual void init(const connect_handler_type& handler) {
 				assert(stream_.get() == 0);
 				holder_.p(parent_);
-				stream_.reset(new stream_type(holder_, *ctx));
-				stream_->async_handshake(boost::asio::ssl::stream_base::client, handler);
+				stream_.reset(new stream_type(holder_, ctx->context()));
+				if (!alpn_.empty()) SSL_set_alpn_protos(stream_->native_handle(), (const unsigned char*)alpn_.data(), alpn_.size());
+				ctx->prepare(stream_->native_handle(), &session_key_);
+	#ifdef ZB_HAS_KTLS
+				// Only TLS 1.2 keys can be handed over, 1.3 has tickets in flight after the handshake
+				if (ktls_ && ktls_available()) {
+					SSL_set_max_proto_version(stream_->native_handle(), TLS1_2_VERSION);
+					SSL_set_options(stream_->native_handle(), SSL_OP_NO_RENEGOTIATION);
+				}
+	#endif
+				stream_->async_handshake(boost::asio::ssl::stream_base::client,
+					boost::bind(&ZbHttpsTransport::_handle_handshake, boost::static_pointer_cast<ZbHttpsTransport>(shared_from_this()), _1, handler));
+			}
+
+			void _handle_handshake(const error_code& error, const connect_handler_type& handler) {
+				if (!error) {
+					ctx->handshake_done(stream_->native_handle());
+					gconf.log(gconf_type::DEBUG_HTTP, gconf_type::ZBLOG_DEBUG, "ZbHttpsTransport", session_key_ + (SSL_session_reused(stream_->native_handle()) ? " resumed" : " full handshake") +
+						(format(", %d full and %d resumed so far") % ctx->full_handshakes() % ctx->resumed_handshakes()).str());
+	#ifdef ZB_HAS_KTLS
+					if (ktls_ && _enable_ktls())
+						gconf.log(gconf_type::DEBUG_HTTP, gconf_type::ZBLOG_DEBUG, "ZbHttpsTransport", session_key_ + " records offloaded to the kernel" +
+							(ktls_tx_ && ktls_rx_ ? "" : ktls_tx_ ? " for sending" : " for receiving"));
+	#endif
+				}
+				handler(error);
 			}
 
 			virtual void async_send(const data_type data,const size_t size,
 				const write_handler_type& handler)
 			{
-				stream_->async_write_some(boost::asio::buffer(data, size), handler);
+				if (ktls_tx_)
+					ZbTransport::async_send(data, size, handler);
+				else
+					boost::asio::async_write(*stream_, boost::asio::buffer(data, size), handler);
 			};
 
 			virtual void async_receive(const data_type& data, const size_t& size,
 				const read_handler_type& handler)
 			{
-				stream_->async_read_some(boost::asio::buffer(data, size), handler);
+				if (ktls_rx_)
+					ZbTransport::async_receive(data, size, handler);
+				else
+					stream_->async_read_some(boost::asio::buffer(data, size), handler);
 			};
+
+	#ifdef ZB_HAS_KTLS
+		protected:
+			/// Whether the kernel has the tls module, probed once
+			static bool ktls_available() {
+				static const bool available = _probe_ktls();
+				return available;
+			}
+
+			static bool _probe_ktls() {
+				int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+				if (fd < 0) return false;
+				// An unconnected socket is refused with ENOTCONN when the module is there, ENOENT when not
+				int r = ::setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls"));
+				bool available = r == 0 || errno == ENOTCONN;
+				::close(fd);
+				return available;
+			}
+
+			/// Hands the TLS 1.2 record keys of a fresh handshake to the kernel. The connection
+			/// stays with openssl, in the directions which fail, when it returns false.
+			bool _enable_ktls() {
+				ZbSocketTransport* tp = dynamic_cast<ZbSocketTransport*>(parent_.get());
+				SSL* ssl = stream_->native_handle();
+				// Only the outermost layer, and only with nothing buffered in openssl
+				if (tp == 0 || !ktls_available() || SSL_version(ssl) != TLS1_2_VERSION || SSL_pending(ssl) > 0 || BIO_ctrl_pending(SSL_get_rbio(ssl)) > 0 || tp->buffered() > 0)
+					return false;
+
+				int nid = SSL_CIPHER_get_cipher_nid(SSL_get_current_cipher(ssl));
+				size_t key_size, iv_size;
+				if (nid == NID_aes_128_gcm) {
+					key_size = 16;
+					iv_size = 4;
+				} else if (nid == NID_aes_256_gcm) {
+					key_size = 32;
+					iv_size = 4;
+	#ifdef TLS_CIPHER_CHACHA20_POLY1305
+				} else if (nid == NID_chacha20_poly1305) {
+					key_size = 32;
+					iv_size = 12;
+	#endif
+				} else {
+					return false;
+				}
+
+				// client key, server key, client iv, server iv, AEAD ciphers have no mac keys
+				uint8_t block[2 * 32 + 2 * 12];
+				size_t block_size = 2 * (key_size + iv_size);
+				int fd = tp->socket()->native_handle();
+				if (_key_block(ssl, block, block_size) && ::setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0) {
+					ktls_tx_ = _set_ktls_key(fd, TLS_TX, nid, block, block + 2 * key_size);
+					ktls_rx_ = _set_ktls_key(fd, TLS_RX, nid, block + key_size, block + 2 * key_size + iv_size);
+				}
+				OPENSSL_cleanse(block, sizeof(block));
+				return ktls_tx_ || ktls_rx_;
+			}
+
+			/// The TLS 1.2 key expansion of RFC 5246 6.3
+			static bool _key_block(SSL* ssl, uint8_t* out, size_t size) {
+				uint8_t master[SSL_MAX_MASTER_KEY_LENGTH];
+				size_t master_size = SSL_SESSION_get_master_key(SSL_get_session(ssl), master, sizeof(master));
+				uint8_t seed[13 + 2 * SSL3_RANDOM_SIZE];
+				memcpy(seed, "key expansion", 13);
+				SSL_get_server_random(ssl, seed + 13, SSL3_RANDOM_SIZE);
+				SSL_get_client_random(ssl, seed + 13 + SSL3_RANDOM_SIZE, SSL3_RANDOM_SIZE);
+
+				EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, 0);
+				bool ok = pctx != 0 && EVP_PKEY_derive_init(pctx) > 0
+					&& EVP_PKEY_CTX_set_tls1_prf_md(pctx, SSL_CIPHER_get_handshake_digest(SSL_get_current_cipher(ssl))) > 0
+					&& EVP_PKEY_CTX_set1_tls1_prf_secret(pctx, master, master_size) > 0
+					&& EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, seed, sizeof(seed)) > 0
+					&& EVP_PKEY_derive(pctx, out, &size) > 0;
+				EVP_PKEY_CTX_free(pctx);
+				OPENSSL_cleanse(master, sizeof(master));
+				return ok;
+			}
+
+			static bool _set_ktls_key(int fd, int direction, int nid, const uint8_t* key, const uint8_t* iv) {
+				union {
+					tls12_crypto_info_aes_gcm_128 gcm128;
+					tls12_crypto_info_aes_gcm_256 gcm256;
+	#ifdef TLS_CIPHER_CHACHA20_POLY1305
+					tls12_crypto_info_chacha20_poly1305 chacha;
+	#endif
+				} info;
+				memset(&info, 0, sizeof(info));
+				// Both Finished messages went out with sequence number 0. The explicit
+				// nonce only has to be unique, the sequence number will do.
+				static const uint8_t seq[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+				size_t size = 0;
+
+				if (nid == NID_aes_128_gcm) {
+					info.gcm128.info.version = TLS_1_2_VERSION;
+					info.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+					memcpy(info.gcm128.key, key, sizeof(info.gcm128.key));
+					memcpy(info.gcm128.salt, iv, sizeof(info.gcm128.salt));
+					memcpy(info.gcm128.iv, seq, sizeof(info.gcm128.iv));
+					memcpy(info.gcm128.rec_seq, seq, sizeof(info.gcm128.rec_seq));
+					size = sizeof(info.gcm128);
+				} else if (nid == NID_aes_256_gcm) {
+					info.gcm256.info.version = TLS_1_2_VERSION;
+					info.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+					memcpy(info.gcm256.key, key, sizeof(info.gcm256.key));
+					memcpy(info.gcm256.salt, iv, sizeof(info.gcm256.salt));
+					memcpy(info.gcm256.iv, seq, sizeof(info.gcm256.iv));
+					memcpy(info.gcm256.rec_seq, seq, sizeof(info.gcm256.rec_seq));
+					size = sizeof(info.gcm256);
+	#ifdef TLS_CIPHER_CHACHA20_POLY1305
+				} else if (nid == NID_chacha20_poly1305) {
+					info.chacha.info.version = TLS_1_2_VERSION;
+					info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+					memcpy(info.chacha.key, key, sizeof(info.chacha.key));
+					memcpy(info.chacha.iv, iv, sizeof(info.chacha.iv));
+					memcpy(info.chacha.rec_seq, seq, sizeof(info.chacha.rec_seq));
+					size = sizeof(info.chacha);
+	#endif
+				}
+
+				bool ok = size > 0 && ::setsockopt(fd, SOL_TLS, direction, &info, size) == 0;
+				OPENSSL_cleanse(&info, sizeof(info));
+				return ok;
+			}
+	#endif // ZB_HAS_KTLS
 		}; // ZbHttpsTransport
 	#endif // WITH_OPENSSL
 
 		////////////////////////////////////////
+		/// SOCKS5 client (RFC 1928) with username/password auth (RFC 1929). With pipeline
+		/// the greeting, auth and CONNECT go out in one write once the target is known,
+		/// and the stacked replies are read back in one go, so a hop costs one round trip.
 		class ZbSocks5Transport: public ZbTransport
 		{
 		protected:
+			enum {BUFSIZE = 512};
 			string username, password;
-			uint8_t req[64];
-			uint8_t buf[64];
-			size_t pos;
+			bool pipeline;
+			vector<uint8_t> req;
+			// Replies, [done, pos) not parsed yet. Once connected it is payload the server sent along.
+			uint8_t buf[BUFSIZE];
+			size_t pos, done;
 			enum {INIT, GREETING, AUTH, STANDBY, CONNECTING, CONNECTED} state;
 
 		public:
-			ZbSocks5Transport(pointer& parent, config_type& conf):ZbTransport(parent),state(INIT), pos(0) {
+			ZbSocks5Transport(pointer& parent, config_type& conf):ZbTransport(parent), pos(0), done(0), state(INIT) {
 				username = CONFIG_GET(conf, "username", "");
 				password = CONFIG_GET(conf, "password", "");
+				pipeline = (CONFIG_GET_INT(conf, "pipeline", 0)) != 0;
 			}
 
 			virtual void init(const connect_handler_type& handler) {
-				std::stringstream s;
-				size_t l = 0;
-				if (username.empty()) {
-					memcpy(req, "\x05\x01\x00", 3);
-					l = 3;
-				} else {
-					memcpy(req, "\x05\x02\x00\x02", 4);
-					l = 4;
-				}
-				state = GREETING;
-				async_send(req, l, boost::bind(&ZbTransport::_dummy_write_handler, boost::static_pointer_cast<ZbSocks5Transport>(shared_from_this()), _1, _2));
-				pos = 0;
-				async_receive(buf, sizeof(buf), boost::bind(&ZbSocks5Transport::_handle_socks, boost::static_pointer_cast<ZbSocks5Transport>(shared_from_this()), _1, _2, 2, handler));
-			}
-
-			void _handle_socks(const error_code& error, const size_t size, const size_t target_size, const connect_handler_type& handler) {
-				if (error) {
-					last_error_ = error.message();
-					invoke_callback(boost::bind(handler, error));
+				if (username.size() > 255 || password.size() > 255) {
+					last_error_ = string("Username or password too long.");
+					invoke_callback(boost::bind(handler, make_error_code(errc::invalid_argument)));
 					return;
 				}
 
-				pos += size;
-				if (pos < target_size) {
-					// Not enough bytes
-					async_receive(buf + pos, sizeof(buf) - pos, boost::bind(&ZbSocks5Transport::_handle_socks, boost::static_pointer_cast<ZbSocks5Transport>(shared_from_this()), _1, _2, target_size, handler));
+				if (pipeline) {
+					// Everything goes out with the CONNECT
+					state = STANDBY;
+					invoke_callback(boost::bind(handler, error_code()));
 					return;
 				}
 
-				if (state == GREETING) {
-					if (buf[0] != 5) {
-						last_error_ = string("Client uses version 5. But server requires version ") + boost::lexical_cast<string>(buf[0]);
-						invoke_callback(boost::bind(handler, make_error_code(errc::protocol_not_supported)));
-					}
+				req.clear();
+				_add_greeting();
+				state = GREETING;
+				_send_and_receive(handler);
+			}
 
-					if (buf[1] == 0xff) {
-						last_error_ = string("Server doesn't support our authentication method.");
-						invoke_callback(boost::bind(handler, make_error_code(errc::protocol_not_supported)));
-					} 
-					else if (buf[1] == 2) {
-						// Auth
-						state = AUTH;
-						std::stringstream s;
-						s << "\x01" << (char)username.size() << username << (char)password.size() << password;
-						string t = s.str();
-						memcpy(req, t.c_str(), t.size());
-						async_send(req, t.size(), boost::bind(&ZbTransport::_dummy_write_handler, boost::static_pointer_cast<ZbSocks5Transport>(shared_from_this()), _1, _2));
-						pos = 0;
-						async_receive(buf, sizeof(buf), boost::bind(&ZbSocks5Transport::_handle_socks, boost::static_pointer_cast<ZbSocks5Transport>(shared_from_this()), _1, _2, 2, handler));
-					} else {
-						// Done
-						state = STANDBY;
-						invoke_callback(boost::bind(handler, error_code()));
-					}
-				} else if (state == AUTH) {
-					if (buf[1] == 0) {
-						// Done
-						state = STANDBY;
-						invoke_callback(boost::bind(handler, error_code()));
-					} else {
-						last_error_ = string("Authentication failed.");
-						invoke_callback(boost::bind(handler, make_error_code(errc::permission_denied)));
-					}
-				} else if (state == CONNECTING) {
-					if (buf[2] == 0) {
-						// Consume remaining bytes
-						size_t tsize = 4;
-						if (buf[4] == 1) tsize += 4 + 2;
-						if (buf[4] == 4) tsize += 16 + 2;
-						if (buf[4] == 3) tsize += 1 + buf[5] + 2;
-						if (pos < tsize) {
-							async_receive(buf + pos, sizeof(buf) - pos, boost::bind(&ZbSocks5Transport::_handle_socks, boost::static_pointer_cast<ZbSocks5Transport>(shared_from_this()), _1, _2, tsize, handler));
-						}
+			virtual socket_ptr raw_socket() {
+				// Reading the socket directly would skip what came with the reply
+				if (done < pos)
+					return socket_ptr();
 
-						// Connected
-						state = CONNECTED;
-						invoke_callback(boost::bind(handler, error_code()));
-					}
+				return ZbTransport::raw_socket();
+			}
+
+			virtual void async_receive(const data_type& data, const size_t& size,
+				const read_handler_type& handler)
+			{
+				if (state == CONNECTED && done < pos) {
+					size_t n = std::min(size, pos - done);
+					memcpy(data, buf + done, n);
+					done += n;
+					invoke_callback(boost::bind(handler, no_error_, n));
+					return;
 				}
+				ZbTransport::async_receive(data, size, handler);
 			}
 
 			virtual void async_connect(string host, string port, const connect_handler_type& handler) {
-				if (host.empty() || port.empty()) {
+				if (host.empty() || port.empty() || host.size() > 255) {
 					last_error_ = string("Bad host:port");
 					invoke_callback(boost::bind(handler, make_error_code(errc::bad_address)));
+					return;
 				}
 
 				if (state != STANDBY) {
 					last_error_ = string("Handshake not succeeded yet.");
 					invoke_callback(boost::bind(handler, make_error_code(errc::operation_in_progress)));
+					return;
 				}
 
-				std::stringstream s;
+				req.clear();
+				if (pipeline) {
+					_add_greeting();
+					if (!username.empty()) _add_auth();
+				}
+
+				// Numeric addresses need no lookup on the server
+				error_code ec;
+				boost::asio::ip::address address = boost::asio::ip::address::from_string(host, ec);
+				uint8_t command[] = {5, 1, 0};
+				req.insert(req.end(), command, command + sizeof(command));
+				if (!ec && address.is_v4()) {
+					boost::asio::ip::address_v4::bytes_type b = address.to_v4().to_bytes();
+					req.push_back(1);
+					req.insert(req.end(), b.begin(), b.end());
+				} else if (!ec && address.is_v6()) {
+					boost::asio::ip::address_v6::bytes_type b = address.to_v6().to_bytes();
+					req.push_back(4);
+					req.insert(req.end(), b.begin(), b.end());
+				} else {
+					req.push_back(3);
+					req.push_back((uint8_t)host.size());
+					req.insert(req.end(), host.begin(), host.end());
+				}
 				int port_ = boost::lexical_cast<int>(port);
-				uint8_t h = (uint8_t)(port_ >> 8), l = (uint8_t)(port_ & 0xff);
-				s << (char)host.size() << host << h << l;
-				string tmp = s.str();
-				memcpy(req, "\x05\x01\x00\x03", 4);
-				memcpy(req + 4, tmp.c_str(), tmp.size());
-
-				state = CONNECTING;
-				async_send((const data_type)req, tmp.size() + 4, boost::bind(&ZbTransport::_dummy_write_handler, boost::static_pointer_cast<ZbSocks5Transport>(shared_from_this()), _1, _2));
-				// target to receive at least 6 bytes which will at least include the starting of address
-				pos = 0;
-				async_receive(buf, sizeof(buf), boost::bind(&ZbSocks5Transport::_handle_socks, boost::static_pointer_cast<ZbSocks5Transport>(shared_from_this()), _1, _2, 6, handler));
+				req.push_back((uint8_t)(port_ >> 8));
+				req.push_back((uint8_t)(port_ & 0xff));
+
+				state = pipeline ? GREETING : CONNECTING;
+				_send_and_receive(handler);
+			}
+
+		protected:
+			void _add_greeting() {
+				// Offer a single method with pipeline, the auth is sent before the server picks
+				if (username.empty()) {
+					uint8_t greeting[] = {5, 1, 0};
+					req.insert(req.end(), greeting, greeting + sizeof(greeting));
+				} else if (pipeline) {
+					uint8_t greeting[] = {5, 1, 2};
+					req.insert(req.end(), greeting, greeting + sizeof(greeting));
+				} else {
+					uint8_t greeting[] = {5, 2, 0, 2};
+					req.insert(req.end(), greeting, greeting + sizeof(greeting));
+				}
+			}
+
+			void _add_auth() {
+				req.push_back(1);
+				req.push_back((uint8_t)username.size());
+				req.insert(req.end(), username.begin(), username.end());
+				req.push_back((uint8_t)password.size());
+				req.insert(req.end(), password.begin(), password.end());
+			}
+
+			void _send_and_receive(const connect_handler_type& handler) {
+				async_send(&req[0], req.size(), boost::bind(&ZbTransport::_dummy_write_handler, boost::static_pointer_cast<ZbSocks5Transport>(shared_from_this()), _1, _2));
+				_parse(handler);
+			}
+
+			void _receive(const connect_handler_type& handler) {
+				if (pos == sizeof(buf)) {
+					// Only the unparsed bytes are kept
+					memmove(buf, buf + done, pos - done);
+					pos -= done;
+					done = 0;
+				}
+				ZbTransport::async_receive(buf + pos, sizeof(buf) - pos, boost::bind(&ZbSocks5Transport::_handle_socks, boost::static_pointer_cast<ZbSocks5Transport>(shared_from_this()), _1, _2, handler));
+			}
+
+			void _handle_socks(const error_code& error, const size_t size, const connect_handler_type& handler) {
+				if (error) {
+					last_error_ = error.message();
+					invoke_callback(boost::bind(handler, error));
+					return;
+				}
+
+				pos += size;
+				_parse(handler);
+			}
+
+			void _fail(const string& message, errc::errc_t code, const connect_handler_type& handler) {
+				last_error_ = message;
+				invoke_callback(boost::bind(handler, make_error_code(code)));
+			}
+
+			/// Consumes the replies received so far, reads more when one is incomplete
+			void _parse(const connect_handler_type& handler) {
+				for (;;) {
+					uint8_t* r = buf + done;
+					size_t n = pos - done;
+
+					if (state == GREETING) {
+						if (n < 2) break;
+						done += 2;
+						if (r[0] != 5) {
+							_fail(string("Client uses version 5. But server requires version ") + boost::lexical_cast<string>((int)r[0]), errc::protocol_not_supported, handler);
+							return;
+						}
+
+						// Only a method we offered will do
+						bool offered = r[1] == 0 ? !(pipeline && !username.empty()) : r[1] == 2 && !username.empty();
+						if (!offered) {
+							_fail("Server doesn't support our authentication method.", errc::protocol_not_supported, handler);
+							return;
+						}
+
+						if (r[1] == 2) {
+							state = AUTH;
+							if (!pipeline) {
+								req.clear();
+								_add_auth();
+								_send_and_receive(handler);
+								return;
+							}
+						} else if (pipeline) {
+							state = CONNECTING;
+						} else {
+							state = STANDBY;
+							invoke_callback(boost::bind(handler, error_code()));
+							return;
+						}
+					} else if (state == AUTH) {
+						if (n < 2) break;
+						done += 2;
+						if (r[1] != 0) {
+							_fail("Authentication failed.", errc::permission_denied, handler);
+							return;
+						}
+
+						if (pipeline) {
+							state = CONNECTING;
+						} else {
+							state = STANDBY;
+							invoke_callback(boost::bind(handler, error_code()));
+							return;
+						}
+					} else if (state == CONNECTING) {
+						// VER REP RSV ATYP BND.ADDR BND.PORT
+						if (n < 5) break;
+						if (r[0] != 5) {
+							_fail(string("Client uses version 5. But server requires version ") + boost::lexical_cast<string>((int)r[0]), errc::protocol_not_supported, handler);
+							return;
+						}
+						if (r[1] != 0) {
+							_fail(string("Server refused to connect: ") + boost::lexical_cast<string>((int)r[1]), r[1] == 2 ? errc::permission_denied : r[1] == 5 ? errc::connection_refused : errc::host_unreachable, handler);
+							return;
+						}
+
+						size_t size = 4 + 2;
+						if (r[3] == 1) {
+							size += 4;
+						} else if (r[3] == 4) {
+							size += 16;
+						} else if (r[3] == 3) {
+							size += 1 + r[4];
+						} else {
+							_fail("Bad address type in reply.", errc::protocol_error, handler);
+							return;
+						}
+						if (n < size) break;
+						done += size;
+
+						// Anything after the reply is payload
+						state = CONNECTED;
+						invoke_callback(boost::bind(handler, error_code()));
+						return;
+					} else {
+						return;
+					}
+				}
+
+				_receive(handler);
 			}
 		}; // ZbSocks5Transport
 	}
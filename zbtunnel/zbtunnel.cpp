@@ -3,23 +3,27 @@
 #include "zbtunnel/zbconnection.hpp"
 #include "zbtunnel/zbconnectionmanager.hpp"
 #include "zbtunnel/zbtransport.hpp"
+#include "zbtunnel/zbmux.hpp"
+#include "zbtunnel/zbupstream.hpp"
 
 namespace zb {
 	namespace tunnel {
 
-		ZbTunnel::ZbTunnel(string name):name_(name), running_(false)
+		ZbTunnel::ZbTunnel(string name):name_(name), running_(false), shared_service_(false), race_width_(1), races_(0), threads_(1), next_shard_(0)
 		{
 			io_service_.reset(new io_service());
 		}
 
-		ZbTunnel::ZbTunnel(string name, boost::shared_ptr<io_service>& io_service):name_(name), running_(false)
+		ZbTunnel::ZbTunnel(string name, boost::shared_ptr<io_service>& io_service):name_(name), running_(false), shared_service_(true), race_width_(1), races_(0), threads_(1), next_shard_(0)
 		{
 			this->io_service_ = io_service;
 		}
 
 		ZbTunnel::~ZbTunnel(void)
 		{
-			io_service_->stop();
+			// A loop handed in by the owner may still serve other tunnels
+			if (!shared_service_)
+				io_service_->stop();
 		}
 
 		void ZbTunnel::start_with_config(config_type& config)  throw (string){
@@ -28,7 +32,7 @@ namespace zb {
 			start_with_config(conf);
 		}
 	
-		void ZbTunnel::start_with_config(const ptree::ptree& config) throw (string) {
+		chain_config_type ZbTunnel::parse_chain(const ptree::ptree& config) {
 			chain_config_type chain_conf;
 
 			BOOST_FOREACH(ptree::ptree::value_type proxy, config) {
@@ -38,8 +42,27 @@ namespace zb {
 				}
 				chain_conf.push_back(conf);
 			}
+			return chain_conf;
+		}
+
+		/// An array of hops is a chain. An array of arrays of hops is a list of alternative
+		/// chains, with the tunnel settings in the first hop of the first chain.
+		void ZbTunnel::start_with_config(const ptree::ptree& config) throw (string) {
+			vector<chain_config_type> chains;
+			bool alternatives = !config.empty() && !config.begin()->second.empty() && config.begin()->second.begin()->first.empty();
+			if (alternatives) {
+				BOOST_FOREACH(const ptree::ptree::value_type& node, config) {
+					chains.push_back(parse_chain(node.second));
+				}
+			} else {
+				chains.push_back(parse_chain(config));
+			}
 
-			start_with_config(chain_conf);
+			{
+				boost::mutex::scoped_lock lock(mutex_);
+				next_alternatives_.assign(chains.begin() + 1, chains.end());
+			}
+			start_with_config(chains[0]);
 		}
 
 		void ZbTunnel::start_with_config(chain_config_type& config) throw (string) {
@@ -55,27 +78,35 @@ namespace zb {
 		void ZbTunnel::worker() {
 			assert(io_service_.get() != 0);
 			gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_DEBUG, "ZbTunnel", name_ + ": Worker started");
-			io_service_->reset();
-			while(!io_service_->stopped()) {
+			run_service(io_service_);
+			gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_WARN, "ZbTunnel", name_ + ": service exited");
+			worker_.reset();
+		}
+
+		void ZbTunnel::run_service(shared_ptr<io_service> service) {
+			service->reset();
+			while(!service->stopped()) {
 				try {
-					io_service_->run();
+					service->run();
 				}
 				catch (const string& e) {
 					gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_WARN, "ZbTunnel", name_ + ": " + e);
-					last_error_ = e;
+					report_error(e);
 				}
 	#ifndef DEBUG
 				catch (const std::exception& e) {
 					gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_WARN, "ZbTunnel", name_ + ": " + e.what());
-					last_error_ = e.what();
+					report_error(e.what());
 				}
 				catch (...) {
 					gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_WARN, "ZbTunnel", name_ + ": worker crashed");
 				}
 	#endif
 			}
-			gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_WARN, "ZbTunnel", name_ + ": service exited");
-			worker_.reset();
+		}
+
+		void ZbTunnel::report_error(const string& error) {
+			io_service_->post(boost::bind(&ZbTunnel::set_last_error, shared_from_this(), error));
 		}
 
 		void ZbTunnel::start_worker() {
@@ -87,6 +118,10 @@ namespace zb {
 		void ZbTunnel::wait() {
 			if (worker_.get() && !io_service_->stopped())
 				worker_->join();
+
+			BOOST_FOREACH(shared_ptr<boost::thread>& t, shard_workers_) {
+				if (t.get() != 0) t->join();
+			}
 		}
 
 		void ZbTunnel::stop() {
@@ -102,6 +137,11 @@ namespace zb {
 			if (manager_.get() != 0) {
 				manager_->stop_all();
 			}
+
+			for (size_t i = 1; i < services_.size(); i++) {
+				services_[i]->post(boost::bind(&ZbConnectionManager::stop_all, managers_[i]));
+				works_[i].reset();
+			}
 		}
 
 		void ZbTunnel::init() {
@@ -109,30 +149,199 @@ namespace zb {
 				manager_.reset(new ZbConnectionManager(name_));
 			}
 
+			if (services_.empty()) {
+				services_.push_back(io_service_);
+				managers_.push_back(manager_);
+				works_.push_back(shared_ptr<io_service::work>());
+				shard_workers_.push_back(shared_ptr<boost::thread>());
+			}
+
+			init_chains();
 			init_coders();
+			init_ssl_contexts();
+			init_upstreams();
 			_init();
 		}
 
+		/// Make sure there are as many running event loops as threads.
+		/// Loops are never removed, surplus ones just get no new connections.
+		void ZbTunnel::init_shards(int threads) {
+			// A tunnel on a loop handed in, like the io_threads pool, keeps the thread count of its owner
+			if (shared_service_ && threads > 1) {
+				gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_WARN, "ZbTunnel", name_ + ": threads is ignored on a shared event loop");
+				threads = 1;
+			}
+			threads_ = threads < 1 ? 1 : threads;
+			next_shard_ = 0;
+
+			for (size_t i = 1; i < threads_; i++) {
+				if (i >= services_.size()) {
+					services_.push_back(shared_ptr<io_service>(new io_service()));
+					managers_.push_back(shared_ptr<ZbConnectionManager>(new ZbConnectionManager(name_ + "/" + boost::lexical_cast<string>(i))));
+					works_.push_back(shared_ptr<io_service::work>());
+					shard_workers_.push_back(shared_ptr<boost::thread>());
+				}
+
+				if (works_[i].get() == 0) {
+					if (shard_workers_[i].get() != 0) shard_workers_[i]->join();
+					works_[i].reset(new io_service::work(*services_[i]));
+					shard_workers_[i].reset(new boost::thread(boost::bind(&ZbTunnel::run_service, shared_from_this(), services_[i])));
+					gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_DEBUG, "ZbTunnel", name_ + ": Event loop " + boost::lexical_cast<string>(i) + " started");
+				}
+			}
+		}
+
+		size_t ZbTunnel::next_shard() {
+			size_t shard = next_shard_;
+			next_shard_ = (next_shard_ + 1) % threads_;
+			return shard;
+		}
+
+		/// Only on shard 0
+		ZbTunnel::shard_type ZbTunnel::shard(size_t i) {
+			shard_type s;
+			s.service = services_[i];
+			s.manager = managers_[i];
+			return s;
+		}
+
 		void ZbTunnel::init_coders() {
 			ZbCoderPool* cp = ZbCoderPool::get_instance();
 			assert(cp != 0);
 
-			BOOST_FOREACH(chain_config_type::value_type& conf, config_) {
-				string transport = CONFIG_GET(conf, "transport", "");
-				if (transport.compare("shadow") == 0) {
-					string method = CONFIG_GET(conf, "method", "");
-					string key = CONFIG_GET(conf, "key", "");
-					if (key.empty()) continue;
-					cp->get_coder(method, key);
+			for (size_t n = 0; n < chains(); n++) {
+				BOOST_FOREACH(config_type conf, *chain(n)) {
+					string transport = CONFIG_GET(conf, "transport", "");
+					if (transport.compare("shadow") == 0) {
+						string method = CONFIG_GET(conf, "method", "");
+						string key = CONFIG_GET(conf, "key", "");
+						if (key.empty()) continue;
+						cp->get_coder(method, key);
+					}
 				}
 			}
 		}
 
+		void ZbTunnel::init_ssl_contexts() {
+#ifdef WITH_OPENSSL
+			vector<vector<ZbSslContext::pointer> > contexts(chains());
+			vector<chain_config_type> configs;
+			for (size_t n = 0; n < chains(); n++) {
+				chain_config_type config = *chain(n);
+				configs.push_back(config);
+				for (size_t i = 0; i < config.size(); i++) {
+					config_type& conf = config[i];
+					string transport = CONFIG_GET(conf, "transport", "");
+					if (transport.compare("https") != 0 && transport.compare("h2") != 0) {
+						contexts[n].push_back(ZbSslContext::pointer());
+					} else if (n < ssl_contexts_.size() && i < ssl_contexts_[n].size() && ssl_contexts_[n][i].get() != 0 && ssl_configs_[n][i] == conf) {
+						// Keep the sessions
+						contexts[n].push_back(ssl_contexts_[n][i]);
+					} else {
+						contexts[n].push_back(ZbSslContext::pointer(new ZbSslContext(conf)));
+					}
+				}
+			}
+
+			boost::mutex::scoped_lock lock(mutex_);
+			ssl_contexts_.swap(contexts);
+			ssl_configs_.swap(configs);
+#endif
+		}
+
+		/// Takes over config_ and the alternative chains of the last config. The race
+		/// statistics start over when the number of chains changed.
+		void ZbTunnel::init_chains() {
+			int width = config_.empty() ? 1 : CONFIG_GET_INT(config_[0], "race", 2);
+
+			vector<chain_ptr> snapshots;
+			snapshots.push_back(chain_ptr(new chain_config_type(config_)));
+
+			boost::mutex::scoped_lock lock(mutex_);
+			BOOST_FOREACH(chain_config_type& alternative, next_alternatives_) {
+				snapshots.push_back(chain_ptr(new chain_config_type(alternative)));
+			}
+			chains_.swap(snapshots);
+			if (race_stats_.size() != chains_.size()) race_stats_.assign(chains_.size(), race_stats_type());
+			race_width_ = std::max(width, 1);
+		}
+
+		vector<size_t> ZbTunnel::race_candidates(vector<chain_ptr>& snapshots) {
+			boost::mutex::scoped_lock lock(mutex_);
+			vector<size_t> chains;
+			snapshots.clear();
+			if (race_stats_.size() <= 1) {
+				chains.push_back(0);
+				snapshots.push_back(chains_[0]);
+				return chains;
+			}
+
+			// Fewest expected seconds per win first, the chains not raced yet before all.
+			// The ones which never finished a race go last.
+			vector<std::pair<double, size_t> > ranked;
+			for (size_t i = 0; i < race_stats_.size(); i++) {
+				race_stats_type& s = race_stats_[i];
+				double key = s.races == 0 ? -1 : s.latency == 0 ? std::numeric_limits<double>::max() : s.latency * (s.races + 2) / (s.wins + 1);
+				ranked.push_back(std::make_pair(key, i));
+			}
+			std::stable_sort(ranked.begin(), ranked.end());
+
+			// Now and then race them all, so a chain which got better is noticed
+			size_t width = races_++ % RACE_ALL_EVERY == 0 ? ranked.size() : std::min(race_width_, ranked.size());
+			for (size_t i = 0; i < width; i++) {
+				chains.push_back(ranked[i].second);
+				snapshots.push_back(chains_[ranked[i].second]);
+			}
+			return chains;
+		}
+
+		void ZbTunnel::race_done(size_t i, bool won, chrono::steady_clock::duration elapsed) {
+			boost::mutex::scoped_lock lock(mutex_);
+			if (i >= race_stats_.size()) return;
+
+			race_stats_type& s = race_stats_[i];
+			double t = chrono::duration_cast<chrono::microseconds>(elapsed).count() / 1e6;
+			s.races++;
+			if (won) s.wins++;
+			s.latency = s.latency == 0 ? t : (EWMA_WEIGHT * t + (100 - EWMA_WEIGHT) * s.latency) / 100;
+		}
+
+		void ZbTunnel::race_cancelled(size_t i) {
+			boost::mutex::scoped_lock lock(mutex_);
+			if (i < race_stats_.size()) race_stats_[i].races++;
+		}
+
+		void ZbTunnel::init_upstreams() {
+			ZbUpstreams::pointer upstreams;
+			if (!config_.empty() && config_[0].count("upstreams")) {
+				upstreams.reset(new ZbUpstreams(config_[0]));
+				ZbUpstreams::pointer old = this->upstreams();
+				if (old.get() != 0) upstreams->inherit(*old);
+			}
+
+			boost::mutex::scoped_lock lock(mutex_);
+			upstreams_ = upstreams;
+		}
+
+#ifdef WITH_OPENSSL
+		void ZbTunnel::ssl_handshakes(unsigned long& full, unsigned long& resumed) {
+			boost::mutex::scoped_lock lock(mutex_);
+			full = resumed = 0;
+			BOOST_FOREACH(vector<ZbSslContext::pointer>& contexts, ssl_contexts_) {
+				BOOST_FOREACH(ZbSslContext::pointer& ctx, contexts) {
+					if (ctx.get() == 0) continue;
+					full += ctx->full_handshakes();
+					resumed += ctx->resumed_handshakes();
+				}
+			}
+		}
+#endif
+
 		///////////////////////////
-		ZbSocketTunnel::ZbSocketTunnel(string name):ZbTunnel(name), old_local_port_(0), local_port_(0) {
+		ZbSocketTunnel::ZbSocketTunnel(string name):ZbTunnel(name), old_local_port_(0), local_port_(0), reuse_port_(false), demux_(false) {
 		}
 
-		ZbSocketTunnel::ZbSocketTunnel(string name, shared_ptr<io_service>& io_service):ZbTunnel(name, io_service), old_local_port_(0), local_port_(0) {
+		ZbSocketTunnel::ZbSocketTunnel(string name, shared_ptr<io_service>& io_service):ZbTunnel(name, io_service), old_local_port_(0), local_port_(0), reuse_port_(false), demux_(false) {
 		}
 
 		ZbSocketTunnel::~ZbSocketTunnel() {
@@ -154,13 +363,41 @@ namespace zb {
 		}
 
 		void ZbSocketTunnel::_stop() {
-			if (acceptor_.get() != 0) {
-				gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_DEBUG, "ZbSocketTunnel", name_ + ": Acceptor stopped");
-				acceptor_->close();
-				acceptor_.reset();
+			for (size_t i = 0; i < acceptors_.size(); i++) {
+				close_acceptor(i);
 			}
 		}
 
+		void ZbSocketTunnel::close_acceptor(size_t listener) {
+			if (acceptors_[listener].get() == 0) return;
+
+			gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_DEBUG, "ZbSocketTunnel", name_ + ": Acceptor " + boost::lexical_cast<string>(listener) + " stopped");
+			if (listener == 0)
+				_close_acceptor(acceptors_[0]);
+			else
+				services_[listener]->post(boost::bind(&ZbSocketTunnel::_close_acceptor, acceptors_[listener]));
+			acceptors_[listener].reset();
+		}
+
+		void ZbSocketTunnel::_close_acceptor(acceptor_ptr acceptor) {
+			error_code ec;
+			acceptor->close(ec);
+		}
+
+		ZbSocketTunnel::acceptor_ptr ZbSocketTunnel::open_acceptor(size_t shard, const tcp::endpoint& endpoint) {
+			acceptor_ptr acceptor(new tcp::acceptor(*services_[shard]));
+			acceptor->open(endpoint.protocol());
+			acceptor->set_option(tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+			if (reuse_port_)
+				acceptor->set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
+			acceptor->bind(endpoint);
+			acceptor->listen();
+			acceptor->set_option(tcp::no_delay(true));
+			return acceptor;
+		}
+
 		void ZbSocketTunnel::_init() {
 			assert(manager_.get() != 0);
 			config_type& conf0 = config_[0];
@@ -170,61 +407,135 @@ namespace zb {
 			local_port_ = CONFIG_GET_INT(conf0, "local_port", 8080); 
 			local_address_ = CONFIG_GET(conf0, "local_address", "0.0.0.0"); 
 
-			manager_->preconnect(CONFIG_GET_INT(conf0, "preconnect", gconf.preconnect()));
-			manager_->max_reuse(CONFIG_GET_INT(conf0, "max_reuse", gconf.max_reuse()));
-			manager_->recycle((CONFIG_GET_INT(conf0, "recycle", gconf.recycle())) != 0);
-			manager_->kill_reusable();
+			init_shards(CONFIG_GET_INT(conf0, "threads", gconf.threads()));
+			init_manager(io_service_, manager_, conf0);
+			for (size_t i = 1; i < services_.size(); i++) {
+				services_[i]->post(boost::bind(&ZbSocketTunnel::init_manager, boost::static_pointer_cast<ZbSocketTunnel>(shared_from_this()), services_[i], managers_[i], conf0));
+			}
 
-			endpoint_cache_.reset();
+			demux_ = (CONFIG_GET_INT(conf0, "demux", 0)) != 0;
 
-			if (acceptor_.get() != 0 && (old_local_port_ != local_port_ || old_local_address_.compare(local_address_) != 0)) {
-				acceptor_->close();
+			bool old_reuse_port = reuse_port_;
+			reuse_port_ = (CONFIG_GET_INT(conf0, "reuse_port", gconf.reuse_port())) != 0;
+#ifndef SO_REUSEPORT
+			if (reuse_port_) {
+				gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_WARN, "ZbSocketTunnel", name_ + ": reuse_port is not supported on this platform");
+				reuse_port_ = false;
+			}
+#endif
+			size_t listeners = reuse_port_ ? threads_ : 1;
+			if (acceptors_.size() < listeners) acceptors_.resize(listeners);
+
+			bool changed = old_local_port_ != local_port_ || old_local_address_.compare(local_address_) != 0 || old_reuse_port != reuse_port_;
+			for (size_t i = 0; i < acceptors_.size(); i++) {
+				if (acceptors_[i].get() != 0 && (changed || i >= listeners || !acceptors_[i]->is_open()))
+					close_acceptor(i);
 			}
 
-			if (acceptor_.get() == 0 || !acceptor_->is_open()) {
+			if (acceptors_[0].get() == 0) {
 				try {
 					boost::asio::ip::address addr = boost::asio::ip::address::from_string(local_address_);				
-					acceptor_.reset(new tcp::acceptor(*io_service_, tcp::endpoint(addr, local_port_), true));
-					acceptor_->set_option(tcp::no_delay(true));
+					acceptors_[0] = open_acceptor(0, tcp::endpoint(addr, local_port_));
 					gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_DEBUG, "ZbSocketTunnel", name_ + ": Acceptor reseted");
 				} catch (std::exception& e) {
 					gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_WARN, "ZbSocketTunnel", name_ + ": Unable to bind to local address");
 					throw e;
 				}
 			}
+
+			// The other shards share the port of the first acceptor, which matters when local_port is 0
+			for (size_t i = 1; i < listeners; i++) {
+				if (acceptors_[i].get() != 0) continue;
+				try {
+					acceptors_[i] = open_acceptor(i, acceptors_[0]->local_endpoint());
+					services_[i]->post(boost::bind(&ZbSocketTunnel::start_accept, boost::static_pointer_cast<ZbSocketTunnel>(shared_from_this()), acceptors_[i], i, shard(i)));
+				} catch (std::exception& e) {
+					gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_WARN, "ZbSocketTunnel", name_ + ": Unable to open acceptor " + boost::lexical_cast<string>(i) + ": " + e.what());
+					acceptors_[i].reset();
+				}
+			}
+		}
+
+		void ZbSocketTunnel::init_manager(shared_ptr<io_service> service, shared_ptr<ZbConnectionManager> manager, config_type conf0) {
+			manager->preconnect(CONFIG_GET_INT(conf0, "preconnect", gconf.preconnect()));
+			manager->max_reuse(CONFIG_GET_INT(conf0, "max_reuse", gconf.max_reuse()));
+			manager->recycle((CONFIG_GET_INT(conf0, "recycle", gconf.recycle())) != 0);
+			manager->idle_timeout(CONFIG_GET_INT(conf0, "idle_timeout", gconf.idle_timeout()));
+			manager->splice((CONFIG_GET_INT(conf0, "splice", gconf.splice())) != 0);
+			manager->high_watermark(CONFIG_GET_INT(conf0, "high_watermark", gconf.high_watermark()));
+			manager->low_watermark(CONFIG_GET_INT(conf0, "low_watermark", gconf.low_watermark()));
+			manager->read_ahead(CONFIG_GET_INT(conf0, "read_ahead", gconf.read_ahead()));
+			manager->min_idle(CONFIG_GET_INT(conf0, "min_idle", gconf.min_idle()));
+			manager->max_idle(CONFIG_GET_INT(conf0, "max_idle", gconf.max_idle()));
+			manager->adaptive((CONFIG_GET_INT(conf0, "adaptive_preconnect", gconf.adaptive_preconnect())) != 0);
+			manager->mux(CONFIG_GET_INT(conf0, "mux", 0));
+			manager->kill_reusable();
+			manager->start_maintenance(service, shared_from_this());
 		}
 
 		void ZbSocketTunnel::start_accept()
 		{
-			if (!running_) return;
-			socket_ptr socket(new tcp::socket(*io_service_));
-			ZbSocketTransport::pointer tp(new ZbSocketTransport(socket, io_service_));
+			start_accept(acceptors_[0], 0, reuse_port_ ? shard(0) : shard_type());
+		}
+
+		/// Runs on the loop of the listener. A reuse_port acceptor keeps connections on
+		/// its own shard, the shared one, without one, hands them out round-robin from shard 0.
+		void ZbSocketTunnel::start_accept(acceptor_ptr acceptor, size_t listener, shard_type own)
+		{
+			if (!running_ || acceptor.get() == 0 || !acceptor->is_open()) return;
+			// The socket is created on the loop which is going to own the connection
+			shard_type target = own.service.get() != 0 ? own : shard(next_shard());
+			socket_ptr socket(new tcp::socket(*target.service));
+			ZbSocketTransport::pointer tp(new ZbSocketTransport(socket, target.service));
 		
-			acceptor_->async_accept(*socket,
-				boost::bind(&ZbSocketTunnel::handle_accept<ZbSocketTransport::pointer>, boost::static_pointer_cast<ZbSocketTunnel>(shared_from_this()), tp,
+			acceptor->async_accept(*socket,
+				boost::bind(&ZbSocketTunnel::handle_accept<ZbSocketTransport::pointer>, boost::static_pointer_cast<ZbSocketTunnel>(shared_from_this()), tp, acceptor, listener, own, target,
 					boost::asio::placeholders::error));
 
 			gdebug(gconf_type::DEBUG_TUNNEL, "ZbSocketTunnel", name_ + ": Accepting...");
 		}
 
 		template <typename SocketTransportPointer>
-		void ZbSocketTunnel::handle_accept(SocketTransportPointer& in,
+		void ZbSocketTunnel::handle_accept(SocketTransportPointer& in, acceptor_ptr acceptor, size_t listener, shard_type own, shard_type target,
 			const error_code& error)
 		{
 			if (!error)
 			{
 				gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_INFO, "ZbSocketTunnel", name_ + ": Accpeted a new connection ...");
-				assert(manager_.get() != 0);
 
-				ZbConnection::pointer conn = manager_->get_or_create_conn(io_service_, shared_from_this());
-				in->socket()->set_option(tcp::no_delay(true));
-				conn->start(boost::static_pointer_cast<ZbTransport>(in));
-				start_accept();
+				// The shared acceptor runs on shard 0
+				if (own.service.get() != 0 || target.service == io_service_)
+					start_connection(target, boost::static_pointer_cast<ZbTransport>(in));
+				else
+					target.service->post(boost::bind(&ZbSocketTunnel::start_connection, boost::static_pointer_cast<ZbSocketTunnel>(shared_from_this()), target, boost::static_pointer_cast<ZbTransport>(in)));
+				start_accept(acceptor, listener, own);
 			} else {
 				gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_WARN, "ZbSocketTunnel", name_ + ": Stop accepting:" + error.message());
 			}
 		}
 
+		void ZbSocketTunnel::start_connection(shard_type shard, shared_ptr<ZbTransport> in) {
+			assert(shard.manager.get() != 0);
+
+			boost::static_pointer_cast<ZbSocketTransport>(in)->socket()->set_option(tcp::no_delay(true));
+
+			if (demux_) {
+				ZbMuxSession::pointer session(new ZbMuxSession(shard.service, name_ + "/mux"));
+				shard.manager->add_session(session);
+				session->start(in, boost::bind(&ZbSocketTunnel::relay, boost::static_pointer_cast<ZbSocketTunnel>(shared_from_this()), shard, _1));
+				return;
+			}
+
+			relay(shard, in);
+		}
+
+		/// Relays an accepted connection, or a stream of a demultiplexed one, to a new or pooled chain
+		void ZbSocketTunnel::relay(shard_type shard, shared_ptr<ZbTransport> in) {
+			shared_ptr<ZbConnectionManager>& m = shard.manager;
+			ZbConnection::pointer conn = m->mux() > 0 ? m->get_mux_conn(shard.service, shared_from_this()) : m->get_or_create_conn(shard.service, shared_from_this());
+			conn->start(in);
+		}
+
 		///////////////////////////////////////
 		ZbIoTunnel::ZbIoTunnel(string name):ZbTunnel(name) {
 		}
@@ -25,12 +25,16 @@
 #pragma once
 
 #include "zbtunnel/headers.hpp"
+#include <boost/atomic.hpp>
 
 namespace zb {
 	namespace tunnel {
 
 		class ZbConnection;
 		class ZbConnectionManager;
+		class ZbTransport;
+		class ZbSslContext;
+		class ZbUpstreams;
 
 		class ZbTunnel:	public boost::enable_shared_from_this<ZbTunnel>
 		{
@@ -62,6 +66,8 @@ namespace zb {
 			void start_worker();
 
 			string last_error() {return last_error_;};
+			/// Keeps error as the last one. Safe on any event loop, last_error_ is only written on shard 0.
+			void report_error(const string& error);
 			shared_ptr<boost::thread> get_worker() {return worker_;};
 
 			boost::function<void ()> get_worker_func() {
@@ -71,22 +77,91 @@ namespace zb {
 			ZB_GETTER_SETTER(running, bool);
 			ZB_GETTER_SETTER(name, string);
 
+			/// The proxies the first hop balances over, null unless conf0 lists upstreams
+			shared_ptr<ZbUpstreams> upstreams() {boost::mutex::scoped_lock lock(mutex_); return upstreams_;};
+
+			/// The hops of chain i as of the last reload, null if there is no such chain. Chain 0 is config_
+			/// with the tunnel settings, the others are alternatives to race it. Connections keep the
+			/// snapshot they started with, a reload only replaces it for the next ones.
+			chain_ptr chain(size_t i) {boost::mutex::scoped_lock lock(mutex_); return i < chains_.size() ? chains_[i] : chain_ptr();};
+			size_t chains() {boost::mutex::scoped_lock lock(mutex_); return chains_.size();};
+			/// The chains to race for a new connection, the most promising first, with their snapshots
+			vector<size_t> race_candidates(vector<chain_ptr>& snapshots);
+			/// Chain i won the race it was in, or failed, after elapsed
+			void race_done(size_t i, bool won, chrono::steady_clock::duration elapsed);
+			/// Chain i was dropped unfinished when another one won, so its time is unknown
+			void race_cancelled(size_t i);
+
+#ifdef WITH_OPENSSL
+			/// The ssl context shared by the connections through hop of chain, null unless it is https or h2
+			shared_ptr<ZbSslContext> ssl_context(size_t chain, size_t hop) {
+				boost::mutex::scoped_lock lock(mutex_);
+				return chain < ssl_contexts_.size() && hop < ssl_contexts_[chain].size() ? ssl_contexts_[chain][hop] : shared_ptr<ZbSslContext>();
+			};
+			/// Full and resumed ssl handshakes through the hops, counted per context
+			void ssl_handshakes(unsigned long& full, unsigned long& resumed);
+#endif
+
 		protected:
 			void init();
 			virtual void _init() {throw string("not implmented");};
+			static chain_config_type parse_chain(const ptree::ptree& config);
 
 			void worker();
+			void run_service(shared_ptr<io_service> service);
+			void set_last_error(string error) {last_error_ = error;};
 			void init_coders();
+			void init_ssl_contexts();
+			void init_upstreams();
+			void init_chains();
+			void init_shards(int threads);
+			size_t next_shard();
+
+			/// The loop of a shard with its manager. Handlers on the other loops get it bound
+			/// in, since only shard 0 may look at the vectors below, which grow on a reload.
+			typedef struct _shard_type {
+				shared_ptr<io_service> service;
+				shared_ptr<ZbConnectionManager> manager;
+			} shard_type;
+			shard_type shard(size_t i);
 		
 			string last_error_;
 			string name_;
 
-			bool running_;
+			bool running_, shared_service_;
 			chain_config_type config_;
 			shared_ptr<ZbConnectionManager> manager_;
 			shared_ptr<boost::thread> worker_;
 			shared_ptr<io_service> io_service_;
-			shared_ptr<tcp::endpoint> endpoint_cache_;
+			boost::mutex mutex_;
+			shared_ptr<ZbUpstreams> upstreams_;
+
+			// Snapshots of config_ and the chains after it, taken over from next_alternatives_ by init().
+			// config_ is only used on shard 0, connections on any loop read the snapshots.
+			vector<chain_config_type> next_alternatives_;
+			vector<chain_ptr> chains_;
+			typedef struct _race_stats_type {
+				unsigned int races, wins;
+				double latency; // EWMA of seconds to win or fail, 0 before the first
+				_race_stats_type():races(0), wins(0), latency(0) {};
+			} race_stats_type;
+			// Every RACE_ALL_EVERY connections race all chains, weight of a new sample in percent
+			enum {RACE_ALL_EVERY = 16, EWMA_WEIGHT = 30};
+			vector<race_stats_type> race_stats_;
+			size_t race_width_, races_;
+#ifdef WITH_OPENSSL
+			// One per hop of every chain, kept over a reload if the hop didn't change
+			vector<vector<shared_ptr<ZbSslContext> > > ssl_contexts_;
+			vector<chain_config_type> ssl_configs_;
+#endif
+
+			// Event loops of the tunnel. Shard 0 is io_service_ with manager_, run by the worker.
+			// Every connection is pinned to the loop of its shard.
+			vector<shared_ptr<io_service> > services_;
+			vector<shared_ptr<ZbConnectionManager> > managers_;
+			vector<shared_ptr<io_service::work> > works_;
+			vector<shared_ptr<boost::thread> > shard_workers_;
+			size_t threads_, next_shard_;
 		};
 
 		/////////////////////////////////////
@@ -97,26 +172,37 @@ namespace zb {
 			ZbSocketTunnel(string name, shared_ptr<io_service>& io_service);
 			~ZbSocketTunnel();
 
-			string local_address() {return acceptor_.get() != 0 ? acceptor_->local_endpoint().address().to_string() : local_address_;};
-			int local_port() {return acceptor_.get() != 0 ? acceptor_->local_endpoint().port() : local_port_;};
+			string local_address() {return !acceptors_.empty() && acceptors_[0].get() != 0 ? acceptors_[0]->local_endpoint().address().to_string() : local_address_;};
+			int local_port() {return !acceptors_.empty() && acceptors_[0].get() != 0 ? acceptors_[0]->local_endpoint().port() : local_port_;};
 
 			virtual void _start_with_config(chain_config_type config) throw (string);
 			virtual void _start();
 			virtual void _stop();
 
 		protected:
+			typedef shared_ptr<tcp::acceptor> acceptor_ptr;
+
 			virtual void _init();
 			void start_accept();
+			void start_accept(acceptor_ptr acceptor, size_t listener, shard_type own);
 			template <typename SocketTransportPointer>
-			void handle_accept(SocketTransportPointer& in,  const error_code& error);
+			void handle_accept(SocketTransportPointer& in, acceptor_ptr acceptor, size_t listener, shard_type own, shard_type target, const error_code& error);
+			void start_connection(shard_type shard, shared_ptr<ZbTransport> in);
+			void relay(shard_type shard, shared_ptr<ZbTransport> in);
+			void init_manager(shared_ptr<io_service> service, shared_ptr<ZbConnectionManager> manager, config_type conf0);
+			acceptor_ptr open_acceptor(size_t shard, const tcp::endpoint& endpoint);
+			void close_acceptor(size_t listener);
+			static void _close_acceptor(acceptor_ptr acceptor);
 
 		private:
-			typedef scoped_ptr<tcp::acceptor> acceptor_ptr;
-
 			int local_port_, old_local_port_;
 			string local_address_, old_local_address_;
+			bool reuse_port_; // only used on shard 0, the other acceptors get their shard bound in
+			boost::atomic<bool> demux_; // accepted connections carry multiplexed streams, read on any loop
 
-			acceptor_ptr acceptor_;
+			// One acceptor on shard 0, or one per shard with reuse_port.
+			// The vector is only used on shard 0, the others get their acceptor bound into handlers.
+			vector<acceptor_ptr> acceptors_;
 		};
 
 		///////////////////////////////////////
@@ -0,0 +1,135 @@
+#include "zbtunnel/zbupstream.hpp"
+#include <boost/algorithm/string.hpp>
+
+namespace zb {
+	namespace tunnel {
+
+		ZbUpstreams::ZbUpstreams(config_type& conf):next_(0) {
+			string list = CONFIG_GET(conf, "upstreams", string());
+			string default_port = CONFIG_GET(conf, "port", string());
+			string balance = CONFIG_GET(conf, "balance", string("round_robin"));
+			max_fails_ = CONFIG_GET_INT(conf, "max_fails", 3);
+			fail_timeout_ = CONFIG_GET_INT(conf, "fail_timeout", 10);
+
+			if (balance.compare("round_robin") == 0)
+				balance_ = ROUND_ROBIN;
+			else if (balance.compare("least_conn") == 0)
+				balance_ = LEAST_CONN;
+			else if (balance.compare("latency") == 0)
+				balance_ = LATENCY;
+			else
+				throw string("unsupported balance: ") + balance;
+
+			vector<string> items;
+			boost::split(items, list, boost::is_any_of(", "), boost::token_compress_on);
+			BOOST_FOREACH(string& item, items) {
+				if (item.empty()) continue;
+
+				// host, host:port, [v6] or [v6]:port
+				upstream_ptr u(new upstream_type());
+				size_t colon = item.rfind(':');
+				if (item[0] == '[') {
+					size_t end = item.find(']');
+					if (end == string::npos) throw string("malformed upstream: ") + item;
+					u->host = item.substr(1, end - 1);
+					u->port = end + 1 < item.size() && item[end + 1] == ':' ? item.substr(end + 2) : default_port;
+				} else if (colon != string::npos) {
+					u->host = item.substr(0, colon);
+					u->port = item.substr(colon + 1);
+				} else {
+					u->host = item;
+					u->port = default_port;
+				}
+
+				if (u->host.empty() || u->port.empty()) throw string("malformed upstream: ") + item;
+				upstreams_.push_back(u);
+			}
+
+			if (upstreams_.empty()) throw string("no upstreams in: ") + list;
+		}
+
+		void ZbUpstreams::inherit(ZbUpstreams& old) {
+			boost::mutex::scoped_lock lock(old.mutex_);
+			BOOST_FOREACH(upstream_ptr& u, upstreams_) {
+				BOOST_FOREACH(upstream_ptr& o, old.upstreams_) {
+					if (o->host == u->host && o->port == u->port) {
+						u->fails = o->fails;
+						u->latency = o->latency;
+						u->down_until = o->down_until;
+						break;
+					}
+				}
+			}
+		}
+
+		bool ZbUpstreams::usable(upstream_ptr u, chrono::steady_clock::time_point now) {
+			return u->fails < max_fails_ || now >= u->down_until;
+		}
+
+		/// What latency minimizes, the unmeasured ones go first
+		double ZbUpstreams::load(upstream_ptr u) {
+			return u->latency * (u->active + 1);
+		}
+
+		ZbUpstreams::upstream_ptr ZbUpstreams::pick(const vector<upstream_ptr>& tried) {
+			boost::mutex::scoped_lock lock(mutex_);
+			chrono::steady_clock::time_point now = chrono::steady_clock::now();
+
+			upstream_ptr best;
+			for (int pass = 0; pass < 2 && best.get() == 0; pass++) {
+				if (pass == 1 && !tried.empty()) break;
+
+				// Start after the last pick, so ties go round
+				for (size_t n = 0; n < upstreams_.size(); n++) {
+					upstream_ptr& u = upstreams_[(next_ + n) % upstreams_.size()];
+					if (std::find(tried.begin(), tried.end(), u) != tried.end()) continue;
+					if (pass == 0 && !usable(u, now)) continue;
+
+					if (best.get() == 0
+						|| (balance_ == LEAST_CONN && u->active < best->active)
+						|| (balance_ == LATENCY && load(u) < load(best))) {
+						best = u;
+					}
+					if (balance_ == ROUND_ROBIN) break;
+				}
+			}
+
+			if (best.get() == 0) return best;
+
+			next_ = (std::find(upstreams_.begin(), upstreams_.end(), best) - upstreams_.begin() + 1) % upstreams_.size();
+			best->active++;
+			// Let one connection at a time probe an upstream out of rotation
+			if (best->fails >= max_fails_) best->down_until = now + chrono::seconds(fail_timeout_);
+			return best;
+		}
+
+		void ZbUpstreams::connected(upstream_ptr u, chrono::steady_clock::duration elapsed, bool sample) {
+			boost::mutex::scoped_lock lock(mutex_);
+			if (u->fails >= max_fails_) {
+				gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_INFO, "ZbUpstreams", u->host + ":" + u->port + " is back in rotation");
+			}
+			u->fails = 0;
+
+			if (!sample) return;
+			double t = chrono::duration_cast<chrono::microseconds>(elapsed).count() / 1e6;
+			u->latency = u->latency == 0 ? t : (EWMA_WEIGHT * t + (100 - EWMA_WEIGHT) * u->latency) / 100;
+		}
+
+		void ZbUpstreams::failed(upstream_ptr u) {
+			boost::mutex::scoped_lock lock(mutex_);
+			u->fails++;
+			if (u->fails >= max_fails_) {
+				u->down_until = chrono::steady_clock::now() + chrono::seconds(fail_timeout_);
+				if (u->fails == max_fails_) {
+					gconf.log(gconf_type::DEBUG_TUNNEL, gconf_type::ZBLOG_WARN, "ZbUpstreams", u->host + ":" + u->port + " failed " + boost::lexical_cast<string>(u->fails)
+						+ " times, out of rotation for " + boost::lexical_cast<string>(fail_timeout_) + "s");
+				}
+			}
+		}
+
+		void ZbUpstreams::release(upstream_ptr u) {
+			boost::mutex::scoped_lock lock(mutex_);
+			if (u->active > 0) u->active--;
+		}
+	}
+}
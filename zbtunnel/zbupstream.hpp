@@ -0,0 +1,88 @@
+/******************************************************************************
+* The MIT License (MIT)
+*
+* Copyright (c) 2013 yufeiwu@gmail.com
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*******************************************************************************/
+
+
+#pragma once
+
+#include "zbtunnel/zbconfig.hpp"
+#include <boost/chrono/chrono.hpp>
+
+namespace zb {
+	namespace tunnel {
+
+		/************************
+		* The equivalent proxies a tunnel's first hop may connect to, from the
+		* comma separated host:port list in its "upstreams". Each connection is
+		* given one by the "balance" strategy: round_robin, least_conn, or latency,
+		* which weighs the EWMA of the time to set up the first hop by the
+		* connections in use. An upstream failing max_fails times in a row sits out
+		* for fail_timeout seconds, then a single connection probes it again.
+		* Shared by the event loops of a tunnel.
+		**/
+		class ZbUpstreams
+		{
+		public:
+			typedef shared_ptr<ZbUpstreams> pointer;
+			typedef struct _upstream_type {
+				string host, port;
+				unsigned int active, fails;
+				double latency; // seconds, 0 until measured
+				chrono::steady_clock::time_point down_until;
+				_upstream_type():active(0), fails(0), latency(0) {};
+			} upstream_type;
+			typedef shared_ptr<upstream_type> upstream_ptr;
+
+			/// Throws a string on a malformed list or an unknown strategy
+			explicit ZbUpstreams(config_type& conf);
+
+			/// Carries the health and latency of the upstreams still listed over from old
+			void inherit(ZbUpstreams& old);
+
+			/// The upstream for a new connection other than the ones tried, null if none is left.
+			/// The first pick falls back to upstreams out of rotation rather than to none.
+			upstream_ptr pick(const vector<upstream_ptr>& tried);
+
+			/// The first hop through u is ready, after elapsed if it was set up from scratch
+			void connected(upstream_ptr u, chrono::steady_clock::duration elapsed, bool sample);
+			void failed(upstream_ptr u);
+			/// A connection given u is gone
+			void release(upstream_ptr u);
+
+			size_t size() {return upstreams_.size();};
+
+		private:
+			enum balance_type {ROUND_ROBIN, LEAST_CONN, LATENCY};
+			enum {EWMA_WEIGHT = 30}; // weight of a new latency sample, in percent
+
+			bool usable(upstream_ptr u, chrono::steady_clock::time_point now);
+			double load(upstream_ptr u);
+
+			vector<upstream_ptr> upstreams_;
+			balance_type balance_;
+			size_t next_;
+			unsigned int max_fails_, fail_timeout_;
+			boost::mutex mutex_;
+		};
+	}
+}